@@ -0,0 +1,23 @@
+#! /bin/bash
+# Replay the same traces against the system malloc and our allocator.
+# Usage: [CFLAGS=...] ./bench.sh [replay options] [trace ...]
+# (default traces: test*.txt, CFLAGS is passed when building libhw4.so)
+
+OPTIONS=()
+while [[ $# -gt 0 && $1 == -* ]]; do
+  OPTIONS+=("$1")
+  [[ $1 == -[ns] ]] && { shift; OPTIONS+=("$1"); }
+  shift
+done
+TRACES=("$@")
+[ ${#TRACES[@]} -eq 0 ] && TRACES=(test*.txt)
+
+gcc -O2 replay.c -o replay || exit 1
+gcc -O2 ${CFLAGS} -shared -fPIC hw4_111511141.c -o libhw4.so || exit 1
+
+for trace in "${TRACES[@]}"; do
+  echo "[1;34m===== ${trace}: system malloc =====[m"
+  ./replay "${OPTIONS[@]}" "${trace}"
+  echo "[1;35m===== ${trace}: hw4 allocator =====[m"
+  LD_PRELOAD=./libhw4.so ./replay "${OPTIONS[@]}" "${trace}"
+done
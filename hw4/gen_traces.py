@@ -0,0 +1,78 @@
+# Generate the synthetic A/D traces used by policies.sh
+# Usage: python3 gen_traces.py [output_dir]
+import os
+import random
+import sys
+
+POOL = 20000  # keep live bytes (plus 32-byte headers) inside the hw4 pool
+
+
+def emit(path, ops):
+    with open(path, "w") as f:
+        for op in ops:
+            f.write("\t".join(str(x) for x in op) + "\n")
+
+
+def churn(seed, n, size_of, live_target):
+    """Random allocs/frees keeping roughly live_target bytes alive."""
+    rng = random.Random(seed)
+    ops, live, next_id, live_bytes = [], {}, 1, 0
+    for _ in range(n):
+        if live and (live_bytes > live_target or rng.random() < 0.45):
+            victim = rng.choice(list(live))
+            live_bytes -= live.pop(victim) + 32
+            ops.append(("D", victim))
+        else:
+            size = size_of(rng)
+            live[next_id] = size
+            live_bytes += size + 32
+            ops.append(("A", next_id, size))
+            next_id += 1
+    for victim in live:
+        ops.append(("D", victim))
+    return ops
+
+
+def ramp(seed, rounds):
+    """Grow a batch of blocks, free every other one, then ask for bigger."""
+    rng = random.Random(seed)
+    ops, next_id = [], 1
+    for _ in range(rounds):
+        batch = []
+        for _ in range(24):
+            size = rng.randrange(100, 600)
+            ops.append(("A", next_id, size))
+            batch.append(next_id)
+            next_id += 1
+        for victim in batch[::2]:
+            ops.append(("D", victim))
+        for _ in range(6):
+            ops.append(("A", next_id, rng.randrange(600, 1200)))
+            batch.append(next_id)
+            next_id += 1
+        for victim in batch[1::2] + batch[24:]:
+            ops.append(("D", victim))
+    return ops
+
+
+def main():
+    out_dir = sys.argv[1] if len(sys.argv) > 1 else "traces"
+    os.makedirs(out_dir, exist_ok=True)
+    suites = {
+        "small_uniform": churn(1, 50000, lambda r: r.randrange(1, 256), 12000),
+        "mixed_uniform": churn(2, 50000, lambda r: r.randrange(1, 2048), 14000),
+        "bimodal": churn(
+            3, 50000,
+            lambda r: r.randrange(16, 64) if r.random() < 0.8
+            else r.randrange(1024, 3000), 14000),
+        "power_law": churn(
+            4, 50000, lambda r: min(int(r.paretovariate(1.2) * 24), 4000),
+            14000),
+        "ramp": ramp(5, 800),
+    }
+    for name, ops in suites.items():
+        emit(os.path.join(out_dir, name + ".txt"), ops)
+
+
+if __name__ == "__main__":
+    main()
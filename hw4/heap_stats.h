@@ -0,0 +1,42 @@
+#ifndef HEAP_STATS_H
+#define HEAP_STATS_H
+
+#include <stddef.h> // size_t
+
+#define HEAP_STATS_LEVELS 11 // same levels as the multi-level free lists
+
+// Snapshot of the hw4 allocator, every field is kept up to date by the
+// allocator itself so taking a snapshot never walks the heap.
+typedef struct heap_stats {
+    unsigned long free_chunks[HEAP_STATS_LEVELS]; // free chunks per level
+    size_t free_bytes[HEAP_STATS_LEVELS]; // free payload bytes per level
+    unsigned long total_free_chunks;
+    size_t total_free_bytes;
+    size_t largest_free;  // payload of the largest free chunk
+    double fragmentation; // 1 - largest_free / total_free_bytes
+    unsigned long used_chunks;
+    size_t used_bytes; // payload bytes of used chunks
+    size_t heap_top; // peak footprint: pool start to the end of the highest
+                     // chunk ever handed out
+    unsigned long quick_chunks; // freed chunks parked in the quick lists
+    size_t quick_bytes;         // their payload bytes
+
+    // event counters, cumulative over the whole process
+    unsigned long mallocs;
+    unsigned long frees;
+    unsigned long splits;
+    unsigned long coalesces;
+    unsigned long failed_allocs;
+    unsigned long quick_hits;     // mallocs served from a quick list
+    unsigned long consolidations; // quick lists flushed into the free lists
+} heap_stats_t;
+
+// Copy the current statistics into *stats. Async-signal-safe: returns 0 for a
+// consistent snapshot, -1 if it interrupted an allocator call (the copy is
+// then the state before that call finished updating it).
+int heap_get_stats(heap_stats_t* stats);
+
+// Write a human readable snapshot to fd. Async-signal-safe.
+void heap_dump_stats(int fd);
+
+#endif
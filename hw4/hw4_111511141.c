@@ -1,30 +1,125 @@
+#include <errno.h>    // EINVAL, ENOMEM
+#include <stdint.h>   // uintptr_t, SIZE_MAX
 #include <stdio.h>    // sprintf
 #include <stdlib.h>   // NULL, size_t
-#include <string.h>   // strlen
+#include <string.h>   // strlen, memcpy, memset
 #include <sys/mman.h> // mmap, munmap
 #include <unistd.h>   // write
 
+#include "heap_stats.h"
+
 // header struct (32 bytes)
 typedef struct header {
     size_t total_size; // Total size of the block (including header) (8 bytes)
     struct header* next_free; // Next in free list (8 bytes)
     struct header* prev_free; // Previous in free list (8 bytes)
     int is_free; // Flag indicating if the block is free (4 bytes), 1 for free,
-                 // 0 for used
-    char padding[4]; // Padding to make 32 bytes (4 bytes)
+                 // 0 for used, 2 for parked in a quick list (not coalesced)
+    int tree_height; // AVL height while in the size tree (FIT_ADDRESS_ORDERED),
+                     // otherwise just padding to make 32 bytes (4 bytes)
 } header_t;
 
 // Start of memory pool, if it's null -> never do the malloc
 void* pool_start = NULL;
-// Total size of memory pool (20,000 bytes)
-const size_t POOL_SIZE = 20000;
+// End of the highest chunk ever handed out (see mark_dirty)
+char* pool_dirty_end = NULL;
+// Total size of memory pool (20,000 bytes) and alignment size (32 bytes).
+// Macros too, for the tables sized by them.
+#define POOL_BYTES 20000
+#define ALIGN_BYTES 32
+const size_t POOL_SIZE = POOL_BYTES;
 const size_t HEADER_SIZE = sizeof(header_t); // Size of header (32 bytes)
-const size_t ALIGNMENT = 32;                 // Alignment size (32 bytes)
+const size_t ALIGNMENT = ALIGN_BYTES;
+
+// Placement policy, pick one at build time with -DFIT_POLICY=...
+// FIT_SEGREGATED: multi-level FIFO lists, best fit in the first level that
+//                 has one, ties go to the chunk freed first (default)
+// FIT_ADDRESS_ORDERED: every free chunk in one AVL tree keyed by
+//                 (size, address), best fit with ties going to the lowest
+//                 address, so reuse packs toward the start of the pool
+#define FIT_SEGREGATED 0
+#define FIT_ADDRESS_ORDERED 1
+#ifndef FIT_POLICY
+#define FIT_POLICY FIT_SEGREGATED
+#endif
 
 // multi-level free lists (11 levels)
 header_t* free_lists[11];
 header_t* free_list_tails[11]; // To track the tail of each free list
 
+// Root of the size tree, free chunks reuse next_free / prev_free as the
+// left / right child pointers while they are in it
+header_t* size_tree = NULL;
+
+// --- Quick lists ---
+
+// Freed chunks with at most QUICK_MAX_SIZE bytes of payload are parked in a
+// LIFO list per exact size instead of being coalesced, so the next malloc of
+// the same size pops them back without any split or merge. They are
+// consolidated (really freed) when a request can't be served or when they
+// hold more than QUICK_MAX_BYTES.
+// Off by default: parking changes which chunk best-fit picks, and with it the
+// "Max Free Chunk Size" the assignment checks. Build with
+// -DQUICK_MAX_SIZE=1024 to enable.
+#ifndef QUICK_MAX_SIZE
+#define QUICK_MAX_SIZE 0
+#endif
+#define QUICK_MAX_BYTES (POOL_BYTES / 4)
+#define QUICK_LISTS (QUICK_MAX_SIZE / ALIGN_BYTES + 1) // index = data size / 32
+
+header_t* quick_lists[QUICK_LISTS];
+size_t quick_bytes = 0; // total_size of everything parked in quick lists
+
+void release_chunk(header_t* chunk_to_free);
+void consolidate_quick_lists();
+
+// --- Statistics (see heap_stats.h) ---
+
+// Every chunk size is a multiple of ALIGNMENT up to POOL_SIZE
+#define SIZE_CLASSES (POOL_BYTES / ALIGN_BYTES + 1)
+
+// Free chunk count per total_size / 32, used to track the largest free chunk
+unsigned int free_class_count[SIZE_CLASSES];
+size_t largest_free_class = 0;
+
+heap_stats_t stats;
+// Odd while an allocator call is updating stats (sequence lock)
+volatile unsigned long stats_seq = 0;
+int stats_depth = 0;       // nesting of allocator calls (realloc -> malloc)
+int stats_dump_on_exit = 0; // HW4_HEAP_STATS is set
+
+void stats_enter() {
+    if (stats_depth++ == 0) stats_seq++;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+}
+
+void stats_leave() {
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    if (--stats_depth == 0) stats_seq++;
+}
+
+void stats_free_chunk_added(int level, size_t total_size) {
+    size_t size_class = total_size / ALIGNMENT;
+    stats.free_chunks[level]++;
+    stats.free_bytes[level] += total_size - HEADER_SIZE;
+    stats.total_free_chunks++;
+    stats.total_free_bytes += total_size - HEADER_SIZE;
+    free_class_count[size_class]++;
+    if (size_class > largest_free_class) largest_free_class = size_class;
+}
+
+void stats_free_chunk_removed(int level, size_t total_size) {
+    size_t size_class = total_size / ALIGNMENT;
+    stats.free_chunks[level]--;
+    stats.free_bytes[level] -= total_size - HEADER_SIZE;
+    stats.total_free_chunks--;
+    stats.total_free_bytes -= total_size - HEADER_SIZE;
+    free_class_count[size_class]--;
+    // The largest one is gone, step down to the next non-empty size class
+    while (largest_free_class > 0 && free_class_count[largest_free_class] == 0)
+        largest_free_class--;
+}
+
 int get_level(size_t data_size) {
     if (data_size < 0 || data_size > POOL_SIZE - HEADER_SIZE)
         return -1; // invalid size
@@ -52,6 +147,125 @@ int get_level(size_t data_size) {
         return 10; // >= 16384
 }
 
+// --- Size tree (FIT_ADDRESS_ORDERED) ---
+
+int tree_height(header_t* node) { return node ? node->tree_height : 0; }
+
+void tree_update(header_t* node) {
+    int left = tree_height(node->next_free);
+    int right = tree_height(node->prev_free);
+    node->tree_height = 1 + (left > right ? left : right);
+}
+
+// In-order position: by size, then by address
+int tree_less(header_t* a, header_t* b) {
+    return a->total_size < b->total_size ||
+           (a->total_size == b->total_size && a < b);
+}
+
+header_t* tree_rotate_right(header_t* node) {
+    header_t* left = node->next_free;
+    node->next_free = left->prev_free;
+    left->prev_free = node;
+    tree_update(node);
+    tree_update(left);
+    return left;
+}
+
+header_t* tree_rotate_left(header_t* node) {
+    header_t* right = node->prev_free;
+    node->prev_free = right->next_free;
+    right->next_free = node;
+    tree_update(node);
+    tree_update(right);
+    return right;
+}
+
+header_t* tree_balance(header_t* node) {
+    tree_update(node);
+    int balance = tree_height(node->next_free) - tree_height(node->prev_free);
+
+    if (balance > 1) { // left heavy
+        header_t* left = node->next_free;
+        if (tree_height(left->next_free) < tree_height(left->prev_free)) {
+            node->next_free = tree_rotate_left(left);
+        }
+        return tree_rotate_right(node);
+    }
+    if (balance < -1) { // right heavy
+        header_t* right = node->prev_free;
+        if (tree_height(right->prev_free) < tree_height(right->next_free)) {
+            node->prev_free = tree_rotate_right(right);
+        }
+        return tree_rotate_left(node);
+    }
+    return node;
+}
+
+header_t* tree_insert(header_t* root, header_t* chunk) {
+    if (root == NULL) {
+        chunk->next_free = NULL;
+        chunk->prev_free = NULL;
+        chunk->tree_height = 1;
+        return chunk;
+    }
+    if (tree_less(chunk, root)) {
+        root->next_free = tree_insert(root->next_free, chunk);
+    } else {
+        root->prev_free = tree_insert(root->prev_free, chunk);
+    }
+    return tree_balance(root);
+}
+
+// Detach the smallest node of the subtree into *min
+header_t* tree_remove_min(header_t* root, header_t** min) {
+    if (root->next_free == NULL) {
+        *min = root;
+        return root->prev_free;
+    }
+    root->next_free = tree_remove_min(root->next_free, min);
+    return tree_balance(root);
+}
+
+header_t* tree_remove(header_t* root, header_t* chunk) {
+    if (root == NULL) return NULL;
+
+    if (root != chunk) {
+        if (tree_less(chunk, root)) {
+            root->next_free = tree_remove(root->next_free, chunk);
+        } else {
+            root->prev_free = tree_remove(root->prev_free, chunk);
+        }
+        return tree_balance(root);
+    }
+
+    // Replace the removed node with its in-order successor
+    header_t* left = root->next_free;
+    header_t* right = root->prev_free;
+    if (right == NULL) return left;
+
+    header_t* successor;
+    right = tree_remove_min(right, &successor);
+    successor->next_free = left;
+    successor->prev_free = right;
+    return tree_balance(successor);
+}
+
+// Smallest chunk with total_size >= total_size, lowest address among equals
+header_t* tree_lower_bound(size_t total_size) {
+    header_t* best = NULL;
+    header_t* node = size_tree;
+    while (node != NULL) {
+        if (node->total_size >= total_size) {
+            best = node;
+            node = node->next_free;
+        } else {
+            node = node->prev_free;
+        }
+    }
+    return best;
+}
+
 void add_to_free_list(header_t* chunk) {
     if (chunk == NULL) return;
 
@@ -59,6 +273,12 @@ void add_to_free_list(header_t* chunk) {
     int level = get_level(data_size);
     if (level == -1) return; // invalid size
 
+#if FIT_POLICY == FIT_ADDRESS_ORDERED
+    size_tree = tree_insert(size_tree, chunk);
+    stats_free_chunk_added(level, chunk->total_size);
+    return;
+#endif
+
     header_t* tail = free_list_tails[level]; // Get current tail of the level
     chunk->next_free = NULL;
 
@@ -71,6 +291,8 @@ void add_to_free_list(header_t* chunk) {
         chunk->prev_free = tail;
         free_list_tails[level] = chunk; // update tail
     }
+
+    stats_free_chunk_added(level, chunk->total_size);
 }
 
 void init_pool() {
@@ -84,11 +306,30 @@ void init_pool() {
         return;
     }
 
+    pool_dirty_end = (char*)pool_start;
+
     // Initialize free lists (head and tail)
+    size_tree = NULL;
     for (int i = 0; i < 11; i++) {
         free_lists[i] = NULL;
         free_list_tails[i] = NULL;
+        stats.free_chunks[i] = 0;
+        stats.free_bytes[i] = 0;
     }
+    memset(free_class_count, 0, sizeof(free_class_count));
+    largest_free_class = 0;
+    stats.total_free_chunks = 0;
+    stats.total_free_bytes = 0;
+    stats.used_chunks = 0;
+    stats.quick_chunks = 0;
+    stats.quick_bytes = 0;
+
+    for (int i = 0; i < QUICK_LISTS; i++) {
+        quick_lists[i] = NULL;
+    }
+    quick_bytes = 0;
+
+    stats_dump_on_exit = getenv("HW4_HEAP_STATS") != NULL;
 
     // Create the initial free chunk that spans the entire pool
     header_t* initial_chunk = (header_t*)pool_start;
@@ -102,18 +343,15 @@ void init_pool() {
 }
 
 void handle_malloc_zero() {
-    size_t max = 0;
+    // Parked chunks count as free memory here
+    consolidate_quick_lists();
 
-    for (int i = 0; i < 11; i++) {
-        header_t* current = free_lists[i];
-        while (current != NULL) {
-            size_t current_size = current->total_size - HEADER_SIZE;
-            if (current_size > max) {
-                max = current_size;
-            }
-            current = current->next_free;
-        }
-    }
+    // Largest free chunk is tracked incrementally, no need to walk the lists
+    size_t max = largest_free_class ? largest_free_class * ALIGNMENT -
+                                          HEADER_SIZE
+                                    : 0;
+
+    if (stats_dump_on_exit) heap_dump_stats(STDERR_FILENO);
 
     // printf will call "malloc", so we use write syscall directly
     char buffer[50];
@@ -141,6 +379,10 @@ header_t* find_best_fit(size_t size) {
     int level = get_level(size);
     if (level == -1) return NULL; // invalid size
 
+#if FIT_POLICY == FIT_ADDRESS_ORDERED
+    return tree_lower_bound(size + HEADER_SIZE);
+#endif
+
     for (int i = level; i < 11; i++) {
         header_t* current = free_lists[i];
         header_t* best_fit = NULL;
@@ -169,6 +411,14 @@ void remove_from_free_list(header_t* chunk) {
     int level = get_level(data_size);
     if (level == -1) return; // invalid size
 
+#if FIT_POLICY == FIT_ADDRESS_ORDERED
+    size_tree = tree_remove(size_tree, chunk);
+    chunk->next_free = NULL;
+    chunk->prev_free = NULL;
+    stats_free_chunk_removed(level, chunk->total_size);
+    return;
+#endif
+
     header_t* prev = chunk->prev_free;
     header_t* next = chunk->next_free;
 
@@ -186,6 +436,47 @@ void remove_from_free_list(header_t* chunk) {
 
     chunk->next_free = NULL;
     chunk->prev_free = NULL;
+
+    stats_free_chunk_removed(level, chunk->total_size);
+}
+
+// Shrink a chunk to hold data_size bytes and give the tail back to the free
+// lists. The tail is merged with the next physical chunk if that one is free,
+// so callers that shrink a used chunk (realloc) keep the coalescing invariant.
+void split_chunk(header_t* chunk, size_t data_size) {
+    size_t remaining_size = chunk->total_size - (data_size + HEADER_SIZE);
+
+    // minimum block size is HEADER_SIZE + 32
+    if (remaining_size < (HEADER_SIZE + ALIGNMENT)) return;
+
+    // Create new free chunk (at the end of the original chunk)
+    header_t* new_free_chunk =
+        (header_t*)((char*)chunk + data_size + HEADER_SIZE);
+    new_free_chunk->total_size = remaining_size;
+    new_free_chunk->is_free = 1;
+    stats.splits++;
+
+    header_t* next_chunk =
+        (header_t*)((char*)new_free_chunk + new_free_chunk->total_size);
+    if ((void*)next_chunk < (void*)((char*)pool_start + POOL_SIZE) &&
+        next_chunk->is_free == 1) {
+        remove_from_free_list(next_chunk);
+        new_free_chunk->total_size += next_chunk->total_size;
+        stats.coalesces++;
+    }
+
+    // Add new free chunk back to free list
+    add_to_free_list(new_free_chunk);
+
+    // Update original chunk size
+    chunk->total_size = data_size + HEADER_SIZE;
+}
+
+// Everything above pool_dirty_end has never been handed out since the pool
+// was mmap'ed, so it is still zero-filled (calloc can skip the memset).
+void mark_dirty(header_t* chunk) {
+    char* end = (char*)chunk + chunk->total_size;
+    if (end > pool_dirty_end) pool_dirty_end = end;
 }
 
 void memory_allocation_state() {
@@ -228,40 +519,51 @@ void* malloc(size_t size) {
         init_pool();
     }
 
+    stats_enter();
+    stats.mallocs++;
+
     // 1. Calculate required size
     size_t rounded_data_size = round_up_to_32(size);
 
-    // 2. Find best
+    // 2. Exact-size quick list hit: no search, no split
+    if (rounded_data_size <= QUICK_MAX_SIZE &&
+        quick_lists[rounded_data_size / ALIGNMENT] != NULL) {
+        header_t* chunk = quick_lists[rounded_data_size / ALIGNMENT];
+        quick_lists[rounded_data_size / ALIGNMENT] = chunk->next_free;
+        chunk->next_free = NULL;
+        chunk->is_free = 0;
+        quick_bytes -= chunk->total_size;
+        stats.quick_chunks--;
+        stats.quick_bytes -= rounded_data_size;
+        stats.quick_hits++;
+        stats.used_chunks++;
+        stats_leave();
+        return (void*)((char*)chunk + HEADER_SIZE);
+    }
+
+    // 3. Find best, consolidating the quick lists once if nothing fits
     header_t* best_fit = find_best_fit(rounded_data_size);
+    if (best_fit == NULL && quick_bytes > 0) {
+        consolidate_quick_lists();
+        best_fit = find_best_fit(rounded_data_size);
+    }
     if (best_fit == NULL) {
+        stats.failed_allocs++;
+        stats_leave();
         return NULL; // Not enough memory
     }
 
-    // 3. Remove from free list
+    // 4. Remove from free list
     remove_from_free_list(best_fit);
 
-    // 4. Check if remaining space is enough for a new free chunk
-    size_t remaining_size =
-        best_fit->total_size - (rounded_data_size + HEADER_SIZE);
-
-    // minimum block size is HEADER_SIZE + 32
-    if (remaining_size >= (HEADER_SIZE + ALIGNMENT)) {
-        // Create new free chunk (at the end of the original chunk)
-        header_t* new_free_chunk =
-            (header_t*)((char*)best_fit + rounded_data_size + HEADER_SIZE);
-
-        new_free_chunk->total_size = remaining_size;
-        new_free_chunk->is_free = 1;
-
-        // Add new free chunk back to free list
-        add_to_free_list(new_free_chunk);
-
-        // Update original chunk size
-        best_fit->total_size = rounded_data_size + HEADER_SIZE;
-    }
+    // 5. Split off the tail if it is big enough for a new free chunk
+    split_chunk(best_fit, rounded_data_size);
 
     // 6. Mark as used and return
     best_fit->is_free = 0;
+    mark_dirty(best_fit);
+    stats.used_chunks++;
+    stats_leave();
 
     // For debugging: print memory allocation state
     // memory_allocation_state();
@@ -301,32 +603,377 @@ void free(void* ptr) {
     // 1. Get chunk header
     header_t* chunk_to_free = (header_t*)((char*)ptr - HEADER_SIZE);
 
-    // If already free, do nothing
+    // If already free (or parked in a quick list), do nothing
     if (chunk_to_free->is_free) {
         return;
     }
 
-    // 2. Mark as free
+    stats_enter();
+    stats.frees++;
+    stats.used_chunks--;
+
+    // 2. Small chunk: park it in its quick list, coalescing is deferred
+    size_t data_size = chunk_to_free->total_size - HEADER_SIZE;
+    if (data_size <= QUICK_MAX_SIZE) {
+        chunk_to_free->is_free = 2;
+        chunk_to_free->next_free = quick_lists[data_size / ALIGNMENT];
+        quick_lists[data_size / ALIGNMENT] = chunk_to_free;
+        quick_bytes += chunk_to_free->total_size;
+        stats.quick_chunks++;
+        stats.quick_bytes += data_size;
+        if (quick_bytes > QUICK_MAX_BYTES) consolidate_quick_lists();
+        stats_leave();
+        return;
+    }
+
+    release_chunk(chunk_to_free);
+    stats_leave();
+}
+
+// Mark a used (or parked) chunk free, merge it with its free physical
+// neighbours and put the result in the free lists
+void release_chunk(header_t* chunk_to_free) {
+    // 1. Mark as free
     chunk_to_free->is_free = 1;
 
-    // 3. Try to merge with next physical chunk
+    // 2. Try to merge with next physical chunk
     header_t* next_chunk =
         (header_t*)((char*)chunk_to_free + chunk_to_free->total_size);
 
     if ((void*)next_chunk < (void*)((char*)pool_start + POOL_SIZE) &&
-        next_chunk->is_free) {
+        next_chunk->is_free == 1) {
         remove_from_free_list(next_chunk);
         chunk_to_free->total_size += next_chunk->total_size;
+        stats.coalesces++;
     }
 
-    // 4. Try to merge with previous physical chunk
+    // 3. Try to merge with previous physical chunk
     header_t* prev_chunk = find_prev_phys(chunk_to_free);
-    if (prev_chunk != NULL && prev_chunk->is_free) {
+    if (prev_chunk != NULL && prev_chunk->is_free == 1) {
         remove_from_free_list(prev_chunk);
         prev_chunk->total_size += chunk_to_free->total_size;
         chunk_to_free = prev_chunk; // Update to the merged chunk
+        stats.coalesces++;
     }
 
-    // 5. Add the (possibly merged) chunk back to free list
+    // 4. Add the (possibly merged) chunk back to free list
     add_to_free_list(chunk_to_free);
-}
\ No newline at end of file
+}
+
+// Really free everything parked in the quick lists
+void consolidate_quick_lists() {
+    if (quick_bytes == 0) return;
+
+    for (int i = 0; i < QUICK_LISTS; i++) {
+        header_t* chunk = quick_lists[i];
+        quick_lists[i] = NULL;
+        while (chunk != NULL) {
+            header_t* next = chunk->next_free;
+            release_chunk(chunk);
+            chunk = next;
+        }
+    }
+    quick_bytes = 0;
+    stats.quick_chunks = 0;
+    stats.quick_bytes = 0;
+    stats.consolidations++;
+}
+
+// Return the header of ptr if it points into the pool, NULL otherwise
+header_t* pool_chunk(void* ptr) {
+    if (ptr == NULL || pool_start == NULL) return NULL;
+    if (ptr < pool_start || ptr >= (void*)((char*)pool_start + POOL_SIZE)) {
+        return NULL;
+    }
+    return (header_t*)((char*)ptr - HEADER_SIZE);
+}
+
+size_t malloc_usable_size(void* ptr) {
+    header_t* chunk = pool_chunk(ptr);
+    if (chunk == NULL || chunk->is_free) return 0;
+    return chunk->total_size - HEADER_SIZE;
+}
+
+void* realloc(void* ptr, size_t size) {
+    // malloc(0) is the "print and release" hook, never reach it from here
+    if (ptr == NULL) return malloc(size == 0 ? 1 : size);
+    if (size == 0) {
+        free(ptr);
+        return NULL;
+    }
+
+    header_t* chunk = pool_chunk(ptr);
+    if (chunk == NULL || chunk->is_free) return NULL; // not ours
+    if (size > POOL_SIZE - HEADER_SIZE) return NULL;
+
+    size_t rounded_data_size = round_up_to_32(size);
+    size_t old_data_size = chunk->total_size - HEADER_SIZE;
+
+    // 1. Shrink (or same size): split the tail off in place
+    if (rounded_data_size <= old_data_size) {
+        stats_enter();
+        split_chunk(chunk, rounded_data_size);
+        stats_leave();
+        return ptr;
+    }
+
+    // 2. Grow in place by absorbing the next physical chunk if it is free
+    header_t* next_chunk = (header_t*)((char*)chunk + chunk->total_size);
+    if ((void*)next_chunk < (void*)((char*)pool_start + POOL_SIZE) &&
+        next_chunk->is_free == 2) {
+        // Parked in a quick list, flush them so it can be absorbed
+        stats_enter();
+        consolidate_quick_lists();
+        stats_leave();
+    }
+    if ((void*)next_chunk < (void*)((char*)pool_start + POOL_SIZE) &&
+        next_chunk->is_free == 1 &&
+        old_data_size + next_chunk->total_size >= rounded_data_size) {
+        stats_enter();
+        remove_from_free_list(next_chunk);
+        chunk->total_size += next_chunk->total_size;
+        stats.coalesces++;
+        split_chunk(chunk, rounded_data_size);
+        mark_dirty(chunk);
+        stats_leave();
+        return ptr;
+    }
+
+    // 3. Move: allocate, copy, free
+    void* new_ptr = malloc(size);
+    if (new_ptr == NULL) return NULL; // old block is left untouched
+    memcpy(new_ptr, ptr, old_data_size);
+    free(ptr);
+    return new_ptr;
+}
+
+// Kept out of line: GCC folds malloc() followed by memset(0) into a call to
+// calloc(), which at -O2 would make calloc below call itself
+__attribute__((noinline)) void zero_fill(void* ptr, size_t size) {
+    memset(ptr, 0, size);
+}
+
+void* calloc(size_t nmemb, size_t size) {
+    if (size != 0 && nmemb > SIZE_MAX / size) return NULL; // overflow
+    size_t total = nmemb * size;
+    if (total == 0) total = 1; // don't trigger the malloc(0) hook
+
+    // Remember the watermark before malloc moves it
+    int was_fresh_pool = (pool_start == NULL);
+    char* dirty_end = pool_dirty_end;
+
+    void* ptr = malloc(total);
+    if (ptr == NULL) return NULL;
+
+    // A chunk that starts at or above the old watermark is fresh mmap memory
+    header_t* chunk = (header_t*)((char*)ptr - HEADER_SIZE);
+    if (was_fresh_pool || (char*)chunk >= dirty_end) return ptr;
+
+    zero_fill(ptr, total);
+    return ptr;
+}
+
+void* memalign(size_t alignment, size_t size) {
+    // alignment must be a power of two
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) return NULL;
+    // Every chunk payload is already 32-byte aligned
+    if (alignment <= ALIGNMENT) return malloc(size == 0 ? 1 : size);
+
+    if (pool_start == NULL) init_pool();
+    if (size > POOL_SIZE - HEADER_SIZE) return NULL;
+
+    size_t rounded_data_size = round_up_to_32(size == 0 ? 1 : size);
+
+    // 1. Worst case we skip (alignment - 32) bytes, plus room for a leading
+    // free chunk of at least HEADER_SIZE + 32 bytes
+    size_t slack = alignment + HEADER_SIZE;
+    if (rounded_data_size > POOL_SIZE - HEADER_SIZE - slack) return NULL;
+
+    stats_enter();
+    stats.mallocs++;
+    header_t* chunk = find_best_fit(rounded_data_size + slack);
+    if (chunk == NULL && quick_bytes > 0) {
+        consolidate_quick_lists();
+        chunk = find_best_fit(rounded_data_size + slack);
+    }
+    if (chunk == NULL) {
+        stats.failed_allocs++;
+        stats_leave();
+        return NULL;
+    }
+    remove_from_free_list(chunk);
+
+    // 2. Find the first aligned payload that leaves either nothing or a
+    // valid free chunk in front of it
+    uintptr_t data = (uintptr_t)chunk + HEADER_SIZE;
+    uintptr_t aligned = (data + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    while (aligned != data && aligned - data < HEADER_SIZE + ALIGNMENT) {
+        aligned += alignment;
+    }
+
+    // 3. Give the leading gap back (the chunk before it is never free)
+    if (aligned != data) {
+        size_t gap = aligned - data;
+        header_t* aligned_chunk = (header_t*)(aligned - HEADER_SIZE);
+        aligned_chunk->total_size = chunk->total_size - gap;
+        chunk->total_size = gap;
+        chunk->is_free = 1;
+        add_to_free_list(chunk);
+        chunk = aligned_chunk;
+        stats.splits++;
+    }
+
+    // 4. Trim the tail and hand it out
+    split_chunk(chunk, rounded_data_size);
+    chunk->is_free = 0;
+    mark_dirty(chunk);
+    stats.used_chunks++;
+    stats_leave();
+
+    return (void*)((char*)chunk + HEADER_SIZE);
+}
+
+int posix_memalign(void** memptr, size_t alignment, size_t size) {
+    if (alignment < sizeof(void*) || (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+    void* ptr = memalign(alignment, size);
+    if (ptr == NULL) return ENOMEM;
+    *memptr = ptr;
+    return 0;
+}
+
+void* aligned_alloc(size_t alignment, size_t size) {
+    return memalign(alignment, size);
+}
+
+void* valloc(size_t size) { return memalign(sysconf(_SC_PAGESIZE), size); }
+
+void* pvalloc(size_t size) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    return memalign(page, (size + page - 1) & ~(page - 1));
+}
+
+// --- Statistics API ---
+
+int heap_get_stats(heap_stats_t* out) {
+    // Retry while an allocator call is in the middle of an update. Inside a
+    // signal handler that interrupted the allocator the writer can't make
+    // progress, so give up after a few tries and report it.
+    int consistent = 0;
+    for (int attempt = 0; attempt < 4 && !consistent; attempt++) {
+        unsigned long seq = stats_seq;
+        __atomic_signal_fence(__ATOMIC_SEQ_CST);
+        *out = stats;
+        out->largest_free = largest_free_class
+                                ? largest_free_class * ALIGNMENT - HEADER_SIZE
+                                : 0;
+        __atomic_signal_fence(__ATOMIC_SEQ_CST);
+        consistent = (seq % 2 == 0 && seq == stats_seq);
+    }
+
+    // Everything that is neither free/parked payload nor a header is used
+    out->used_bytes = 0;
+    if (pool_start != NULL) {
+        out->used_bytes = POOL_SIZE - out->total_free_bytes -
+                          out->quick_bytes -
+                          (out->total_free_chunks + out->quick_chunks +
+                           out->used_chunks) *
+                              HEADER_SIZE;
+    }
+    out->heap_top = pool_start ? pool_dirty_end - (char*)pool_start : 0;
+    out->fragmentation =
+        out->total_free_bytes
+            ? 1.0 - (double)out->largest_free / out->total_free_bytes
+            : 0.0;
+
+    return consistent ? 0 : -1;
+}
+
+// sprintf is not async-signal-safe, build the dump by hand
+void append_str(char* buffer, size_t* len, const char* str) {
+    while (*str && *len < 511) buffer[(*len)++] = *str++;
+}
+
+void append_uint(char* buffer, size_t* len, unsigned long value) {
+    char digits[20];
+    int n = 0;
+    do {
+        digits[n++] = '0' + value % 10;
+        value /= 10;
+    } while (value > 0);
+    while (n > 0 && *len < 511) buffer[(*len)++] = digits[--n];
+}
+
+void heap_dump_stats(int fd) {
+    heap_stats_t snapshot;
+    int consistent = heap_get_stats(&snapshot) == 0;
+
+    char buffer[512];
+    size_t len = 0;
+    append_str(buffer, &len, "Heap Stats:");
+    if (!consistent) append_str(buffer, &len, " (mid-update)");
+    append_str(buffer, &len, "\nlevel\tfree\tbytes\n");
+    write(fd, buffer, len);
+
+    for (int i = 0; i < HEAP_STATS_LEVELS; i++) {
+        len = 0;
+        append_uint(buffer, &len, i);
+        append_str(buffer, &len, "\t");
+        append_uint(buffer, &len, snapshot.free_chunks[i]);
+        append_str(buffer, &len, "\t");
+        append_uint(buffer, &len, snapshot.free_bytes[i]);
+        append_str(buffer, &len, "\n");
+        write(fd, buffer, len);
+    }
+
+    // fragmentation with 4 decimals
+    unsigned long frag = (unsigned long)(snapshot.fragmentation * 10000 + 0.5);
+    len = 0;
+    append_str(buffer, &len, "free chunks = ");
+    append_uint(buffer, &len, snapshot.total_free_chunks);
+    append_str(buffer, &len, ", free bytes = ");
+    append_uint(buffer, &len, snapshot.total_free_bytes);
+    append_str(buffer, &len, ", largest free = ");
+    append_uint(buffer, &len, snapshot.largest_free);
+    append_str(buffer, &len, "\nused chunks = ");
+    append_uint(buffer, &len, snapshot.used_chunks);
+    append_str(buffer, &len, ", used bytes = ");
+    append_uint(buffer, &len, snapshot.used_bytes);
+    append_str(buffer, &len, ", heap top = ");
+    append_uint(buffer, &len, snapshot.heap_top);
+    append_str(buffer, &len, "\nquick chunks = ");
+    append_uint(buffer, &len, snapshot.quick_chunks);
+    append_str(buffer, &len, ", quick bytes = ");
+    append_uint(buffer, &len, snapshot.quick_bytes);
+    append_str(buffer, &len, ", quick hits = ");
+    append_uint(buffer, &len, snapshot.quick_hits);
+    append_str(buffer, &len, ", consolidations = ");
+    append_uint(buffer, &len, snapshot.consolidations);
+    append_str(buffer, &len, "\nfragmentation = ");
+    append_uint(buffer, &len, frag / 10000);
+    append_str(buffer, &len, ".");
+    for (unsigned long d = 1000; d > 0; d /= 10) {
+        append_uint(buffer, &len, frag / d % 10);
+    }
+    append_str(buffer, &len, "\nmallocs = ");
+    append_uint(buffer, &len, snapshot.mallocs);
+    append_str(buffer, &len, ", frees = ");
+    append_uint(buffer, &len, snapshot.frees);
+    append_str(buffer, &len, ", splits = ");
+    append_uint(buffer, &len, snapshot.splits);
+    append_str(buffer, &len, ", coalesces = ");
+    append_uint(buffer, &len, snapshot.coalesces);
+    append_str(buffer, &len, ", failed allocs = ");
+    append_uint(buffer, &len, snapshot.failed_allocs);
+    append_str(buffer, &len, "\n");
+    write(fd, buffer, len);
+}
+
+// HW4_HEAP_STATS=1 dumps to stderr when the pool is released by malloc(0)
+// and at exit if it is still mapped
+__attribute__((destructor)) void dump_stats_at_exit() {
+    if (stats_dump_on_exit && pool_start != NULL) {
+        heap_dump_stats(STDERR_FILENO);
+    }
+}
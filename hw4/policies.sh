@@ -0,0 +1,20 @@
+#! /bin/bash
+# Compare the free-list placement policies over the synthetic trace suite.
+# Usage: ./policies.sh [replay options]   (traces are generated into traces/)
+
+python3 gen_traces.py traces || exit 1
+gcc -O2 replay.c -o replay || exit 1
+
+printf "%-16s %-20s %9s %7s %10s %9s %9s %9s %9s\n" policy trace ns/op \
+  failed peak_live end_frag max_frag max_free heap_top
+for policy in FIT_SEGREGATED FIT_ADDRESS_ORDERED; do
+  gcc -O2 -DFIT_POLICY=${policy} ${CFLAGS} -shared -fPIC hw4_111511141.c \
+    -o libhw4_${policy}.so || exit 1
+  for trace in traces/*.txt; do
+    LD_PRELOAD=./libhw4_${policy}.so ./replay -c -s 64 "$@" "${trace}" |
+      awk -F, -v policy=${policy} '{
+        name = $1; sub(".*/", "", name); sub("[.]txt$", "", name)
+        printf "%-16s %-20s %9s %7s %10s %9s %9s %9s %9s\n",
+          substr(policy, 5), name, $2, $3, $4, $5, $6, $7, $8 }'
+  done
+done
@@ -1,135 +1,227 @@
+#include <pthread.h>
+#include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <time.h>
+#include <unistd.h>
 
 #define HASH_SIZE 131071 // Prime number around max frame number (65536) * 2
-#define MAX_REFERENCES 100000001 // max
 
-typedef struct Node {
-  unsigned long vpn;   // virtual page number
-  int dirty;           // dirty bit
-  struct Node *prev;   // LRU's prev
-  struct Node *next;   // LRU's next
-  struct Node *h_next; // hash table's next
+// Frames are kept in a per-cache pool and linked by 32-bit ids instead of
+// pointers; id 0 is the null link, so nodes[1..capacity] are the frames
+typedef uint32_t NodeId;
+#define NIL 0
+
+typedef struct {
+  unsigned long vpn; // virtual page number
+  NodeId prev;       // LRU's prev
+  NodeId next;       // LRU's next (free list's next while unused)
 
   // CFLRU optimization
-  struct Node *aux_prev; // clean/dirty list prev
-  struct Node *aux_next; // clean/dirty list next
-  int in_region;         // flag: 1 if in clean-first region, 0 otherwise
-} Node;
+  NodeId aux_prev;         // clean/dirty list prev
+  NodeId aux_next;         // clean/dirty list next
+  unsigned char dirty;     // dirty bit
+  unsigned char in_region; // flag: 1 if in clean-first region, 0 otherwise
+
+  // Other replacement policies (see policy_table)
+  unsigned char list;  // which of the policy's lists/states the page is in
+  unsigned char ref;   // reference bit, or access frequency for S3-FIFO
+  unsigned char flags; // policy specific
+} Node;                // 32 bytes
 
 typedef struct {
-  Node *head;        // MRU
-  Node *tail;        // LRU
-  int size;          // current number of frames
-  int capacity;      // frame number
-  Node **hash_table; // Array of pointers
+  NodeId head;  // MRU
+  NodeId tail;  // LRU
+  int size;     // current number of frames
+  int capacity; // frame number
+  Node *nodes;  // frame pool, capacity + ghosts + 1 entries
+  NodeId free_ids;    // evicted frames, linked through next
+  NodeId next_unused; // frames never handed out start here
+  NodeId *hash_table; // vpn -> frame, HASH_SIZE chains
+  NodeId *hash_next;  // chains' next, indexed like nodes
 
   // CFLRU optimization
-  Node *clean_head;
-  Node *clean_tail;
-  Node *dirty_head;
-  Node *dirty_tail;
-  Node *boundary; // First node in the clean-first region (closest to head)
+  NodeId clean_head;
+  NodeId clean_tail;
+  NodeId dirty_head;
+  NodeId dirty_tail;
+  NodeId boundary; // First node in the clean-first region (closest to head)
   int window_size;
 } Cache;
 
 // Function Prototypes
 Cache *init_cache(int capacity);
+Cache *init_cache_with_ghosts(int capacity, int ghosts);
 void free_cache(Cache *cache);
-Node *find_in_hash(Cache *cache, unsigned long vpn);
-void add_to_hash(Cache *cache, Node *node);
-void remove_from_hash(Cache *cache, Node *node);
-void move_to_head(Cache *cache, Node *node);
-void remove_node(Cache *cache, Node *node);
-void add_to_head(Cache *cache, Node *node);
-Node *evict_lru(Cache *cache);
-Node *evict_cflru(Cache *cache);
-
-// Global stats
-unsigned int hits = 0;
-unsigned int misses = 0;
-unsigned int write_backs = 0;
-
-// Trace buffer
-char *trace_types;
-unsigned long *trace_addrs;
-int trace_count = 0;
-
-Cache *init_cache(int capacity) {
+NodeId find_in_hash(Cache *cache, unsigned long vpn);
+void add_to_hash(Cache *cache, NodeId id);
+void remove_from_hash(Cache *cache, NodeId id);
+void move_to_head(Cache *cache, NodeId id);
+void remove_node(Cache *cache, NodeId id);
+void add_to_head(Cache *cache, NodeId id);
+NodeId evict_lru(Cache *cache);
+NodeId evict_cflru(Cache *cache);
+
+// Trace buffer, one entry per reference: vpn << 1 | is_write
+unsigned long *trace_refs;
+long trace_count = 0;
+size_t trace_mapped = 0; // > 0 if trace_refs points into an mmap'ed file
+uint32_t *trace_next_use; // for OPT, built on first use
+
+// Cost of a write back relative to a page fault's read (-w), setting it
+// adds a weighted I/O cost column: misses + write_cost * write backs
+double write_cost = 1.0;
+int show_cost = 0;
+
+// Per-interval metrics (-I): references per interval, 0 = off
+long metrics_interval = 0;
+FILE *metrics_file;
+
+#define REF_VPN(ref) ((ref) >> 1)
+#define REF_IS_WRITE(ref) ((ref)&1)
+
+unsigned int page_hash(unsigned long vpn) {
+  // Fibonacci hashing, the high bits are the well mixed ones
+  return (unsigned int)((vpn * 0x9E3779B97F4A7C15UL) >> 32);
+}
+
+// Growable vpn -> uint32 map for whole-trace passes (open addressing, load
+// factor <= 1/2)
+typedef struct {
+  unsigned long *keys; // vpn + 1, 0 = empty
+  uint32_t *values;
+  unsigned int mask;
+  unsigned int used;
+} PageMap;
+
+void page_map_init(PageMap *map, unsigned int size) { // size: power of two
+  map->keys = (unsigned long *)calloc(size, sizeof(unsigned long));
+  map->values = (uint32_t *)malloc(size * sizeof(uint32_t));
+  map->mask = size - 1;
+  map->used = 0;
+}
+
+void page_map_free(PageMap *map) {
+  free(map->keys);
+  free(map->values);
+}
+
+// Value of vpn, inserted (*is_new = 1) if missing. Valid until the next call.
+uint32_t *page_map_slot(PageMap *map, unsigned long vpn, int *is_new) {
+  if ((map->used + 1) * 2 > map->mask + 1) {
+    PageMap bigger;
+    page_map_init(&bigger, (map->mask + 1) * 2);
+    for (unsigned int i = 0; i <= map->mask; i++) {
+      if (!map->keys[i])
+        continue;
+      unsigned int j = page_hash(map->keys[i] - 1) & bigger.mask;
+      while (bigger.keys[j])
+        j = (j + 1) & bigger.mask;
+      bigger.keys[j] = map->keys[i];
+      bigger.values[j] = map->values[i];
+    }
+    bigger.used = map->used;
+    page_map_free(map);
+    *map = bigger;
+  }
+
+  unsigned int idx = page_hash(vpn) & map->mask;
+  while (map->keys[idx] && map->keys[idx] != vpn + 1)
+    idx = (idx + 1) & map->mask;
+  *is_new = !map->keys[idx];
+  if (*is_new) {
+    map->keys[idx] = vpn + 1;
+    map->used++;
+  }
+  return &map->values[idx];
+}
+
+Cache *init_cache(int capacity) { return init_cache_with_ghosts(capacity, 0); }
+
+// ghosts: extra entries for policies that remember evicted pages, they live
+// in the pool and page table next to the resident frames
+Cache *init_cache_with_ghosts(int capacity, int ghosts) {
   Cache *cache = (Cache *)malloc(sizeof(Cache));
+  unsigned int entries = capacity + ghosts;
   cache->capacity = capacity;
   cache->size = 0;
-  cache->head = NULL;
-  cache->tail = NULL;
-  cache->hash_table = (Node **)calloc(HASH_SIZE, sizeof(Node *));
+  cache->head = NIL;
+  cache->tail = NIL;
+  cache->nodes = (Node *)malloc((entries + 1) * sizeof(Node));
+  cache->free_ids = NIL;
+  cache->next_unused = 1;
+
+  // Chained through ids; with HASH_SIZE buckets most are empty, which keeps
+  // the branches of the miss path predictable
+  cache->hash_table = (NodeId *)calloc(HASH_SIZE, sizeof(NodeId));
+  cache->hash_next = (NodeId *)malloc((entries + 1) * sizeof(NodeId));
 
   // CFLRU init
-  cache->clean_head = NULL;
-  cache->clean_tail = NULL;
-  cache->dirty_head = NULL;
-  cache->dirty_tail = NULL;
-  cache->boundary = NULL;
+  cache->clean_head = NIL;
+  cache->clean_tail = NIL;
+  cache->dirty_head = NIL;
+  cache->dirty_tail = NIL;
+  cache->boundary = NIL;
   cache->window_size = capacity / 4;
 
   return cache;
 }
 
 void free_cache(Cache *cache) {
-  Node *current = cache->head;
-  while (current) { // free every element in LRU list
-    Node *next = current->next;
-    free(current);
-    current = next;
-  }
-  // after this while loop, all node will be freed.
-  // So there will be nothing in the hash table
-  free(cache->hash_table); // free hash_table
-  free(cache);             // free cache itself
+  // frames live in the pool, nothing to free one by one
+  free(cache->nodes);
+  free(cache->hash_table);
+  free(cache->hash_next);
+  free(cache);
+}
+
+NodeId alloc_node(Cache *cache) {
+  NodeId id = cache->free_ids;
+  if (id != NIL)
+    cache->free_ids = cache->nodes[id].next; // reuse an evicted frame
+  else
+    id = cache->next_unused++; // callers never exceed the pool
+  return id;
+}
+
+void release_node(Cache *cache, NodeId id) {
+  cache->nodes[id].next = cache->free_ids;
+  cache->free_ids = id;
 }
 
 unsigned int hash_func(unsigned long vpn) { return vpn % HASH_SIZE; }
 
-Node *find_in_hash(Cache *cache, unsigned long vpn) {
-  unsigned int idx = hash_func(vpn);
-  Node *curr = cache->hash_table[idx];
-  while (curr) {          // curr is NOT NULL
-    if (curr->vpn == vpn) // find it
-      return curr;
-    curr = curr->h_next; // collision, h_next
-  }
-  return NULL;
+NodeId find_in_hash(Cache *cache, unsigned long vpn) {
+  NodeId id = cache->hash_table[hash_func(vpn)];
+  while (id && cache->nodes[id].vpn != vpn) // collision, next in chain
+    id = cache->hash_next[id];
+  return id;
 }
 
-void add_to_hash(Cache *cache, Node *node) {
-  // hash table is array of link-lists
-  unsigned int idx = hash_func(node->vpn);
-  node->h_next = cache->hash_table[idx];
-  // org hash_table[idx] == NULL
-  // just adding to head of that link-list
-  cache->hash_table[idx] = node;
+void add_to_hash(Cache *cache, NodeId id) {
+  // just adding to head of that chain
+  unsigned int idx = hash_func(cache->nodes[id].vpn);
+  cache->hash_next[id] = cache->hash_table[idx];
+  cache->hash_table[idx] = id;
 }
 
-void remove_from_hash(Cache *cache, Node *node) {
-  unsigned int idx = hash_func(node->vpn);
-  Node *curr = cache->hash_table[idx];
-  Node *prev = NULL;                 // because hash table didn't record prev
-  while (curr) {                     // curr is NOT NULL
-    if (curr == node) {              // find the node to be removed
-      if (prev)                      // if is NOT head of link-list
-        prev->h_next = curr->h_next; // prev's h_next = curr's h_next
-      else                           // if is head
-        cache->hash_table[idx] = curr->h_next; // head = h_next
-      return;                                  // break
-    }
-    prev = curr;
-    curr = curr->h_next;
-  }
+void remove_from_hash(Cache *cache, NodeId id) {
+  // the link pointing at id: the bucket or the previous node's hash_next
+  NodeId *link = &cache->hash_table[hash_func(cache->nodes[id].vpn)];
+  while (*link != id)
+    link = &cache->hash_next[*link];
+  *link = cache->hash_next[id];
 }
 
-void region_add(Cache *cache, Node *node) {
+void region_add(Cache *cache, NodeId id) {
+  Node *nodes = cache->nodes;
+  Node *node = &nodes[id];
   if (node->in_region)
     return;
   node->in_region = 1;
@@ -137,89 +229,93 @@ void region_add(Cache *cache, Node *node) {
   if (node->dirty) {
     // Add to dirty list head
     node->aux_next = cache->dirty_head;
-    node->aux_prev = NULL;
+    node->aux_prev = NIL;
     if (cache->dirty_head)
-      cache->dirty_head->aux_prev = node;
-    cache->dirty_head = node;
+      nodes[cache->dirty_head].aux_prev = id;
+    cache->dirty_head = id;
     if (!cache->dirty_tail)
-      cache->dirty_tail = node;
+      cache->dirty_tail = id;
   } else {
     // Add to clean list head
     node->aux_next = cache->clean_head;
-    node->aux_prev = NULL;
+    node->aux_prev = NIL;
     if (cache->clean_head)
-      cache->clean_head->aux_prev = node;
-    cache->clean_head = node;
+      nodes[cache->clean_head].aux_prev = id;
+    cache->clean_head = id;
     if (!cache->clean_tail)
-      cache->clean_tail = node;
+      cache->clean_tail = id;
   }
 }
 
-void region_remove(Cache *cache, Node *node) {
+void region_remove(Cache *cache, NodeId id) {
+  Node *nodes = cache->nodes;
+  Node *node = &nodes[id];
   if (!node->in_region) // if not in region, just return
     return;
   node->in_region = 0; // set in_region to 0 -> remove from region
 
   if (node->dirty) { // remove from dirty list
     if (node->aux_prev)
-      node->aux_prev->aux_next = node->aux_next;
+      nodes[node->aux_prev].aux_next = node->aux_next;
     else
       cache->dirty_head = node->aux_next;
 
     if (node->aux_next)
-      node->aux_next->aux_prev = node->aux_prev;
+      nodes[node->aux_next].aux_prev = node->aux_prev;
     else
       cache->dirty_tail = node->aux_prev;
   } else { // remove from clean list
     if (node->aux_prev)
-      node->aux_prev->aux_next = node->aux_next;
+      nodes[node->aux_prev].aux_next = node->aux_next;
     else
       cache->clean_head = node->aux_next;
 
     if (node->aux_next)
-      node->aux_next->aux_prev = node->aux_prev;
+      nodes[node->aux_next].aux_prev = node->aux_prev;
     else
       cache->clean_tail = node->aux_prev;
   }
 }
 
-void move_to_head(Cache *cache, Node *node) {
+void move_to_head(Cache *cache, NodeId id) {
+  Node *nodes = cache->nodes;
+  Node *node = &nodes[id];
   // LRU list
-  if (cache->head == node) // already at head
+  if (cache->head == id) // already at head
     return;
 
   // CFLRU: Handle region changes
   if (node->in_region) {
-    region_remove(cache, node);
+    region_remove(cache, id);
 
     // If we remove from region (and size > window)
     // we need to pull one node from working region to clean-first region and
     // become boundary
     if (cache->size > cache->window_size && cache->boundary &&
-        cache->boundary->prev) {
-      Node *pull = cache->boundary->prev;
+        nodes[cache->boundary].prev) {
+      NodeId pull = nodes[cache->boundary].prev;
       region_add(cache, pull);
       cache->boundary = pull;
     }
   }
 
   // Detach, remove this node from LRU list
-  if (node->prev)                  // there is a prev -> NOT head
-    node->prev->next = node->next; // detach prev
-  if (node->next)                  // there is a next -> NOT tail
-    node->next->prev = node->prev; // detach next
-  if (cache->tail == node)         // tail -> update tail
+  if (node->prev)                         // there is a prev -> NOT head
+    nodes[node->prev].next = node->next; // detach prev
+  if (node->next)                         // there is a next -> NOT tail
+    nodes[node->next].prev = node->prev; // detach next
+  if (cache->tail == id)                  // tail -> update tail
     cache->tail = node->prev;
 
   // Attach to head, add this node to HEAD of LRU list
   node->next = cache->head;
-  node->prev = NULL;
+  node->prev = NIL;
   if (cache->head) // there is a head -> NOT empty
-    cache->head->prev = node;
-  cache->head = node; // head = node
-  if (!cache->tail)   // there is no tail -> empty
+    nodes[cache->head].prev = id;
+  cache->head = id; // head = node
+  if (!cache->tail) // there is no tail -> empty
     // the head is also the tail
-    cache->tail = node;
+    cache->tail = id;
 
   // CFLRU: If size <= window, node stays in region (at head)
   if (cache->size <= cache->window_size) {
@@ -227,53 +323,56 @@ void move_to_head(Cache *cache, Node *node) {
     // add org node back
     // we can't do nothing even the node won't leave clean-first region
     // because the sorting matters
-    region_add(cache, node);
+    region_add(cache, id);
     cache->boundary = cache->head;
   }
 }
 
-void add_to_head(Cache *cache, Node *node) {
-  node->next = cache->head;
-  node->prev = NULL;
-  if (cache->head)            // if cache is NOT empty
-    cache->head->prev = node; // org head's prev = new node
-  cache->head = node;         // cache's new head = new node
-  if (!cache->tail)           // if cache is empty
-    cache->tail = node;       // only one node(the new one) is in the cache
-                              // tail will also be the new node
-  cache->size++;              // size += 1
+void add_to_head(Cache *cache, NodeId id) {
+  Node *nodes = cache->nodes;
+  nodes[id].next = cache->head;
+  nodes[id].prev = NIL;
+  if (cache->head)                // if cache is NOT empty
+    nodes[cache->head].prev = id; // org head's prev = new node
+  cache->head = id;               // cache's new head = new node
+  if (!cache->tail)               // if cache is empty
+    cache->tail = id;             // only one node(the new one) is in the cache
+                                  // tail will also be the new node
+  cache->size++;                  // size += 1
 
   // CFLRU: Add to region if size <= window
   if (cache->size <= cache->window_size) {
-    region_add(cache, node);
-    cache->boundary = node;
+    region_add(cache, id);
+    cache->boundary = id;
   }
 }
 
-void remove_node(Cache *cache, Node *node) {
+void remove_node(Cache *cache, NodeId id) {
+  Node *nodes = cache->nodes;
+  Node *node = &nodes[id];
   // CFLRU: Ensure removed from region lists (safety for LRU eviction)
   if (node->in_region) { // Although evict_cfrlu() already does this
     // we do this here just in case
-    region_remove(cache, node);
+    region_remove(cache, id);
   }
 
-  if (node->prev)                  // if the removed one is NOT head
-    node->prev->next = node->next; // prev's next = next
-  else                             // is head
-    cache->head = node->next;      // cache's head = next
+  if (node->prev)                         // if the removed one is NOT head
+    nodes[node->prev].next = node->next; // prev's next = next
+  else                                    // is head
+    cache->head = node->next;             // cache's head = next
 
-  if (node->next)                  // if is NOT tail
-    node->next->prev = node->prev; // next's prev = prev
-  else                             // is tail
-    cache->tail = node->prev;      // tail = prev
+  if (node->next)                         // if is NOT tail
+    nodes[node->next].prev = node->prev; // next's prev = prev
+  else                                    // is tail
+    cache->tail = node->prev;             // tail = prev
 
   cache->size--; // size -= 1
 }
 
-Node *evict_lru(Cache *cache) { return cache->tail; } // LRU evict tail node
+NodeId evict_lru(Cache *cache) { return cache->tail; } // LRU evict tail node
 
-Node *evict_cflru(Cache *cache) {
-  Node *victim = NULL;
+NodeId evict_cflru(Cache *cache) {
+  NodeId victim = NIL;
 
   // 1. Pick victim from clean list tail
   if (cache->clean_tail) {
@@ -297,8 +396,8 @@ Node *evict_cflru(Cache *cache) {
   // victim from main list. If we pull now, we maintain W nodes in region
   // (excluding victim).
   if (cache->size > cache->window_size && cache->boundary &&
-      cache->boundary->prev) {
-    Node *pull = cache->boundary->prev;
+      cache->nodes[cache->boundary].prev) {
+    NodeId pull = cache->nodes[cache->boundary].prev;
     // Ensure we don't pull the victim itself (if boundary->prev==victim)
     // although is impossible(??? or just I can't find the case hahaha
     if (pull != victim) {
@@ -310,161 +409,2694 @@ Node *evict_cflru(Cache *cache) {
   return victim;
 }
 
-void load_trace(const char *filepath) { // load trace file
-  FILE *fp = fopen(filepath, "r");
-  if (!fp) {
+// --- Binary trace format ---
+// 32-byte header followed by the payload:
+// TRACE_RAW:    count host-order u64 entries (vpn << 1 | is_write), the
+//               same layout as trace_refs, so it is mmap'ed and used as is
+// TRACE_VARINT: per reference, zigzag(vpn - previous vpn) << 1 | is_write as
+//               an LEB128 varint; sequential traces shrink to 1-2 bytes per
+//               reference and decode in one pass
+#define TRACE_MAGIC "HW5T"
+#define TRACE_RAW 0
+#define TRACE_VARINT 1
+
+typedef struct {
+  char magic[4];
+  uint32_t encoding;
+  uint64_t count;         // number of references
+  uint64_t payload_bytes; // bytes after the header
+  uint64_t reserved;
+} TraceHeader;
+
+void trace_append(unsigned long ref, long *capacity) {
+  if (trace_count == *capacity) { // grow with the trace, not up front
+    *capacity = *capacity ? *capacity * 2 : 1 << 20;
+    trace_refs = (unsigned long *)realloc(trace_refs,
+                                          *capacity * sizeof(unsigned long));
+    if (!trace_refs) {
+      fprintf(stderr, "Memory allocation failed for trace buffer\n");
+      exit(1);
+    }
+  }
+  trace_refs[trace_count++] = ref;
+}
+
+// --- Trace reader ---
+// Decodes a text or binary trace chunk by chunk into packed references, used
+// by load_trace() and by the streaming mode
+
+#define TRACE_TEXT -1
+
+typedef struct {
+  FILE *fp;
+  int encoding;       // TRACE_TEXT, TRACE_RAW or TRACE_VARINT
+  uint64_t remaining; // binary: references not read yet
+  unsigned long vpn;  // TRACE_VARINT: previous vpn
+} TraceReader;
+
+void trace_reader_open(TraceReader *reader, const char *filepath) {
+  reader->fp = fopen(filepath, "rb");
+  if (!reader->fp) {
     perror("Error opening file");
     exit(1);
   }
+  reader->vpn = 0;
+
+  TraceHeader header;
+  if (fread(&header, sizeof(header), 1, reader->fp) == 1 &&
+      memcmp(header.magic, TRACE_MAGIC, 4) == 0) {
+    reader->encoding = header.encoding;
+    reader->remaining = header.count;
+  } else {
+    reader->encoding = TRACE_TEXT;
+    rewind(reader->fp);
+  }
+}
+
+// Fill refs with up to max references, returns how many (0 at the end)
+long trace_reader_next(TraceReader *reader, unsigned long *refs, long max) {
+  long n = 0;
+
+  if (reader->encoding == TRACE_TEXT) {
+    char line[256];
+    while (n < max && fgets(line, sizeof(line), reader->fp)) {
+      char type;
+      unsigned long addr;
+
+      if (sscanf(line, " %c %lx", &type, &addr) != 2) {
+        continue;
+      }
+
+      // 4096 bytes per page: virtual page number = addr >> 12
+      refs[n++] = (addr >> 12) << 1 | (type == 'W');
+    }
+    return n;
+  }
+
+  if ((uint64_t)max > reader->remaining)
+    max = reader->remaining;
+
+  if (reader->encoding == TRACE_RAW) {
+    n = fread(refs, sizeof(unsigned long), max, reader->fp);
+  } else { // TRACE_VARINT
+    int c = 0;
+    while (n < max && c != EOF) {
+      unsigned long value = 0;
+      int shift = 0;
+      while ((c = getc(reader->fp)) != EOF && (c & 0x80)) {
+        value |= (unsigned long)(c & 0x7f) << shift;
+        shift += 7;
+      }
+      if (c == EOF)
+        break;
+      value |= (unsigned long)c << shift;
+
+      unsigned long zigzag = value >> 1;
+      long delta = (long)(zigzag >> 1) ^ -(long)(zigzag & 1);
+      reader->vpn += delta;
+      refs[n++] = reader->vpn << 1 | (value & 1);
+    }
+  }
+
+  reader->remaining -= n;
+  return n;
+}
+
+void trace_reader_close(TraceReader *reader) { fclose(reader->fp); }
+
+void load_trace(const char *filepath) { // load trace file (text or binary)
+  TraceReader reader;
+  trace_reader_open(&reader, filepath);
+
+  if (reader.encoding == TRACE_RAW) {
+    // zero parsing: map the file and use the payload as the trace buffer
+    struct stat st;
+    fstat(fileno(reader.fp), &st);
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+                     fileno(reader.fp), 0);
+    if (map == MAP_FAILED) {
+      perror("Error mapping file");
+      exit(1);
+    }
+    if ((uint64_t)st.st_size < sizeof(TraceHeader) +
+                                   reader.remaining * sizeof(unsigned long)) {
+      fprintf(stderr, "Truncated binary trace\n");
+      exit(1);
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    trace_refs = (unsigned long *)((char *)map + sizeof(TraceHeader));
+    trace_count = reader.remaining;
+    trace_mapped = st.st_size;
+    trace_reader_close(&reader);
+    return;
+  }
 
-  trace_types = (char *)malloc(MAX_REFERENCES * sizeof(char));
-  trace_addrs = (unsigned long *)malloc(MAX_REFERENCES * sizeof(unsigned long));
+  // memory grows with the trace, there is no upper limit on its length
+  long capacity = 0;
+  unsigned long chunk[4096];
+  long n;
+  while ((n = trace_reader_next(&reader, chunk, 4096)) > 0)
+    for (long j = 0; j < n; j++)
+      trace_append(chunk[j], &capacity);
+  trace_reader_close(&reader);
+}
+
+void free_trace() {
+  if (trace_mapped)
+    munmap((char *)trace_refs - sizeof(TraceHeader), trace_mapped);
+  else
+    free(trace_refs);
+  free(trace_next_use);
+}
 
-  if (!trace_types || !trace_addrs) {
-    fprintf(stderr, "Memory allocation failed for trace buffer\n");
+// Write the loaded trace as a binary trace file
+void write_trace(const char *filepath, int encoding) {
+  FILE *fp = fopen(filepath, "wb");
+  if (!fp) {
+    perror("Error opening output file");
     exit(1);
   }
 
-  char line[256];
-  while (fgets(line, sizeof(line), fp)) {
-    char type;
-    unsigned long addr;
+  TraceHeader header = {{0}, (uint32_t)encoding,
+                        (uint64_t)trace_count, 0, 0};
+  memcpy(header.magic, TRACE_MAGIC, 4);
+  fwrite(&header, sizeof(header), 1, fp); // payload size is patched below
 
-    if (sscanf(line, " %c %lx", &type, &addr) != 2) {
+  if (encoding == TRACE_RAW) {
+    fwrite(trace_refs, sizeof(unsigned long), trace_count, fp);
+    header.payload_bytes = trace_count * sizeof(unsigned long);
+  } else {
+    unsigned long prev = 0;
+    unsigned char buffer[16];
+    for (long j = 0; j < trace_count; j++) {
+      long delta = (long)(REF_VPN(trace_refs[j]) - prev);
+      prev = REF_VPN(trace_refs[j]);
+      unsigned long zigzag = ((unsigned long)delta << 1) ^ (delta >> 63);
+      unsigned long value = zigzag << 1 | REF_IS_WRITE(trace_refs[j]);
+      int len = 0;
+      while (value >= 0x80) {
+        buffer[len++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+      }
+      buffer[len++] = value;
+      fwrite(buffer, 1, len, fp);
+      header.payload_bytes += len;
+    }
+  }
+
+  fseek(fp, 0, SEEK_SET);
+  fwrite(&header, sizeof(header), 1, fp);
+  fclose(fp);
+}
+
+// --- Stack distance engine (Mattson) ---
+// LRU is a stack algorithm: a reference hits in a cache of C frames iff fewer
+// than C distinct pages were touched since the previous reference to the same
+// page (its stack distance). One pass that records a histogram of stack
+// distances therefore gives the hit/miss count for every capacity at once.
+//
+// Stack distances come from a Fenwick tree over timestamps holding a 1 at the
+// last reference time of every page: distance = number of 1s after it.
+// Timestamps are renumbered when they run out, so memory follows the number
+// of distinct pages instead of the trace length.
+//
+// Write backs: a dirty page is written back when it is evicted, i.e. at the
+// end of a reuse interval with distance >= C, and it is dirty in a C-frame
+// cache iff no interval since its last write had distance >= C. With
+// max_dist = largest distance since the last write, that is exactly the
+// capacities max_dist < C <= distance, added to a difference array.
+
+typedef struct {
+  unsigned long vpn;
+  unsigned int last;     // timestamp (Fenwick position) of last reference
+  unsigned int max_dist; // largest stack distance since the last write
+  int written;           // page has been written at least once
+} StackPage;
+
+typedef struct {
+  StackPage *pages;
+  unsigned int num_pages;
+  unsigned int page_cap;
+  unsigned int *map; // open addressing vpn -> page index + 1 (0 = empty)
+  unsigned int map_mask;
+
+  unsigned int *fenwick; // 1-based
+  unsigned int *owner;   // timestamp -> page index + 1 (0 = stale)
+  unsigned int fen_size;
+  unsigned int now;    // last used timestamp
+  unsigned int active; // number of 1s in the tree (= num_pages)
+
+  int max_capacity;       // distances >= max_capacity are all misses
+  unsigned long *hist;    // hist[d]: references with distance d (d < max)
+  unsigned long far;      // references with distance >= max_capacity
+  unsigned long cold;     // first references
+  long *wb_diff;          // write back difference array over capacities
+  unsigned long refs;
+} StackSim;
+
+StackSim *init_stack_sim(int max_capacity) {
+  StackSim *sim = (StackSim *)calloc(1, sizeof(StackSim));
+  sim->page_cap = 1 << 16;
+  sim->pages = (StackPage *)malloc(sim->page_cap * sizeof(StackPage));
+  sim->map_mask = (1 << 17) - 1;
+  sim->map = (unsigned int *)calloc(sim->map_mask + 1, sizeof(unsigned int));
+  sim->fen_size = 1 << 17;
+  sim->fenwick = (unsigned int *)calloc(sim->fen_size + 1, sizeof(unsigned int));
+  sim->owner = (unsigned int *)calloc(sim->fen_size + 1, sizeof(unsigned int));
+  sim->max_capacity = max_capacity;
+  sim->hist = (unsigned long *)calloc(max_capacity, sizeof(unsigned long));
+  sim->wb_diff = (long *)calloc(max_capacity + 2, sizeof(long));
+  return sim;
+}
+
+void free_stack_sim(StackSim *sim) {
+  free(sim->pages);
+  free(sim->map);
+  free(sim->fenwick);
+  free(sim->owner);
+  free(sim->hist);
+  free(sim->wb_diff);
+  free(sim);
+}
+
+void fenwick_add(StackSim *sim, unsigned int pos, int delta) {
+  for (; pos <= sim->fen_size; pos += pos & -pos)
+    sim->fenwick[pos] += delta;
+}
+
+unsigned int fenwick_prefix(StackSim *sim, unsigned int pos) {
+  unsigned int sum = 0;
+  for (; pos > 0; pos -= pos & -pos)
+    sum += sim->fenwick[pos];
+  return sum;
+}
+
+// Out of timestamps: renumber live pages 1..active in their current order
+// (growing the tree if it is more than half full) and rebuild the tree
+void stack_compact(StackSim *sim) {
+  unsigned int new_size = sim->fen_size;
+  if (sim->active * 2 > sim->fen_size)
+    new_size *= 2;
+  unsigned int *owner = (unsigned int *)calloc(new_size + 1,
+                                               sizeof(unsigned int));
+  unsigned int next = 0;
+  for (unsigned int t = 1; t <= sim->now; t++) {
+    if (sim->owner[t] == 0)
       continue;
+    owner[++next] = sim->owner[t];
+    sim->pages[sim->owner[t] - 1].last = next;
+  }
+  free(sim->owner);
+  free(sim->fenwick);
+  sim->owner = owner;
+  sim->fen_size = new_size;
+  sim->now = next;
+
+  // O(n) build: every position 1..next holds a 1
+  sim->fenwick = (unsigned int *)calloc(new_size + 1, sizeof(unsigned int));
+  for (unsigned int pos = 1; pos <= new_size; pos++) {
+    sim->fenwick[pos] += pos <= next ? 1 : 0;
+    unsigned int parent = pos + (pos & -pos);
+    if (parent <= new_size)
+      sim->fenwick[parent] += sim->fenwick[pos];
+  }
+}
+
+// Find the page of vpn, creating it if needed (*is_new = 1)
+StackPage *stack_lookup(StackSim *sim, unsigned long vpn, int *is_new) {
+  unsigned int idx = page_hash(vpn) & sim->map_mask;
+  while (sim->map[idx]) {
+    StackPage *page = &sim->pages[sim->map[idx] - 1];
+    if (page->vpn == vpn) {
+      *is_new = 0;
+      return page;
     }
+    idx = (idx + 1) & sim->map_mask;
+  }
 
-    if (trace_count >= MAX_REFERENCES) {
-      fprintf(stderr, "Trace file too large\n");
-      break;
+  *is_new = 1;
+  if (sim->num_pages == sim->page_cap) {
+    sim->page_cap *= 2;
+    sim->pages = (StackPage *)realloc(sim->pages,
+                                      sim->page_cap * sizeof(StackPage));
+  }
+  StackPage *page = &sim->pages[sim->num_pages++];
+  page->vpn = vpn;
+  page->last = 0;
+  page->max_dist = 0;
+  page->written = 0;
+  sim->map[idx] = sim->num_pages;
+
+  // Keep the load factor under 1/2
+  if (sim->num_pages * 2 > sim->map_mask + 1) {
+    unsigned int new_mask = sim->map_mask * 2 + 1;
+    unsigned int *map = (unsigned int *)calloc(new_mask + 1,
+                                               sizeof(unsigned int));
+    for (unsigned int i = 0; i < sim->num_pages; i++) {
+      unsigned int j = page_hash(sim->pages[i].vpn) & new_mask;
+      while (map[j])
+        j = (j + 1) & new_mask;
+      map[j] = i + 1;
     }
+    free(sim->map);
+    sim->map = map;
+    sim->map_mask = new_mask;
+  }
+  return page;
+}
+
+// Write backs for capacities max_dist < C <= dist
+void stack_add_write_backs(StackSim *sim, unsigned int max_dist,
+                           unsigned int dist) {
+  unsigned int lo = max_dist + 1;
+  unsigned int max_capacity = sim->max_capacity;
+  unsigned int hi = dist < max_capacity ? dist : max_capacity;
+  if (lo > hi)
+    return;
+  sim->wb_diff[lo]++;
+  sim->wb_diff[hi + 1]--;
+}
 
-    trace_types[trace_count] = type;
-    trace_addrs[trace_count] = addr;
-    trace_count++;
+void stack_access(StackSim *sim, unsigned long vpn, int is_write) {
+  int is_new;
+  StackPage *page = stack_lookup(sim, vpn, &is_new);
+  unsigned int index = page - sim->pages;
+  sim->refs++;
+
+  if (is_new) {
+    sim->cold++;
+    sim->active++;
+  } else {
+    // distinct pages referenced after the previous reference
+    unsigned int dist = sim->active - fenwick_prefix(sim, page->last);
+    if (dist < (unsigned int)sim->max_capacity)
+      sim->hist[dist]++;
+    else
+      sim->far++;
+
+    if (page->written)
+      stack_add_write_backs(sim, page->max_dist, dist);
+    if (dist > page->max_dist)
+      page->max_dist = dist;
+
+    fenwick_add(sim, page->last, -1);
+    sim->owner[page->last] = 0;
   }
 
-  fclose(fp);
+  if (is_write) {
+    page->written = 1;
+    page->max_dist = 0;
+  }
+
+  if (sim->now == sim->fen_size) {
+    stack_compact(sim);
+    page = &sim->pages[index];
+  }
+  page->last = ++sim->now;
+  sim->owner[page->last] = index + 1;
+  fenwick_add(sim, page->last, 1);
 }
 
-void run_simulation(const char *policy, int frame_sizes[], int num_sizes,
-                    const char *filepath) {
+// Pages still resident at the end are only written back if they were pushed
+// out after their last reference
+void stack_finish(StackSim *sim) {
+  for (unsigned int i = 0; i < sim->num_pages; i++) {
+    StackPage *page = &sim->pages[i];
+    if (!page->written)
+      continue;
+    unsigned int dist = sim->active - fenwick_prefix(sim, page->last);
+    stack_add_write_backs(sim, page->max_dist, dist);
+  }
+}
+
+// Results for a C-frame LRU cache, C in 1..max_capacity. Call in increasing
+// order of capacity: misses and write backs are running sums.
+typedef struct {
+  int capacity;
+  unsigned long misses; // references with distance >= capacity, plus cold
+  long write_backs;
+  unsigned long hits_below; // references with distance < capacity
+} StackCursor;
+
+void stack_cursor_advance(StackSim *sim, StackCursor *cursor, int capacity) {
+  while (cursor->capacity < capacity) {
+    cursor->hits_below += sim->hist[cursor->capacity];
+    cursor->capacity++;
+    cursor->write_backs += sim->wb_diff[cursor->capacity];
+  }
+  cursor->misses = sim->refs - cursor->hits_below;
+}
+
+StackSim *run_stack_distances(int max_capacity) {
+  StackSim *sim = init_stack_sim(max_capacity);
+  for (long j = 0; j < trace_count; j++)
+    stack_access(sim, REF_VPN(trace_refs[j]), REF_IS_WRITE(trace_refs[j]));
+  stack_finish(sim);
+  return sim;
+}
+
+double elapsed_since(struct timeval *start) {
+  struct timeval end;
+  gettimeofday(&end, NULL);
+  return (end.tv_sec - start->tv_sec) +
+         (end.tv_usec - start->tv_usec) / 1000000.0;
+}
+
+int max_frame_size(int frame_sizes[], int num_sizes) {
+  int max_capacity = 0;
+  for (int i = 0; i < num_sizes; i++)
+    if (frame_sizes[i] > max_capacity)
+      max_capacity = frame_sizes[i];
+  return max_capacity;
+}
+
+// LRU table for the given frame sizes, plus an optional miss ratio curve
+// (every curve_step frames) on stdout as CSV
+void print_header(const char *policy) {
   printf("%s policy:\n", policy);
-  printf("Frame\tHit\t\tMiss\t\tPage fault ratio\tWrite back count\n");
+  printf("Frame\tHit\t\tMiss\t\tPage fault ratio\tWrite back count%s\n",
+         show_cost ? "\tWeighted I/O cost" : "");
+}
+
+void print_row(int capacity, unsigned long hits, unsigned long misses,
+               unsigned long write_backs) {
+  double fault_ratio = (double)misses / (hits + misses);
+
+  printf("%d\t%lu\t%lu\t\t%.10f\t\t%lu", capacity, hits, misses,
+         fault_ratio, write_backs);
+  if (show_cost)
+    printf("\t\t\t%.1f", misses + write_cost * write_backs);
+  printf("\n");
+}
+
+void print_stack_result(StackSim *sim, int frame_sizes[], int num_sizes,
+                        int curve_step, double total_time) {
+  print_header("LRU");
+
+  StackCursor cursor = {0, 0, 0, 0};
+  for (int i = 0; i < num_sizes; i++) { // frame_sizes[] is increasing
+    stack_cursor_advance(sim, &cursor, frame_sizes[i]);
+    print_row(frame_sizes[i], sim->refs - cursor.misses, cursor.misses,
+              cursor.write_backs);
+  }
 
-  struct timeval start, end;
+  printf("Total elapsed time %.6f sec\n\n", total_time);
+
+  if (curve_step > 0) {
+    printf("frames,hits,misses,fault_ratio,write_backs\n");
+    StackCursor curve = {0, 0, 0, 0};
+    for (int c = curve_step; c <= sim->max_capacity; c += curve_step) {
+      stack_cursor_advance(sim, &curve, c);
+      printf("%d,%lu,%lu,%.10f,%ld\n", c, sim->refs - curve.misses,
+             curve.misses, (double)curve.misses / sim->refs,
+             curve.write_backs);
+    }
+    printf("\n");
+  }
+}
+
+// LRU for every frame size from a single pass over the loaded trace
+void run_stack_simulation(int frame_sizes[], int num_sizes, int curve_step) {
+  struct timeval start;
   gettimeofday(&start, NULL);
 
-  for (int i = 0; i < num_sizes; i++) { // {4096, 8192, 16384, 32768, 65536}
-    int capacity = frame_sizes[i];
-    Cache *cache = init_cache(capacity);
-    hits = 0;
-    misses = 0;
-    write_backs = 0;
-
-    for (int j = 0; j < trace_count; j++) {
-      char type = trace_types[j];
-      unsigned long addr = trace_addrs[j];
-
-      unsigned long vpn = addr >> 12; // 4096 bytes per page, virtual page
-                                      // number = address / 4096 = addr >> 12
-      int is_write = (type == 'W');
-
-      Node *node = find_in_hash(cache, vpn);
-      // if vpn is not in hash (cache miss), node == NULL
-
-      if (node) { // if hit (node != NULL)
-        hits++;
-        move_to_head(cache, node);
-        if (is_write) { // if write, set dirty bit
-          if (node->dirty == 0) {
-            // Status change: Clean -> Dirty
-            // If node is in region, we must move it from Clean List to Dirty
-            // List!
-            if (node->in_region) {
-              region_remove(cache, node); // Remove from Clean List
-              node->dirty = 1; // We have to set dirty bit AFTER region_remove()
-              // because region_remove() will remove node according its org
-              // dirty bit
-              region_add(cache, node); // Add to Dirty List
-            } else {
-              node->dirty = 1;
-            }
-          }
-        }
-      } else { // if miss (node == NULL)
-        misses++;
-        if (cache->size == cache->capacity) {
-          // if cache is full, evict one node
-          Node *victim = NULL;              // victim node to be evicted
-          if (strcmp(policy, "LRU") == 0) { // policy
-            victim = evict_lru(cache);      // find victim by LRU
-          } else if (strcmp(policy, "CFLRU") == 0) {
-            victim = evict_cflru(cache); // find victim by CFLRU
+  StackSim *sim = run_stack_distances(max_frame_size(frame_sizes, num_sizes));
+  print_stack_result(sim, frame_sizes, num_sizes, curve_step,
+                     elapsed_since(&start));
+  free_stack_sim(sim);
+}
+
+typedef struct Policy Policy;
+
+// Counter deltas and occupancy at the end of one -I interval
+typedef struct {
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long write_backs;
+  int resident; // pages in memory
+  int dirty;    // of which dirty
+} IntervalStats;
+
+// Counters of one (policy, capacity) simulation
+typedef struct {
+  const Policy *policy;
+  int capacity;
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long write_backs;
+  double seconds;           // time spent in this simulation
+  IntervalStats *intervals; // with -I
+} SimResult;
+
+// --- Replacement policies ---
+// A policy owns its state for one capacity and is handed the references in
+// batches (the whole trace, or one chunk when streaming). Going through
+// policy_table costs one indirect call per batch; nothing inside the
+// per-reference loops compares names or dispatches.
+
+struct Policy {
+  const char *name;
+  void *(*create)(int capacity);
+  void (*destroy)(void *state);
+  // Feed count references, adding to result's counters
+  void (*run)(void *state, SimResult *result, const unsigned long *refs,
+              long count);
+  // Pages in memory and how many of them are dirty (-I)
+  void (*occupancy)(void *state, int *resident, int *dirty);
+  int offline; // needs the whole trace in one batch (not with -t)
+};
+
+// LRU and CFLRU share the Cache lists, only the victim differs
+void replay_cache(Cache *cache, int cflru, SimResult *result,
+                  const unsigned long *refs, long count) {
+  for (long j = 0; j < count; j++) {
+    unsigned long vpn = REF_VPN(refs[j]); // shifted when loaded
+    int is_write = REF_IS_WRITE(refs[j]);
+
+    NodeId id = find_in_hash(cache, vpn);
+    // if vpn is not in hash (cache miss), id == NIL
+
+    if (id) { // if hit (id != NIL)
+      Node *node = &cache->nodes[id];
+      result->hits++;
+      move_to_head(cache, id);
+      if (is_write) { // if write, set dirty bit
+        if (node->dirty == 0) {
+          // Status change: Clean -> Dirty
+          // If node is in region, we must move it from Clean List to Dirty
+          // List!
+          if (node->in_region) {
+            region_remove(cache, id); // Remove from Clean List
+            node->dirty = 1; // We have to set dirty bit AFTER region_remove()
+            // because region_remove() will remove node according its org
+            // dirty bit
+            region_add(cache, id); // Add to Dirty List
           } else {
-            perror("Error policy");
-            exit(1);
+            node->dirty = 1;
           }
+        }
+      }
+    } else { // if miss (id == NIL)
+      result->misses++;
+      if (cache->size == cache->capacity) {
+        // if cache is full, evict one node
+        // victim node to be evicted, by CFLRU or LRU (tail)
+        NodeId victim = cflru ? evict_cflru(cache) : evict_lru(cache);
+
+        if (cache->nodes[victim].dirty) // if victim node is dirty, it have to
+                                        // write back -> write_backs++
+          result->write_backs++;
+
+        remove_from_hash(cache, victim); // remove node from hash
+        remove_node(cache, victim);      // remove node from LRU list
+        release_node(cache, victim);     // back to the pool
+      }
 
-          if (victim->dirty) // if victim node is dirty, it have to write back
-                             // -> write_backs++
-            write_backs++;
+      // if cache is not full, just add new node
+      // node's element: vpn, dirty, prev, next
+      id = alloc_node(cache);
+      Node *new_node = &cache->nodes[id];
+      new_node->vpn = vpn;
+      // this node is new one, so it's ok to set the dirty bit to is_write
+      new_node->dirty = is_write;
+      new_node->in_region = 0;
+      new_node->aux_prev = NIL;
+      new_node->aux_next = NIL;
+      // add to head of LRU list (MRU) (initialize prev, next)
+      add_to_head(cache, id);
+      // add to page table
+      add_to_hash(cache, id);
+    }
+  }
+}
 
-          remove_from_hash(cache, victim); // remove node from hash
-          remove_node(cache, victim);      // remove node from LRU list
-          free(victim);                    // free memory
-        }
+// Dirty pages in the page table; ghost entries are always clean
+int count_dirty(Cache *cache) {
+  int dirty = 0;
+  for (unsigned int i = 0; i < HASH_SIZE; i++)
+    for (NodeId id = cache->hash_table[i]; id; id = cache->hash_next[id])
+      dirty += cache->nodes[id].dirty;
+  return dirty;
+}
 
-        // if cache is not full, just add new node
-        // node's element: vpn, dirty, prev, next, h_next
-        Node *new_node = (Node *)malloc(sizeof(Node));
-        new_node->vpn = vpn;
-        // this node is new one, so it's ok to set the dirty bit to is_write
-        new_node->dirty = is_write;
-        new_node->in_region = 0;
-        new_node->aux_prev = NULL;
-        new_node->aux_next = NULL;
-        // add to head of LRU list (MRU) (initialize prev, next)
-        add_to_head(cache, new_node);
-        // add to hash table (initialize h_next)
-        add_to_hash(cache, new_node);
-      }
+void *create_cache(int capacity) { return init_cache(capacity); }
+
+void cache_occupancy(void *state, int *resident, int *dirty) {
+  Cache *cache = (Cache *)state;
+  *resident = cache->size;
+  *dirty = count_dirty(cache);
+}
+
+void destroy_cache(void *state) { free_cache((Cache *)state); }
+
+void run_lru(void *state, SimResult *result, const unsigned long *refs,
+             long count) {
+  replay_cache((Cache *)state, 0, result, refs, count);
+}
+
+void run_cflru(void *state, SimResult *result, const unsigned long *refs,
+               long count) {
+  replay_cache((Cache *)state, 1, result, refs, count);
+}
+
+// Resize CFLRU's clean-first region: it is the window pages nearest the
+// LRU end, rebuilt from the tail. O(size), callers amortise it.
+void set_window(Cache *cache, int window) {
+  Node *nodes = cache->nodes;
+  for (NodeId id = cache->head; id; id = nodes[id].next)
+    nodes[id].in_region = 0;
+  cache->clean_head = NIL;
+  cache->clean_tail = NIL;
+  cache->dirty_head = NIL;
+  cache->dirty_tail = NIL;
+  cache->boundary = NIL;
+  cache->window_size = window;
+
+  int n = 0;
+  for (NodeId id = cache->tail; id && n < window; id = nodes[id].prev, n++) {
+    region_add(cache, id); // walking toward the head keeps the list order
+    cache->boundary = id;
+  }
+}
+
+// Adaptive CFLRU: two shadow CFLRU caches run next to the real one with a
+// window one step smaller and one step larger. After every epoch (capacity
+// references) the window moves to whichever of the three had the lowest
+// weighted I/O cost, misses + write_cost * write backs, and the shadows are
+// re-centred on it. The window starts at CFLRU's capacity / 4.
+typedef struct {
+  Cache *cache;
+  Cache *shadow[2];          // window - step, window + step
+  SimResult shadow_result[2]; // counters of the shadows, not reported
+  int step;
+  long epoch;      // references per epoch
+  long epoch_left; // references until the next adjustment
+  double epoch_start[3]; // cost of cache, shadow[0], shadow[1] at epoch start
+} AdaptiveState;
+
+double weighted_cost(const SimResult *result) {
+  return result->misses + write_cost * result->write_backs;
+}
+
+void adaptive_recentre(AdaptiveState *adaptive, const SimResult *result) {
+  int capacity = adaptive->cache->capacity;
+  int window = adaptive->cache->window_size;
+  int smaller = window - adaptive->step > 0 ? window - adaptive->step : 0;
+  int larger = window + adaptive->step < capacity ? window + adaptive->step
+                                                   : capacity;
+  set_window(adaptive->shadow[0], smaller);
+  set_window(adaptive->shadow[1], larger);
+  adaptive->epoch_start[0] = weighted_cost(result);
+  adaptive->epoch_start[1] = weighted_cost(&adaptive->shadow_result[0]);
+  adaptive->epoch_start[2] = weighted_cost(&adaptive->shadow_result[1]);
+  adaptive->epoch_left = adaptive->epoch;
+}
+
+void *adaptive_create(int capacity) {
+  AdaptiveState *adaptive = (AdaptiveState *)calloc(1, sizeof(AdaptiveState));
+  adaptive->cache = init_cache(capacity);
+  adaptive->shadow[0] = init_cache(capacity);
+  adaptive->shadow[1] = init_cache(capacity);
+  adaptive->step = capacity / 32 > 0 ? capacity / 32 : 1;
+  adaptive->epoch = capacity;
+  SimResult empty = {0};
+  adaptive_recentre(adaptive, &empty);
+  return adaptive;
+}
+
+void adaptive_destroy(void *state) {
+  AdaptiveState *adaptive = (AdaptiveState *)state;
+  free_cache(adaptive->cache);
+  free_cache(adaptive->shadow[0]);
+  free_cache(adaptive->shadow[1]);
+  free(adaptive);
+}
+
+void adaptive_occupancy(void *state, int *resident, int *dirty) {
+  cache_occupancy(((AdaptiveState *)state)->cache, resident, dirty);
+}
+
+void adaptive_run(void *state, SimResult *result, const unsigned long *refs,
+                  long count) {
+  AdaptiveState *adaptive = (AdaptiveState *)state;
+
+  while (count > 0) {
+    long n = count < adaptive->epoch_left ? count : adaptive->epoch_left;
+    replay_cache(adaptive->cache, 1, result, refs, n);
+    replay_cache(adaptive->shadow[0], 1, &adaptive->shadow_result[0], refs, n);
+    replay_cache(adaptive->shadow[1], 1, &adaptive->shadow_result[1], refs, n);
+    refs += n;
+    count -= n;
+    adaptive->epoch_left -= n;
+    if (adaptive->epoch_left > 0)
+      continue;
+
+    double cost = weighted_cost(result) - adaptive->epoch_start[0];
+    double smaller = weighted_cost(&adaptive->shadow_result[0]) -
+                     adaptive->epoch_start[1];
+    double larger = weighted_cost(&adaptive->shadow_result[1]) -
+                    adaptive->epoch_start[2];
+    if (smaller < cost && smaller <= larger)
+      set_window(adaptive->cache, adaptive->shadow[0]->window_size);
+    else if (larger < cost)
+      set_window(adaptive->cache, adaptive->shadow[1]->window_size);
+    adaptive_recentre(adaptive, result);
+  }
+}
+
+// The policies below keep their resident pages and ghost entries (evicted
+// pages they still remember) in a Cache's pool and page table, and thread
+// them on their own lists. Ghost hits are misses.
+
+NodeId new_page(Cache *cache, unsigned long vpn, int is_write) {
+  NodeId id = alloc_node(cache);
+  Node *node = &cache->nodes[id];
+  node->vpn = vpn;
+  node->dirty = is_write;
+  node->list = 0;
+  node->ref = 0;
+  node->flags = 0;
+  add_to_hash(cache, id);
+  return id;
+}
+
+// Forget the page completely
+void drop_page(Cache *cache, NodeId id) {
+  remove_from_hash(cache, id);
+  release_node(cache, id);
+}
+
+// The page leaves memory (it may stay behind as a ghost entry)
+void page_out(Cache *cache, SimResult *result, NodeId id) {
+  if (cache->nodes[id].dirty) {
+    result->write_backs++;
+    cache->nodes[id].dirty = 0;
+  }
+}
+
+// Doubly linked list of pool entries, head is the newest
+typedef struct {
+  NodeId head;
+  NodeId tail;
+  int size;
+  int aux; // linked through aux_prev/aux_next, for pages on two lists
+} List;
+
+#define LIST_PREV(list, node)                                                 \
+  (*((list)->aux ? &(node)->aux_prev : &(node)->prev))
+#define LIST_NEXT(list, node)                                                 \
+  (*((list)->aux ? &(node)->aux_next : &(node)->next))
+
+void list_push_head(Cache *cache, List *list, NodeId id) {
+  Node *node = &cache->nodes[id];
+  LIST_PREV(list, node) = NIL;
+  LIST_NEXT(list, node) = list->head;
+  if (list->head)
+    LIST_PREV(list, &cache->nodes[list->head]) = id;
+  else
+    list->tail = id;
+  list->head = id;
+  list->size++;
+}
+
+void list_remove(Cache *cache, List *list, NodeId id) {
+  Node *node = &cache->nodes[id];
+  NodeId prev = LIST_PREV(list, node);
+  NodeId next = LIST_NEXT(list, node);
+  if (prev)
+    LIST_NEXT(list, &cache->nodes[prev]) = next;
+  else
+    list->head = next;
+  if (next)
+    LIST_PREV(list, &cache->nodes[next]) = prev;
+  else
+    list->tail = prev;
+  list->size--;
+}
+
+void list_move_to_head(Cache *cache, List *list, NodeId id) {
+  if (list->head == id)
+    return;
+  list_remove(cache, list, id);
+  list_push_head(cache, list, id);
+}
+
+// CLOCK: frames form a ring (pool ids 1..capacity, never freed), the hand
+// clears reference bits until it finds an unreferenced victim, whose frame
+// takes the new page
+typedef struct {
+  Cache *cache;
+  NodeId hand;
+} ClockState;
+
+void *clock_create(int capacity) {
+  ClockState *clock = (ClockState *)malloc(sizeof(ClockState));
+  clock->cache = init_cache(capacity);
+  clock->hand = 1;
+  return clock;
+}
+
+void clock_destroy(void *state) {
+  ClockState *clock = (ClockState *)state;
+  free_cache(clock->cache);
+  free(clock);
+}
+
+void clock_occupancy(void *state, int *resident, int *dirty) {
+  cache_occupancy(((ClockState *)state)->cache, resident, dirty);
+}
+
+void clock_run(void *state, SimResult *result, const unsigned long *refs,
+               long count) {
+  ClockState *clock = (ClockState *)state;
+  Cache *cache = clock->cache;
+  Node *nodes = cache->nodes;
+  NodeId capacity = cache->capacity;
+
+  for (long j = 0; j < count; j++) {
+    unsigned long vpn = REF_VPN(refs[j]);
+    int is_write = REF_IS_WRITE(refs[j]);
+
+    NodeId id = find_in_hash(cache, vpn);
+    if (id) {
+      result->hits++;
+      nodes[id].ref = 1;
+      nodes[id].dirty |= is_write;
+      continue;
+    }
+
+    result->misses++;
+    if (cache->size < cache->capacity) {
+      new_page(cache, vpn, is_write);
+      cache->size++;
+      continue;
+    }
+    while (nodes[clock->hand].ref) { // second chance
+      nodes[clock->hand].ref = 0;
+      clock->hand = clock->hand % capacity + 1;
     }
+    id = clock->hand;
+    page_out(cache, result, id);
+    remove_from_hash(cache, id);
+    nodes[id].vpn = vpn;
+    nodes[id].dirty = is_write;
+    add_to_hash(cache, id);
+    clock->hand = id % capacity + 1;
+  }
+}
 
-    double fault_ratio = (double)misses / (hits + misses);
+// CLOCK-Pro (Jiang, Chen, Zhang, USENIX ATC '05): one clock holds hot and
+// cold resident pages plus non-resident cold pages still in their test
+// period. A cold page re-referenced during its test period becomes hot.
+// HAND_cold evicts cold pages, HAND_hot demotes hot ones and HAND_test ends
+// test periods. The cold share adapts down to 1% of the frames (the LIRS HIR
+// share) rather than the paper's 1 frame: HAND_cold walks past every hot
+// page between two cold ones, so a single cold frame costs a full turn of
+// the clock per miss.
+#define CP_COLD 0
+#define CP_HOT 1
+#define CP_RESIDENT 1 // flags
+#define CP_TEST 2
 
-    printf("%d\t%d\t%d\t\t%.10f\t\t%d\n", capacity, hits, misses, fault_ratio,
-           write_backs);
+typedef struct {
+  Cache *cache;
+  int capacity;
+  int cold_target; // resident cold pages wanted (m_c in the paper)
+  int cold_min;
+  int hot_count;
+  int cold_count;     // resident cold pages
+  int nonresident;    // non-resident pages in their test period
+  NodeId hand_hot;    // also the list head: new pages go just behind it
+  NodeId hand_cold;
+  NodeId hand_test;
+} ClockProState;
+
+void *clockpro_create(int capacity) {
+  ClockProState *cp = (ClockProState *)calloc(1, sizeof(ClockProState));
+  // at most capacity non-resident pages, plus the one being added
+  cp->cache = init_cache_with_ghosts(capacity, capacity + 2);
+  cp->capacity = capacity;
+  cp->cold_min = capacity / 100 > 0 ? capacity / 100 : 1;
+  cp->cold_target = cp->cold_min;
+  return cp;
+}
+
+void clockpro_destroy(void *state) {
+  ClockProState *cp = (ClockProState *)state;
+  free_cache(cp->cache);
+  free(cp);
+}
 
-    free_cache(cache);
+void clockpro_occupancy(void *state, int *resident, int *dirty) {
+  ClockProState *cp = (ClockProState *)state;
+  *resident = cp->hot_count + cp->cold_count;
+  *dirty = count_dirty(cp->cache);
+}
+
+// Insert at the list head, which is the position just behind HAND_hot
+void clockpro_link(ClockProState *cp, NodeId id) {
+  Node *nodes = cp->cache->nodes;
+  if (!cp->hand_hot) {
+    nodes[id].prev = id;
+    nodes[id].next = id;
+    cp->hand_hot = cp->hand_cold = cp->hand_test = id;
+    return;
   }
+  NodeId next = cp->hand_hot;
+  NodeId prev = nodes[next].prev;
+  nodes[id].prev = prev;
+  nodes[id].next = next;
+  nodes[prev].next = id;
+  nodes[next].prev = id;
+}
 
-  gettimeofday(&end, NULL);
-  double total_time =
-      (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
-  printf("Total elapsed time %.6f sec\n\n", total_time);
+// Remove from the clock, hands on the page move on to the next one
+void clockpro_unlink(ClockProState *cp, NodeId id) {
+  Node *nodes = cp->cache->nodes;
+  NodeId next = nodes[id].next;
+  if (next == id) {
+    cp->hand_hot = cp->hand_cold = cp->hand_test = NIL;
+    return;
+  }
+  if (cp->hand_hot == id)
+    cp->hand_hot = next;
+  if (cp->hand_cold == id)
+    cp->hand_cold = next;
+  if (cp->hand_test == id)
+    cp->hand_test = next;
+  nodes[nodes[id].prev].next = next;
+  nodes[next].prev = nodes[id].prev;
 }
 
-int main(int argc, char *argv[]) {
-  // argc: number of arguments(including the program name), argv: arguments
-  if (argc < 2) {
-    // only 1 argument: the program name, no input file path provided
-    fprintf(stderr, "Usage: %s <input_file>\n", argv[0]);
-    return 1;
+// A non-resident page's test period ended without a re-reference: the cold
+// share was too big
+void clockpro_forget(ClockProState *cp, NodeId id) {
+  if (cp->cold_target > cp->cold_min)
+    cp->cold_target--;
+  clockpro_unlink(cp, id);
+  drop_page(cp->cache, id);
+  cp->nonresident--;
+}
+
+// Demote one hot page to cold
+void clockpro_run_hand_hot(ClockProState *cp) {
+  Node *nodes = cp->cache->nodes;
+  for (;;) {
+    NodeId id = cp->hand_hot;
+    Node *node = &nodes[id];
+    cp->hand_hot = node->next;
+    if (node->list == CP_HOT) {
+      if (node->ref) {
+        node->ref = 0;
+        continue;
+      }
+      node->list = CP_COLD;
+      cp->hot_count--;
+      cp->cold_count++;
+      return;
+    }
+    // HAND_hot also ends the test periods of the cold pages it passes
+    if (node->flags & CP_TEST) {
+      node->flags &= ~CP_TEST;
+      if (!(node->flags & CP_RESIDENT))
+        clockpro_forget(cp, id);
+    }
   }
-  char *file_path = argv[1];
+}
 
-  int frame_sizes[] = {4096, 8192, 16384, 32768, 65536}; // frame numbers
-  // number of frame_sizes[]
-  int num_sizes = sizeof(frame_sizes) / sizeof(frame_sizes[0]);
+void clockpro_balance(ClockProState *cp) {
+  while (cp->hot_count > cp->capacity - cp->cold_target)
+    clockpro_run_hand_hot(cp);
+}
 
-  load_trace(file_path);
+// Remove one non-resident page
+void clockpro_run_hand_test(ClockProState *cp) {
+  Node *nodes = cp->cache->nodes;
+  for (;;) {
+    NodeId id = cp->hand_test;
+    Node *node = &nodes[id];
+    cp->hand_test = node->next;
+    if (node->list == CP_COLD && (node->flags & CP_TEST)) {
+      node->flags &= ~CP_TEST;
+      if (!(node->flags & CP_RESIDENT)) {
+        clockpro_forget(cp, id);
+        return;
+      }
+    }
+  }
+}
+
+// Free one frame
+void clockpro_run_hand_cold(ClockProState *cp, SimResult *result) {
+  Node *nodes = cp->cache->nodes;
+  for (;;) {
+    NodeId id = cp->hand_cold;
+    Node *node = &nodes[id];
+    cp->hand_cold = node->next;
+    if (node->list == CP_HOT || !(node->flags & CP_RESIDENT))
+      continue;
+
+    if (node->ref) {
+      node->ref = 0;
+      clockpro_unlink(cp, id);
+      clockpro_link(cp, id);
+      if (node->flags & CP_TEST) { // re-referenced while in test: hot
+        node->flags &= ~CP_TEST;
+        node->list = CP_HOT;
+        cp->cold_count--;
+        cp->hot_count++;
+        clockpro_balance(cp);
+      } else { // start a new test period
+        node->flags |= CP_TEST;
+      }
+      continue;
+    }
+
+    page_out(cp->cache, result, id);
+    cp->cold_count--;
+    if (node->flags & CP_TEST) { // remember it until the test period ends
+      node->flags &= ~CP_RESIDENT;
+      cp->nonresident++;
+    } else {
+      clockpro_unlink(cp, id);
+      drop_page(cp->cache, id);
+    }
+    return;
+  }
+}
+
+void clockpro_run(void *state, SimResult *result, const unsigned long *refs,
+                  long count) {
+  ClockProState *cp = (ClockProState *)state;
+  Cache *cache = cp->cache;
+  Node *nodes = cache->nodes;
+
+  for (long j = 0; j < count; j++) {
+    unsigned long vpn = REF_VPN(refs[j]);
+    int is_write = REF_IS_WRITE(refs[j]);
+
+    NodeId id = find_in_hash(cache, vpn);
+    if (id && (nodes[id].flags & CP_RESIDENT)) {
+      result->hits++;
+      nodes[id].ref = 1;
+      nodes[id].dirty |= is_write;
+      continue;
+    }
+
+    result->misses++;
+    int full = cp->hot_count + cp->cold_count == cp->capacity;
+    if (id) {
+      // Non-resident page still in its test period: its reuse distance
+      // beats the hot pages', so the cold share grows and it comes back hot.
+      // Take it off the clock first so no hand can drop it.
+      if (cp->cold_target < cp->capacity - 1)
+        cp->cold_target++;
+      clockpro_unlink(cp, id);
+      cp->nonresident--;
+      if (full)
+        clockpro_run_hand_cold(cp, result);
+      nodes[id].list = CP_HOT;
+      nodes[id].flags = CP_RESIDENT;
+      nodes[id].ref = 0;
+      nodes[id].dirty = is_write;
+      clockpro_link(cp, id);
+      cp->hot_count++;
+      clockpro_balance(cp);
+    } else {
+      if (full)
+        clockpro_run_hand_cold(cp, result);
+      id = new_page(cache, vpn, is_write);
+      nodes[id].list = CP_COLD;
+      nodes[id].flags = CP_RESIDENT | CP_TEST;
+      clockpro_link(cp, id);
+      cp->cold_count++;
+    }
+    while (cp->nonresident > cp->capacity)
+      clockpro_run_hand_test(cp);
+  }
+}
 
-  run_simulation("LRU", frame_sizes, num_sizes, file_path);
-  run_simulation("CFLRU", frame_sizes, num_sizes, file_path);
+// ARC (Megiddo, Modha, FAST '03): T1 holds pages seen once recently, T2
+// pages seen at least twice; B1/B2 remember what was evicted from them. A
+// ghost hit moves the T1 target p toward the list that would have kept it.
+#define ARC_T1 1
+#define ARC_T2 2
+#define ARC_B1 3
+#define ARC_B2 4
+
+typedef struct {
+  Cache *cache;
+  int capacity;
+  int p; // target size of T1
+  List t1, t2, b1, b2;
+} ArcState;
+
+void *arc_create(int capacity) {
+  ArcState *arc = (ArcState *)calloc(1, sizeof(ArcState));
+  arc->cache = init_cache_with_ghosts(capacity, capacity + 1);
+  arc->capacity = capacity;
+  return arc;
+}
+
+void arc_destroy(void *state) {
+  ArcState *arc = (ArcState *)state;
+  free_cache(arc->cache);
+  free(arc);
+}
+
+void arc_occupancy(void *state, int *resident, int *dirty) {
+  ArcState *arc = (ArcState *)state;
+  *resident = arc->t1.size + arc->t2.size;
+  *dirty = count_dirty(arc->cache);
+}
+
+// Move the LRU page of T1 or T2 to its ghost list
+void arc_replace(ArcState *arc, SimResult *result, int in_b2) {
+  Cache *cache = arc->cache;
+  NodeId victim;
+  if (arc->t1.size > 0 &&
+      (arc->t1.size > arc->p || (in_b2 && arc->t1.size == arc->p))) {
+    victim = arc->t1.tail;
+    list_remove(cache, &arc->t1, victim);
+    list_push_head(cache, &arc->b1, victim);
+    cache->nodes[victim].list = ARC_B1;
+  } else {
+    victim = arc->t2.tail;
+    list_remove(cache, &arc->t2, victim);
+    list_push_head(cache, &arc->b2, victim);
+    cache->nodes[victim].list = ARC_B2;
+  }
+  page_out(cache, result, victim);
+}
+
+void arc_run(void *state, SimResult *result, const unsigned long *refs,
+             long count) {
+  ArcState *arc = (ArcState *)state;
+  Cache *cache = arc->cache;
+  Node *nodes = cache->nodes;
+  int c = arc->capacity;
+
+  for (long j = 0; j < count; j++) {
+    unsigned long vpn = REF_VPN(refs[j]);
+    int is_write = REF_IS_WRITE(refs[j]);
+
+    NodeId id = find_in_hash(cache, vpn);
+    int list = id ? nodes[id].list : 0;
+    if (list == ARC_T1 || list == ARC_T2) {
+      result->hits++;
+      list_remove(cache, list == ARC_T1 ? &arc->t1 : &arc->t2, id);
+      list_push_head(cache, &arc->t2, id);
+      nodes[id].list = ARC_T2;
+      nodes[id].dirty |= is_write;
+      continue;
+    }
+
+    result->misses++;
+    if (list == ARC_B1) {
+      int delta = arc->b2.size > arc->b1.size ? arc->b2.size / arc->b1.size : 1;
+      arc->p = arc->p + delta < c ? arc->p + delta : c;
+      arc_replace(arc, result, 0);
+      list_remove(cache, &arc->b1, id);
+    } else if (list == ARC_B2) {
+      int delta = arc->b1.size > arc->b2.size ? arc->b1.size / arc->b2.size : 1;
+      arc->p = arc->p - delta > 0 ? arc->p - delta : 0;
+      arc_replace(arc, result, 1);
+      list_remove(cache, &arc->b2, id);
+    } else {
+      int l1 = arc->t1.size + arc->b1.size;
+      int total = l1 + arc->t2.size + arc->b2.size;
+      if (l1 == c) {
+        if (arc->t1.size < c) {
+          NodeId ghost = arc->b1.tail;
+          list_remove(cache, &arc->b1, ghost);
+          drop_page(cache, ghost);
+          arc_replace(arc, result, 0);
+        } else { // B1 is empty, T1's LRU page goes without a trace
+          NodeId victim = arc->t1.tail;
+          list_remove(cache, &arc->t1, victim);
+          page_out(cache, result, victim);
+          drop_page(cache, victim);
+        }
+      } else if (total >= c) {
+        if (total == 2 * c) {
+          NodeId ghost = arc->b2.tail;
+          list_remove(cache, &arc->b2, ghost);
+          drop_page(cache, ghost);
+        }
+        arc_replace(arc, result, 0);
+      }
+      id = new_page(cache, vpn, is_write);
+      list_push_head(cache, &arc->t1, id);
+      nodes[id].list = ARC_T1;
+      continue;
+    }
+
+    // ghost hit: back in memory, seen twice
+    list_push_head(cache, &arc->t2, id);
+    nodes[id].list = ARC_T2;
+    nodes[id].dirty = is_write;
+  }
+}
+
+// 2Q (Johnson, Shasha, VLDB '94), full version: first references go to the
+// A1in FIFO (Kin = 25% of the frames); pages pushed out of it are remembered
+// in A1out (Kout = 50%), and a reference there promotes the page to the Am
+// LRU list. Hits in A1in do not reorder it.
+#define TWOQ_AM 1
+#define TWOQ_A1IN 2
+#define TWOQ_A1OUT 3
+
+typedef struct {
+  Cache *cache;
+  int capacity;
+  int kin;
+  int kout;
+  List am, a1in, a1out;
+} TwoQState;
+
+void *twoq_create(int capacity) {
+  TwoQState *twoq = (TwoQState *)calloc(1, sizeof(TwoQState));
+  twoq->capacity = capacity;
+  twoq->kin = capacity / 4 > 0 ? capacity / 4 : 1;
+  twoq->kout = capacity / 2 > 0 ? capacity / 2 : 1;
+  twoq->cache = init_cache_with_ghosts(capacity, twoq->kout + 1);
+  return twoq;
+}
+
+void twoq_destroy(void *state) {
+  TwoQState *twoq = (TwoQState *)state;
+  free_cache(twoq->cache);
+  free(twoq);
+}
+
+void twoq_occupancy(void *state, int *resident, int *dirty) {
+  TwoQState *twoq = (TwoQState *)state;
+  *resident = twoq->am.size + twoq->a1in.size;
+  *dirty = count_dirty(twoq->cache);
+}
+
+// Make room for one page
+void twoq_reclaim(TwoQState *twoq, SimResult *result) {
+  Cache *cache = twoq->cache;
+  if (twoq->am.size + twoq->a1in.size < twoq->capacity)
+    return;
+  if (twoq->a1in.size > twoq->kin) {
+    NodeId victim = twoq->a1in.tail;
+    list_remove(cache, &twoq->a1in, victim);
+    page_out(cache, result, victim);
+    list_push_head(cache, &twoq->a1out, victim);
+    cache->nodes[victim].list = TWOQ_A1OUT;
+    if (twoq->a1out.size > twoq->kout) {
+      NodeId ghost = twoq->a1out.tail;
+      list_remove(cache, &twoq->a1out, ghost);
+      drop_page(cache, ghost);
+    }
+  } else {
+    NodeId victim = twoq->am.tail;
+    list_remove(cache, &twoq->am, victim);
+    page_out(cache, result, victim);
+    drop_page(cache, victim);
+  }
+}
+
+void twoq_run(void *state, SimResult *result, const unsigned long *refs,
+              long count) {
+  TwoQState *twoq = (TwoQState *)state;
+  Cache *cache = twoq->cache;
+  Node *nodes = cache->nodes;
+
+  for (long j = 0; j < count; j++) {
+    unsigned long vpn = REF_VPN(refs[j]);
+    int is_write = REF_IS_WRITE(refs[j]);
+
+    NodeId id = find_in_hash(cache, vpn);
+    int list = id ? nodes[id].list : 0;
+    if (list == TWOQ_AM || list == TWOQ_A1IN) {
+      result->hits++;
+      if (list == TWOQ_AM)
+        list_move_to_head(cache, &twoq->am, id);
+      nodes[id].dirty |= is_write;
+      continue;
+    }
+
+    result->misses++;
+    if (list == TWOQ_A1OUT) {
+      list_remove(cache, &twoq->a1out, id);
+      twoq_reclaim(twoq, result);
+      list_push_head(cache, &twoq->am, id);
+      nodes[id].list = TWOQ_AM;
+      nodes[id].dirty = is_write;
+    } else {
+      twoq_reclaim(twoq, result);
+      id = new_page(cache, vpn, is_write);
+      list_push_head(cache, &twoq->a1in, id);
+      nodes[id].list = TWOQ_A1IN;
+    }
+  }
+}
+
+// LIRS (Jiang, Zhang, SIGMETRICS '02): pages with a small inter-reference
+// recency (LIR, ~99% of the frames) stay; the rest of the frames hold HIR
+// pages in FIFO queue Q. Stack S orders pages by recency with an LIR page at
+// the bottom; a HIR page referenced again while still in S becomes LIR and
+// the bottom LIR page is demoted. Evicted HIR pages stay in S as
+// non-resident entries, capped at capacity (oldest dropped first).
+#define LIRS_LIR 1
+#define LIRS_HIR 2      // resident HIR
+#define LIRS_GHOST 3    // non-resident HIR
+#define LIRS_IN_STACK 1 // flags
+
+typedef struct {
+  Cache *cache;
+  int capacity;
+  int lir_limit;
+  int lir_count;
+  List stack;  // S, through prev/next, head = top
+  List queue;  // Q, through aux links, resident HIR pages
+  List ghosts; // through aux links, non-resident HIR pages in S
+} LirsState;
+
+void *lirs_create(int capacity) {
+  LirsState *lirs = (LirsState *)calloc(1, sizeof(LirsState));
+  int hir_limit = capacity / 100 > 0 ? capacity / 100 : 1;
+  lirs->cache = init_cache_with_ghosts(capacity, capacity + 1);
+  lirs->capacity = capacity;
+  lirs->lir_limit = capacity - hir_limit > 0 ? capacity - hir_limit : 1;
+  lirs->queue.aux = 1;
+  lirs->ghosts.aux = 1;
+  return lirs;
+}
+
+void lirs_destroy(void *state) {
+  LirsState *lirs = (LirsState *)state;
+  free_cache(lirs->cache);
+  free(lirs);
+}
+
+void lirs_occupancy(void *state, int *resident, int *dirty) {
+  LirsState *lirs = (LirsState *)state;
+  *resident = lirs->lir_count + lirs->queue.size;
+  *dirty = count_dirty(lirs->cache);
+}
+
+void lirs_leave_stack(LirsState *lirs, NodeId id) {
+  list_remove(lirs->cache, &lirs->stack, id);
+  lirs->cache->nodes[id].flags &= ~LIRS_IN_STACK;
+}
+
+// Pop HIR entries off the bottom of S until an LIR page is there
+void lirs_prune(LirsState *lirs) {
+  Node *nodes = lirs->cache->nodes;
+  while (lirs->stack.tail && nodes[lirs->stack.tail].list != LIRS_LIR) {
+    NodeId id = lirs->stack.tail;
+    lirs_leave_stack(lirs, id);
+    if (nodes[id].list == LIRS_GHOST) {
+      list_remove(lirs->cache, &lirs->ghosts, id);
+      drop_page(lirs->cache, id);
+    }
+  }
+}
+
+// A page just became LIR: the bottom LIR page becomes resident HIR
+void lirs_demote_bottom(LirsState *lirs) {
+  NodeId bottom = lirs->stack.tail;
+  lirs->cache->nodes[bottom].list = LIRS_HIR;
+  lirs->lir_count--;
+  lirs_leave_stack(lirs, bottom);
+  list_push_head(lirs->cache, &lirs->queue, bottom);
+  lirs_prune(lirs);
+}
+
+void lirs_run(void *state, SimResult *result, const unsigned long *refs,
+              long count) {
+  LirsState *lirs = (LirsState *)state;
+  Cache *cache = lirs->cache;
+  Node *nodes = cache->nodes;
+
+  for (long j = 0; j < count; j++) {
+    unsigned long vpn = REF_VPN(refs[j]);
+    int is_write = REF_IS_WRITE(refs[j]);
+
+    NodeId id = find_in_hash(cache, vpn);
+    int list = id ? nodes[id].list : 0;
+    if (list == LIRS_LIR) {
+      result->hits++;
+      nodes[id].dirty |= is_write;
+      int was_bottom = lirs->stack.tail == id;
+      list_move_to_head(cache, &lirs->stack, id);
+      if (was_bottom)
+        lirs_prune(lirs);
+      continue;
+    }
+    if (list == LIRS_HIR) {
+      result->hits++;
+      nodes[id].dirty |= is_write;
+      if (nodes[id].flags & LIRS_IN_STACK) {
+        list_move_to_head(cache, &lirs->stack, id);
+        list_remove(cache, &lirs->queue, id);
+        nodes[id].list = LIRS_LIR;
+        lirs->lir_count++;
+        lirs_demote_bottom(lirs);
+      } else {
+        list_push_head(cache, &lirs->stack, id);
+        nodes[id].flags |= LIRS_IN_STACK;
+        list_move_to_head(cache, &lirs->queue, id);
+      }
+      continue;
+    }
+
+    result->misses++;
+    if (!id && lirs->lir_count < lirs->lir_limit) { // warming up
+      id = new_page(cache, vpn, is_write);
+      nodes[id].list = LIRS_LIR;
+      nodes[id].flags = LIRS_IN_STACK;
+      list_push_head(cache, &lirs->stack, id);
+      lirs->lir_count++;
+      continue;
+    }
+
+    if (id) // keep the ghost away from the cap below
+      list_remove(cache, &lirs->ghosts, id);
+
+    if (lirs->lir_count + lirs->queue.size == lirs->capacity) {
+      // evict the oldest resident HIR page
+      NodeId victim = lirs->queue.tail;
+      list_remove(cache, &lirs->queue, victim);
+      page_out(cache, result, victim);
+      if (nodes[victim].flags & LIRS_IN_STACK) {
+        nodes[victim].list = LIRS_GHOST;
+        list_push_head(cache, &lirs->ghosts, victim);
+        if (lirs->ghosts.size > lirs->capacity) {
+          NodeId ghost = lirs->ghosts.tail;
+          list_remove(cache, &lirs->ghosts, ghost);
+          lirs_leave_stack(lirs, ghost);
+          drop_page(cache, ghost);
+        }
+      } else {
+        drop_page(cache, victim);
+      }
+    }
+
+    if (id) { // non-resident HIR still in S: small recency, becomes LIR
+      nodes[id].list = LIRS_LIR;
+      nodes[id].dirty = is_write;
+      list_move_to_head(cache, &lirs->stack, id);
+      lirs->lir_count++;
+      lirs_demote_bottom(lirs);
+    } else {
+      id = new_page(cache, vpn, is_write);
+      nodes[id].list = LIRS_HIR;
+      nodes[id].flags = LIRS_IN_STACK;
+      list_push_head(cache, &lirs->stack, id);
+      list_push_head(cache, &lirs->queue, id);
+    }
+  }
+}
+
+// S3-FIFO (Yang et al., SOSP '23): new pages enter a small FIFO S (10% of
+// the frames); only those referenced again while in S move to the main
+// FIFO M, the others are remembered in ghost FIFO G (as many entries as M
+// has frames) so that a quick return goes straight to M. M reinserts pages
+// with a non-zero 2-bit frequency, decrementing it.
+#define S3_SMALL 1
+#define S3_MAIN 2
+#define S3_GHOST 3
+
+typedef struct {
+  Cache *cache;
+  int capacity;
+  int small_limit;
+  int main_limit; // also the ghost FIFO's length
+  List small, main, ghost;
+} S3FifoState;
+
+void *s3fifo_create(int capacity) {
+  S3FifoState *s3 = (S3FifoState *)calloc(1, sizeof(S3FifoState));
+  s3->capacity = capacity;
+  s3->small_limit = capacity / 10 > 0 ? capacity / 10 : 1;
+  s3->main_limit = capacity - s3->small_limit > 0 ? capacity - s3->small_limit
+                                                  : 1;
+  s3->cache = init_cache_with_ghosts(capacity, s3->main_limit + 2);
+  return s3;
+}
+
+void s3fifo_destroy(void *state) {
+  S3FifoState *s3 = (S3FifoState *)state;
+  free_cache(s3->cache);
+  free(s3);
+}
+
+void s3fifo_occupancy(void *state, int *resident, int *dirty) {
+  S3FifoState *s3 = (S3FifoState *)state;
+  *resident = s3->small.size + s3->main.size;
+  *dirty = count_dirty(s3->cache);
+}
+
+void s3fifo_evict_main(S3FifoState *s3, SimResult *result) {
+  Cache *cache = s3->cache;
+  for (;;) {
+    NodeId id = s3->main.tail;
+    if (cache->nodes[id].ref > 0) {
+      cache->nodes[id].ref--;
+      list_move_to_head(cache, &s3->main, id);
+      continue;
+    }
+    list_remove(cache, &s3->main, id);
+    page_out(cache, result, id);
+    drop_page(cache, id);
+    return;
+  }
+}
+
+void s3fifo_evict_small(S3FifoState *s3, SimResult *result) {
+  Cache *cache = s3->cache;
+  while (s3->small.size > 0) {
+    NodeId id = s3->small.tail;
+    list_remove(cache, &s3->small, id);
+    if (cache->nodes[id].ref > 1) {
+      cache->nodes[id].list = S3_MAIN;
+      cache->nodes[id].ref = 0;
+      list_push_head(cache, &s3->main, id);
+      if (s3->main.size > s3->main_limit)
+        s3fifo_evict_main(s3, result);
+      continue;
+    }
+    page_out(cache, result, id);
+    cache->nodes[id].list = S3_GHOST;
+    list_push_head(cache, &s3->ghost, id);
+    if (s3->ghost.size > s3->main_limit) {
+      NodeId ghost = s3->ghost.tail;
+      list_remove(cache, &s3->ghost, ghost);
+      drop_page(cache, ghost);
+    }
+    return;
+  }
+}
+
+void s3fifo_run(void *state, SimResult *result, const unsigned long *refs,
+                long count) {
+  S3FifoState *s3 = (S3FifoState *)state;
+  Cache *cache = s3->cache;
+  Node *nodes = cache->nodes;
+
+  for (long j = 0; j < count; j++) {
+    unsigned long vpn = REF_VPN(refs[j]);
+    int is_write = REF_IS_WRITE(refs[j]);
+
+    NodeId id = find_in_hash(cache, vpn);
+    int list = id ? nodes[id].list : 0;
+    if (list == S3_SMALL || list == S3_MAIN) {
+      result->hits++;
+      if (nodes[id].ref < 3)
+        nodes[id].ref++;
+      nodes[id].dirty |= is_write;
+      continue;
+    }
+
+    result->misses++;
+    if (id) // keep the ghost away from the eviction below
+      list_remove(cache, &s3->ghost, id);
+    while (s3->small.size + s3->main.size >= s3->capacity) {
+      if (s3->small.size >= s3->small_limit)
+        s3fifo_evict_small(s3, result);
+      else
+        s3fifo_evict_main(s3, result);
+    }
+
+    if (id) {
+      nodes[id].list = S3_MAIN;
+      nodes[id].ref = 0;
+      nodes[id].dirty = is_write;
+      list_push_head(cache, &s3->main, id);
+    } else {
+      id = new_page(cache, vpn, is_write);
+      nodes[id].list = S3_SMALL;
+      list_push_head(cache, &s3->small, id);
+    }
+  }
+}
+
+// Belady's MIN (OPT) evicts the resident page referenced furthest in the
+// future, which gives the fewest misses possible. OPT-WB also weighs write
+// backs: keeping a page until its next reference ties up a frame for that
+// distance, and evicting it costs a miss plus write_cost if it is dirty.
+// It evicts the page with the lowest cost per frame-time freed. That is the
+// best clean page (furthest away) unless the best dirty page is more than
+// 1 + write_cost times further. Exact minimum cost with two eviction costs
+// needs min-cost flow; this greedy is the usual practical bound.
+// Both need the whole trace up front (offline), not available with -t.
+
+// Max-heap of pool ids ordered by key[id] (position of the next reference)
+typedef struct {
+  NodeId *ids;
+  uint32_t *pos; // by id: index in ids
+  int size;
+} UseHeap;
+
+void heap_swap(UseHeap *heap, int a, int b) {
+  NodeId tmp = heap->ids[a];
+  heap->ids[a] = heap->ids[b];
+  heap->ids[b] = tmp;
+  heap->pos[heap->ids[a]] = a;
+  heap->pos[heap->ids[b]] = b;
+}
+
+void heap_sift_up(UseHeap *heap, const uint32_t *key, int i) {
+  while (i > 0 && key[heap->ids[(i - 1) / 2]] < key[heap->ids[i]]) {
+    heap_swap(heap, i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+}
+
+void heap_sift_down(UseHeap *heap, const uint32_t *key, int i) {
+  for (;;) {
+    int largest = i;
+    int left = 2 * i + 1;
+    int right = left + 1;
+    if (left < heap->size && key[heap->ids[left]] > key[heap->ids[largest]])
+      largest = left;
+    if (right < heap->size && key[heap->ids[right]] > key[heap->ids[largest]])
+      largest = right;
+    if (largest == i)
+      return;
+    heap_swap(heap, i, largest);
+    i = largest;
+  }
+}
+
+void heap_push(UseHeap *heap, const uint32_t *key, NodeId id) {
+  heap->ids[heap->size] = id;
+  heap->pos[id] = heap->size;
+  heap_sift_up(heap, key, heap->size++);
+}
+
+void heap_remove(UseHeap *heap, const uint32_t *key, NodeId id) {
+  int i = heap->pos[id];
+  heap_swap(heap, i, --heap->size);
+  if (i < heap->size) {
+    heap_sift_up(heap, key, i);
+    heap_sift_down(heap, key, i);
+  }
+}
+
+typedef struct {
+  Cache *cache; // pool and page table only
+  int dirty_aware;
+  uint32_t *key;       // by id: position of the page's next reference
+  UseHeap pages;       // every page (OPT) or the clean ones (OPT-WB)
+  UseHeap dirty_pages; // OPT-WB only
+} OptState;
+
+void *opt_create_variant(int capacity, int dirty_aware) {
+  OptState *opt = (OptState *)calloc(1, sizeof(OptState));
+  opt->cache = init_cache(capacity);
+  opt->dirty_aware = dirty_aware;
+  opt->key = (uint32_t *)malloc((capacity + 1) * sizeof(uint32_t));
+  UseHeap *heaps[] = {&opt->pages, &opt->dirty_pages};
+  for (int i = 0; i < 2; i++) {
+    heaps[i]->ids = (NodeId *)malloc(capacity * sizeof(NodeId));
+    heaps[i]->pos = (uint32_t *)malloc((capacity + 1) * sizeof(uint32_t));
+  }
+  return opt;
+}
+
+void *opt_create(int capacity) { return opt_create_variant(capacity, 0); }
+
+void *opt_wb_create(int capacity) { return opt_create_variant(capacity, 1); }
+
+void opt_destroy(void *state) {
+  OptState *opt = (OptState *)state;
+  free_cache(opt->cache);
+  free(opt->key);
+  free(opt->pages.ids);
+  free(opt->pages.pos);
+  free(opt->dirty_pages.ids);
+  free(opt->dirty_pages.pos);
+  free(opt);
+}
+
+void opt_occupancy(void *state, int *resident, int *dirty) {
+  cache_occupancy(((OptState *)state)->cache, resident, dirty);
+}
+
+// next_use[j]: position of the next reference to trace_refs[j]'s page, or
+// NEVER. One reverse pass, shared by every OPT simulation of the trace.
+#define NEVER UINT32_MAX
+pthread_mutex_t next_use_lock = PTHREAD_MUTEX_INITIALIZER;
+
+const uint32_t *trace_next_uses() {
+  pthread_mutex_lock(&next_use_lock);
+  if (!trace_next_use) {
+    uint32_t *next = (uint32_t *)malloc(trace_count * sizeof(uint32_t));
+    PageMap last; // vpn -> position of its next reference
+    page_map_init(&last, 1 << 16);
+    for (long j = trace_count - 1; j >= 0; j--) {
+      int is_new;
+      uint32_t *slot = page_map_slot(&last, REF_VPN(trace_refs[j]), &is_new);
+      next[j] = is_new ? NEVER : *slot;
+      *slot = j;
+    }
+    page_map_free(&last);
+    trace_next_use = next;
+  }
+  pthread_mutex_unlock(&next_use_lock);
+  return trace_next_use;
+}
+
+NodeId opt_victim(OptState *opt, long now) {
+  if (opt->dirty_pages.size == 0)
+    return opt->pages.ids[0];
+  if (opt->pages.size == 0)
+    return opt->dirty_pages.ids[0];
+  uint32_t clean = opt->key[opt->pages.ids[0]];
+  uint32_t dirty = opt->key[opt->dirty_pages.ids[0]];
+  if (clean == NEVER) // free to drop
+    return opt->pages.ids[0];
+  if (dirty == NEVER ||
+      (double)(dirty - now) > (1 + write_cost) * (double)(clean - now))
+    return opt->dirty_pages.ids[0];
+  return opt->pages.ids[0];
+}
+
+void opt_run(void *state, SimResult *result, const unsigned long *refs,
+             long count) {
+  OptState *opt = (OptState *)state;
+  Cache *cache = opt->cache;
+  Node *nodes = cache->nodes;
+  uint32_t *key = opt->key;
+
+  // refs may be a slice of the loaded trace (-I), never a copy
+  if (refs < trace_refs || refs + count > trace_refs + trace_count ||
+      trace_count >= (long)NEVER) {
+    fprintf(stderr, "OPT needs the whole trace loaded (< %u references)\n",
+            NEVER);
+    exit(1);
+  }
+  const uint32_t *next_use = trace_next_uses() + (refs - trace_refs);
+  long now = refs - trace_refs;
+
+  for (long j = 0; j < count; j++) {
+    unsigned long vpn = REF_VPN(refs[j]);
+    int is_write = REF_IS_WRITE(refs[j]);
+
+    NodeId id = find_in_hash(cache, vpn);
+    if (id) {
+      result->hits++;
+      // its key was j, the smallest; it moves back to its next reference
+      UseHeap *heap = opt->dirty_aware && nodes[id].dirty ? &opt->dirty_pages
+                                                          : &opt->pages;
+      if (opt->dirty_aware && is_write && !nodes[id].dirty) {
+        heap_remove(heap, key, id);
+        key[id] = next_use[j];
+        heap_push(&opt->dirty_pages, key, id);
+      } else {
+        key[id] = next_use[j];
+        heap_sift_down(heap, key, heap->pos[id]);
+        heap_sift_up(heap, key, heap->pos[id]);
+      }
+      nodes[id].dirty |= is_write;
+      continue;
+    }
+
+    result->misses++;
+    if (cache->size == cache->capacity) {
+      NodeId victim = opt_victim(opt, now + j);
+      heap_remove(opt->dirty_aware && nodes[victim].dirty ? &opt->dirty_pages
+                                                          : &opt->pages,
+                  key, victim);
+      page_out(cache, result, victim);
+      drop_page(cache, victim);
+      cache->size--;
+    }
+    id = new_page(cache, vpn, is_write);
+    cache->size++;
+    key[id] = next_use[j];
+    heap_push(opt->dirty_aware && is_write ? &opt->dirty_pages : &opt->pages,
+              key, id);
+  }
+}
+
+const Policy policy_table[] = {
+    {"LRU", create_cache, destroy_cache, run_lru, cache_occupancy, 0},
+    {"CFLRU", create_cache, destroy_cache, run_cflru, cache_occupancy, 0},
+    {"ACFLRU", adaptive_create, adaptive_destroy, adaptive_run,
+     adaptive_occupancy, 0},
+    {"CLOCK", clock_create, clock_destroy, clock_run, clock_occupancy, 0},
+    {"CLOCK-Pro", clockpro_create, clockpro_destroy, clockpro_run,
+     clockpro_occupancy, 0},
+    {"ARC", arc_create, arc_destroy, arc_run, arc_occupancy, 0},
+    {"2Q", twoq_create, twoq_destroy, twoq_run, twoq_occupancy, 0},
+    {"LIRS", lirs_create, lirs_destroy, lirs_run, lirs_occupancy, 0},
+    {"S3-FIFO", s3fifo_create, s3fifo_destroy, s3fifo_run, s3fifo_occupancy,
+     0},
+    {"OPT", opt_create, opt_destroy, opt_run, opt_occupancy, 1},
+    {"OPT-WB", opt_wb_create, opt_destroy, opt_run, opt_occupancy, 1},
+};
+#define NUM_POLICIES ((int)(sizeof(policy_table) / sizeof(policy_table[0])))
+
+const Policy *find_policy(const char *name) {
+  for (int i = 0; i < NUM_POLICIES; i++)
+    if (strcasecmp(policy_table[i].name, name) == 0)
+      return &policy_table[i];
+  return NULL;
+}
+
+// Comma separated policy names, or "all"; returns the count or -1
+int parse_policies(char *list, const Policy *policies[]) {
+  int num = 0;
+  for (char *name = strtok(list, ","); name; name = strtok(NULL, ",")) {
+    if (strcasecmp(name, "all") == 0) {
+      for (int i = 0; i < NUM_POLICIES; i++)
+        policies[i] = &policy_table[i];
+      return NUM_POLICIES;
+    }
+    const Policy *policy = find_policy(name);
+    if (!policy || num == NUM_POLICIES) {
+      fprintf(stderr, "Unknown policy %s\n", name);
+      return -1;
+    }
+    policies[num++] = policy;
+  }
+  return num;
+}
+
+// Replay the whole trace through one cache of result->capacity frames
+void simulate(SimResult *result) {
+  struct timeval start;
+  gettimeofday(&start, NULL);
+
+  const Policy *policy = result->policy;
+  void *state = policy->create(result->capacity);
+  result->hits = 0;
+  result->misses = 0;
+  result->write_backs = 0;
+  if (metrics_interval > 0) {
+    // the same run cut into intervals, the loops themselves are untouched
+    long num = (trace_count + metrics_interval - 1) / metrics_interval;
+    result->intervals = (IntervalStats *)calloc(num, sizeof(IntervalStats));
+    for (long k = 0; k < num; k++) {
+      long first = k * metrics_interval;
+      long n = trace_count - first < metrics_interval ? trace_count - first
+                                                       : metrics_interval;
+      IntervalStats *stats = &result->intervals[k];
+      stats->hits = result->hits;
+      stats->misses = result->misses;
+      stats->write_backs = result->write_backs;
+      policy->run(state, result, trace_refs + first, n);
+      stats->hits = result->hits - stats->hits;
+      stats->misses = result->misses - stats->misses;
+      stats->write_backs = result->write_backs - stats->write_backs;
+      policy->occupancy(state, &stats->resident, &stats->dirty);
+    }
+  } else {
+    policy->run(state, result, trace_refs, trace_count);
+  }
+  policy->destroy(state);
+
+  result->seconds = elapsed_since(&start);
+}
+
+// --- Interval metrics (-I) ---
+// Working set (distinct pages referenced) per interval and phase changes,
+// which only depend on the trace, so they are computed once. Consecutive
+// intervals are compared by the relative distance |W1 ^ W2| / |W1 | W2| of
+// their signatures (Dhodapkar and Smith), and a distance above
+// PHASE_THRESHOLD starts a new phase. A signature holds the pages referenced
+// at least twice in the interval: one-off pages (scans, cold misses) would
+// otherwise swamp the distance of any trace with a streaming component.
+#define PHASE_THRESHOLD 0.5
+
+typedef struct {
+  unsigned long working_set;
+  double distance; // to the previous interval's signature
+  int phase;
+} IntervalPhase;
+
+// Per page: last interval it was referenced in (+ 1) << 2, whether it was
+// in the signature of the interval before that, and whether it is in the
+// last interval's signature
+#define SEEN_IN_PREVIOUS 2
+#define SEEN_TWICE 1
+
+IntervalPhase *interval_phases;
+
+void compute_phases() {
+  long num = (trace_count + metrics_interval - 1) / metrics_interval;
+  interval_phases = (IntervalPhase *)calloc(num, sizeof(IntervalPhase));
+  PageMap seen;
+  page_map_init(&seen, 1 << 16);
+  unsigned long previous = 0; // size of the previous signature
+  int phase = 0;
+
+  for (long k = 0; k < num; k++) {
+    unsigned long distinct = 0;
+    unsigned long signature = 0;
+    unsigned long shared = 0; // also in the previous signature
+    uint32_t tag = (uint32_t)(k + 1) << 2;
+    long end = (k + 1) * metrics_interval < trace_count
+                   ? (k + 1) * metrics_interval
+                   : trace_count;
+    for (long j = k * metrics_interval; j < end; j++) {
+      int is_new;
+      uint32_t *state = page_map_slot(&seen, REF_VPN(trace_refs[j]), &is_new);
+      if (is_new || (*state & ~3u) < tag) { // first reference in interval k
+        int in_previous =
+            !is_new && (*state & ~3u) == tag - 4 && (*state & SEEN_TWICE);
+        *state = tag | (in_previous ? SEEN_IN_PREVIOUS : 0);
+        distinct++;
+      } else if (!(*state & SEEN_TWICE)) {
+        *state |= SEEN_TWICE;
+        signature++;
+        if (*state & SEEN_IN_PREVIOUS)
+          shared++;
+      }
+    }
+
+    IntervalPhase *current = &interval_phases[k];
+    unsigned long union_size = signature + previous - shared;
+    current->working_set = distinct;
+    if (k > 0 && union_size > 0)
+      current->distance =
+          (double)(signature + previous - 2 * shared) / union_size;
+    if (current->distance > PHASE_THRESHOLD)
+      phase++;
+    current->phase = phase;
+    previous = signature;
+  }
+  page_map_free(&seen);
+}
+
+void write_metrics_header() {
+  fprintf(metrics_file, "policy,frames,interval,first_ref,refs,hits,misses,"
+                        "hit_ratio,write_backs,dirty_fraction,resident,"
+                        "working_set,ws_distance,phase\n");
+}
+
+// CSV rows of one simulation, then drop them
+void write_intervals(SimResult *result) {
+  if (!result->intervals)
+    return;
+  long num = (trace_count + metrics_interval - 1) / metrics_interval;
+  for (long k = 0; k < num; k++) {
+    IntervalStats *stats = &result->intervals[k];
+    IntervalPhase *phase = &interval_phases[k];
+    unsigned long refs = stats->hits + stats->misses;
+    fprintf(metrics_file, "%s,%d,%ld,%ld,%lu,%lu,%lu,%.6f,%lu,%.6f,%d,%lu,"
+                          "%.4f,%d\n",
+            result->policy->name, result->capacity, k, k * metrics_interval,
+            refs, stats->hits, stats->misses, (double)stats->hits / refs,
+            stats->write_backs,
+            stats->resident ? (double)stats->dirty / stats->resident : 0,
+            stats->resident, phase->working_set, phase->distance,
+            phase->phase);
+  }
+  free(result->intervals);
+  result->intervals = NULL;
+}
+
+void print_result(SimResult *result) {
+  print_row(result->capacity, result->hits, result->misses,
+            result->write_backs);
+}
+
+// Tables for simulations that overlapped in time: rows[p * num_sizes + i] is
+// policy p with frame_sizes[i], and a policy's elapsed time is the sum of
+// its simulations
+void print_tables(const Policy *policies[], int num_policies,
+                  SimResult **rows, int num_sizes) {
+  for (int p = 0; p < num_policies; p++) {
+    print_header(policies[p]->name);
+    double total_time = 0;
+    for (int i = 0; i < num_sizes; i++) {
+      print_result(rows[p * num_sizes + i]);
+      total_time += rows[p * num_sizes + i]->seconds;
+    }
+    printf("Total elapsed time %.6f sec\n\n", total_time);
+  }
+}
+
+void run_simulation(const Policy *policy, int frame_sizes[], int num_sizes,
+                    const char *filepath) {
+  print_header(policy->name);
+
+  struct timeval start;
+  gettimeofday(&start, NULL);
+
+  for (int i = 0; i < num_sizes; i++) { // {4096, 8192, 16384, 32768, 65536}
+    SimResult result = {.policy = policy, .capacity = frame_sizes[i]};
+    simulate(&result);
+    print_result(&result);
+    write_intervals(&result);
+  }
+
+  double total_time = elapsed_since(&start);
+  printf("Total elapsed time %.6f sec\n\n", total_time);
+}
+
+// --- Parallel mode ---
+// Every (policy, capacity) simulation owns its Cache and only reads the
+// trace buffers, so they can all run at once. Worker threads take the next
+// task from a shared counter, biggest caches first since they run longest.
+
+typedef struct {
+  SimResult *tasks;
+  int num_tasks;
+  int next_task; // taken with an atomic fetch-and-add
+} TaskQueue;
+
+void *simulation_worker(void *arg) {
+  TaskQueue *queue = (TaskQueue *)arg;
+  int i;
+  while ((i = __atomic_fetch_add(&queue->next_task, 1, __ATOMIC_RELAXED)) <
+         queue->num_tasks)
+    simulate(&queue->tasks[i]);
+  return NULL;
+}
+
+void run_parallel(const Policy *policies[], int num_policies, int frame_sizes[],
+                  int num_sizes, int num_threads) {
+  struct timeval start;
+  gettimeofday(&start, NULL);
+
+  // Tasks in largest-capacity-first order, slot[] maps table rows to them
+  int num_tasks = num_policies * num_sizes;
+  TaskQueue queue = {(SimResult *)calloc(num_tasks, sizeof(SimResult)),
+                     num_tasks, 0};
+  SimResult **slot = (SimResult **)calloc(num_tasks, sizeof(SimResult *));
+  int t = 0;
+  for (int i = num_sizes - 1; i >= 0; i--) {
+    for (int p = 0; p < num_policies; p++) {
+      queue.tasks[t].policy = policies[p];
+      queue.tasks[t].capacity = frame_sizes[i];
+      slot[p * num_sizes + i] = &queue.tasks[t];
+      t++;
+    }
+  }
+
+  if (num_threads > num_tasks)
+    num_threads = num_tasks;
+  pthread_t *threads = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
+  for (int i = 0; i < num_threads; i++)
+    pthread_create(&threads[i], NULL, simulation_worker, &queue);
+  for (int i = 0; i < num_threads; i++)
+    pthread_join(threads[i], NULL);
+  double wall_time = elapsed_since(&start);
+
+  // Same tables as the sequential run
+  print_tables(policies, num_policies, slot, num_sizes);
+  for (int i = 0; i < num_tasks; i++)
+    write_intervals(slot[i]);
+
+  printf("Simulation times (%d threads):\n", num_threads);
+  double sum = 0;
+  for (int i = 0; i < num_tasks; i++) {
+    printf("%s\t%d\t%.6f sec\n", slot[i]->policy->name, slot[i]->capacity,
+           slot[i]->seconds);
+    sum += slot[i]->seconds;
+  }
+  printf("Wall-clock time %.6f sec (simulations took %.6f sec in total)\n\n",
+         wall_time, sum);
+
+  free(threads);
+  free(slot);
+  free(queue.tasks);
+}
+
+// --- Streaming mode ---
+// The trace is never loaded: a reader thread decodes it into a ring of
+// RING_SLOTS chunk buffers while consumer threads feed every chunk through
+// their share of the simulations. A slot is refilled only after every
+// consumer is done with it, so memory stays at RING_SLOTS chunks however long
+// the trace is.
+
+#define CHUNK_REFS (1 << 18) // references per chunk (2 MB)
+#define RING_SLOTS 2         // double buffering
+
+typedef struct {
+  SimResult result;
+  void *state;     // replay simulation
+  StackSim *stack; // or the single LRU stack distance pass (-S)
+} StreamTask;
+
+typedef struct {
+  TraceReader reader;
+  unsigned long *refs[RING_SLOTS];
+  long count[RING_SLOTS];
+  int pending[RING_SLOTS]; // consumers still working on the slot
+  long produced;           // chunks handed out so far
+  unsigned long total;     // references in them
+  int done;                // reader reached the end of the trace
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+
+  StreamTask *tasks;
+  int num_tasks;
+  int num_consumers;
+} ChunkRing;
+
+typedef struct {
+  ChunkRing *ring;
+  int id; // runs tasks id, id + num_consumers, ...
+} StreamConsumer;
+
+void *stream_reader(void *arg) {
+  ChunkRing *ring = (ChunkRing *)arg;
+  for (long chunk = 0;; chunk++) {
+    int slot = chunk % RING_SLOTS;
+
+    pthread_mutex_lock(&ring->lock);
+    while (ring->pending[slot] > 0)
+      pthread_cond_wait(&ring->changed, &ring->lock);
+    pthread_mutex_unlock(&ring->lock);
+
+    // nobody reads this slot until it is published below
+    long n = trace_reader_next(&ring->reader, ring->refs[slot], CHUNK_REFS);
+
+    pthread_mutex_lock(&ring->lock);
+    if (n == 0) {
+      ring->done = 1;
+    } else {
+      ring->count[slot] = n;
+      ring->pending[slot] = ring->num_consumers;
+      ring->produced = chunk + 1;
+      ring->total += n;
+    }
+    pthread_cond_broadcast(&ring->changed);
+    pthread_mutex_unlock(&ring->lock);
+    if (n == 0)
+      return NULL;
+  }
+}
+
+void *stream_consumer(void *arg) {
+  StreamConsumer *consumer = (StreamConsumer *)arg;
+  ChunkRing *ring = consumer->ring;
+
+  for (long chunk = 0;; chunk++) {
+    int slot = chunk % RING_SLOTS;
+
+    pthread_mutex_lock(&ring->lock);
+    while (ring->produced <= chunk && !ring->done)
+      pthread_cond_wait(&ring->changed, &ring->lock);
+    int finished = ring->produced <= chunk;
+    pthread_mutex_unlock(&ring->lock);
+    if (finished)
+      return NULL;
+
+    const unsigned long *refs = ring->refs[slot];
+    long n = ring->count[slot];
+    for (int i = consumer->id; i < ring->num_tasks; i += ring->num_consumers) {
+      StreamTask *task = &ring->tasks[i];
+      struct timeval start;
+      gettimeofday(&start, NULL);
+      if (task->stack) {
+        for (long j = 0; j < n; j++)
+          stack_access(task->stack, REF_VPN(refs[j]), REF_IS_WRITE(refs[j]));
+      } else {
+        task->result.policy->run(task->state, &task->result, refs, n);
+      }
+      task->result.seconds += elapsed_since(&start);
+    }
+
+    pthread_mutex_lock(&ring->lock);
+    if (--ring->pending[slot] == 0)
+      pthread_cond_broadcast(&ring->changed);
+    pthread_mutex_unlock(&ring->lock);
+  }
+}
+
+// stack_lru: LRU from one stack distance pass, besides the policies
+void run_stream(const char *filepath, const Policy *policies[],
+                int num_policies, int frame_sizes[], int num_sizes,
+                int stack_lru, int curve_step, int num_threads) {
+  struct timeval start;
+  gettimeofday(&start, NULL);
+
+  ChunkRing ring;
+  memset(&ring, 0, sizeof(ring));
+  trace_reader_open(&ring.reader, filepath);
+  for (int i = 0; i < RING_SLOTS; i++)
+    ring.refs[i] = (unsigned long *)malloc(CHUNK_REFS * sizeof(unsigned long));
+  pthread_mutex_init(&ring.lock, NULL);
+  pthread_cond_init(&ring.changed, NULL);
+
+  ring.num_tasks = num_policies * num_sizes + (stack_lru ? 1 : 0);
+  ring.tasks = (StreamTask *)calloc(ring.num_tasks, sizeof(StreamTask));
+  SimResult **rows = (SimResult **)calloc(ring.num_tasks, sizeof(SimResult *));
+  int t = 0;
+  if (stack_lru)
+    ring.tasks[t++].stack =
+        init_stack_sim(max_frame_size(frame_sizes, num_sizes));
+  for (int p = 0; p < num_policies; p++) {
+    for (int i = 0; i < num_sizes; i++, t++) {
+      ring.tasks[t].result.policy = policies[p];
+      ring.tasks[t].result.capacity = frame_sizes[i];
+      ring.tasks[t].state = policies[p]->create(frame_sizes[i]);
+      rows[p * num_sizes + i] = &ring.tasks[t].result;
+    }
+  }
+
+  ring.num_consumers = num_threads < ring.num_tasks ? num_threads
+                                                    : ring.num_tasks;
+  pthread_t reader;
+  pthread_t *threads =
+      (pthread_t *)malloc(ring.num_consumers * sizeof(pthread_t));
+  StreamConsumer *consumers = (StreamConsumer *)malloc(
+      ring.num_consumers * sizeof(StreamConsumer));
+  pthread_create(&reader, NULL, stream_reader, &ring);
+  for (int i = 0; i < ring.num_consumers; i++) {
+    consumers[i].ring = &ring;
+    consumers[i].id = i;
+    pthread_create(&threads[i], NULL, stream_consumer, &consumers[i]);
+  }
+  pthread_join(reader, NULL);
+  for (int i = 0; i < ring.num_consumers; i++)
+    pthread_join(threads[i], NULL);
+  double wall_time = elapsed_since(&start);
+
+  if (stack_lru) {
+    stack_finish(ring.tasks[0].stack);
+    print_stack_result(ring.tasks[0].stack, frame_sizes, num_sizes,
+                       curve_step, ring.tasks[0].result.seconds);
+    free_stack_sim(ring.tasks[0].stack);
+  }
+  print_tables(policies, num_policies, rows, num_sizes);
+
+  printf("Streamed %lu references in %ld chunks of %d (%d consumer "
+         "threads), wall-clock time %.6f sec\n\n",
+         ring.total, ring.produced, CHUNK_REFS, ring.num_consumers, wall_time);
+
+  for (int i = 0; i < ring.num_tasks; i++)
+    if (ring.tasks[i].state)
+      ring.tasks[i].result.policy->destroy(ring.tasks[i].state);
+  for (int i = 0; i < RING_SLOTS; i++)
+    free(ring.refs[i]);
+  trace_reader_close(&ring.reader);
+  pthread_mutex_destroy(&ring.lock);
+  pthread_cond_destroy(&ring.changed);
+  free(consumers);
+  free(threads);
+  free(rows);
+  free(ring.tasks);
+}
+
+// --- SHARDS sampling ---
+// Spatially hashed sampling (Waldspurger et al., FAST '15): a page is in
+// the sample iff its hash is below rate * 2^24, so every reference to a
+// sampled page is kept and reuse distances shrink by the rate. A C-frame
+// cache is estimated by a rate * C-frame cache run over the sample: LRU
+// from one stack distance pass, other policies by miniature simulations.
+// Misses and write backs are scaled by 1 / rate. The sample rarely holds
+// exactly N * rate references (a hot page is either in or out), and the
+// difference is counted as hits (SHARDS-adj), so the miss ratio is sampled
+// misses / (N * rate). The sample is taken while reading, so the trace is
+// never loaded.
+#define SHARDS_MODULUS (1 << 24)
+
+typedef struct {
+  unsigned long *refs;
+  long count; // sampled references
+  long total; // references in the trace
+  double rate;
+} Sample;
+
+void read_sample(Sample *sample, const char *filepath, double rate) {
+  unsigned int threshold = (unsigned int)(rate * SHARDS_MODULUS);
+  unsigned long *chunk =
+      (unsigned long *)malloc(CHUNK_REFS * sizeof(unsigned long));
+  long capacity = 1 << 16;
+  sample->refs = (unsigned long *)malloc(capacity * sizeof(unsigned long));
+  sample->count = 0;
+  sample->total = 0;
+  sample->rate = rate;
+
+  TraceReader reader;
+  trace_reader_open(&reader, filepath);
+  long n;
+  while ((n = trace_reader_next(&reader, chunk, CHUNK_REFS)) > 0) {
+    sample->total += n;
+    for (long j = 0; j < n; j++) {
+      if ((page_hash(REF_VPN(chunk[j])) & (SHARDS_MODULUS - 1)) >= threshold)
+        continue;
+      if (sample->count == capacity) {
+        capacity *= 2;
+        sample->refs = (unsigned long *)realloc(
+            sample->refs, capacity * sizeof(unsigned long));
+      }
+      sample->refs[sample->count++] = chunk[j];
+    }
+  }
+  trace_reader_close(&reader);
+  free(chunk);
+}
+
+int scaled_capacity(const Sample *sample, int capacity) {
+  int scaled = (int)(capacity * sample->rate + 0.5);
+  return scaled > 0 ? scaled : 1;
+}
+
+// Full trace estimate for a capacity-frame cache from sample counters
+void scale_result(SimResult *estimate, const Sample *sample, int capacity,
+                  unsigned long misses, unsigned long write_backs) {
+  // SHARDS-adj: the sample holds count references instead of the expected
+  // total * rate, and the difference goes to the hits
+  double scale = 1 / sample->rate;
+  double hits = (sample->count - (double)misses +
+                 (sample->total * sample->rate - sample->count)) *
+                scale;
+  if (hits < 0)
+    hits = 0;
+  if (hits > sample->total)
+    hits = sample->total;
+  estimate->capacity = capacity;
+  estimate->hits = (unsigned long)(hits + 0.5);
+  estimate->misses = sample->total - estimate->hits;
+  estimate->write_backs = (unsigned long)(write_backs * scale + 0.5);
+}
+
+// Estimate for one capacity: the LRU stack or a miniature simulation
+void sampled_estimate(SimResult *estimate, const Sample *sample,
+                      StackSim *stack, StackCursor *cursor, int capacity) {
+  int scaled = scaled_capacity(sample, capacity);
+  if (stack) { // capacities come in increasing order
+    stack_cursor_advance(stack, cursor, scaled);
+    scale_result(estimate, sample, capacity, cursor->misses,
+                 cursor->write_backs);
+    return;
+  }
+  SimResult mini = {.policy = estimate->policy, .capacity = scaled};
+  void *state = estimate->policy->create(scaled);
+  estimate->policy->run(state, &mini, sample->refs, sample->count);
+  estimate->policy->destroy(state);
+  scale_result(estimate, sample, capacity, mini.misses, mini.write_backs);
+}
+
+// Exact results for the error report (needs the loaded trace)
+void exact_result(SimResult *exact, StackSim *stack, StackCursor *cursor) {
+  if (!stack) {
+    simulate(exact);
+    return;
+  }
+  stack_cursor_advance(stack, cursor, exact->capacity);
+  exact->misses = cursor->misses;
+  exact->hits = stack->refs - cursor->misses;
+  exact->write_backs = cursor->write_backs;
+}
+
+// check: also run the exact simulations and print the estimation error
+void run_sampled(const char *filepath, const Policy *policies[],
+                 int num_policies, int frame_sizes[], int num_sizes,
+                 double rate, int curve_step, int check) {
+  struct timeval start;
+  gettimeofday(&start, NULL);
+  Sample sample;
+  read_sample(&sample, filepath, rate);
+  if (sample.count == 0) {
+    fprintf(stderr, "The sample is empty, raise the sampling rate\n");
+    exit(1);
+  }
+  printf("SHARDS sample: %ld of %ld references (rate %g), read in %.6f "
+         "sec\n\n",
+         sample.count, sample.total, rate, elapsed_since(&start));
+
+  int max_capacity = max_frame_size(frame_sizes, num_sizes);
+  if (curve_step > max_capacity)
+    curve_step = 0;
+  SimResult *estimates =
+      (SimResult *)calloc(num_policies * num_sizes, sizeof(SimResult));
+  double *estimate_time = (double *)calloc(num_policies, sizeof(double));
+
+  for (int p = 0; p < num_policies; p++) {
+    gettimeofday(&start, NULL);
+    // LRU is one stack distance pass, for every capacity at once
+    StackSim *stack = NULL;
+    if (policies[p]->run == run_lru) {
+      stack = init_stack_sim(scaled_capacity(&sample, max_capacity));
+      for (long j = 0; j < sample.count; j++)
+        stack_access(stack, REF_VPN(sample.refs[j]),
+                     REF_IS_WRITE(sample.refs[j]));
+      stack_finish(stack);
+    }
+
+    print_header(policies[p]->name);
+    StackCursor cursor = {0, 0, 0, 0};
+    for (int i = 0; i < num_sizes; i++) {
+      SimResult *estimate = &estimates[p * num_sizes + i];
+      estimate->policy = policies[p];
+      sampled_estimate(estimate, &sample, stack, &cursor, frame_sizes[i]);
+      print_result(estimate);
+    }
+    estimate_time[p] = elapsed_since(&start);
+    printf("Total elapsed time %.6f sec (SHARDS estimate)\n\n",
+           estimate_time[p]);
+
+    if (curve_step > 0) {
+      printf("frames,hits,misses,fault_ratio,write_backs\n");
+      StackCursor curve = {0, 0, 0, 0};
+      for (int c = curve_step; c <= max_capacity; c += curve_step) {
+        SimResult point = {.policy = policies[p]};
+        sampled_estimate(&point, &sample, stack, &curve, c);
+        printf("%d,%lu,%lu,%.10f,%lu\n", c, point.hits, point.misses,
+               (double)point.misses / sample.total, point.write_backs);
+      }
+      printf("\n");
+    }
+    if (stack)
+      free_stack_sim(stack);
+  }
+  free(sample.refs);
+
+  if (check) {
+    load_trace(filepath);
+    for (int p = 0; p < num_policies; p++) {
+      gettimeofday(&start, NULL);
+      StackSim *stack = NULL;
+      if (policies[p]->run == run_lru)
+        stack = run_stack_distances(max_capacity);
+      StackCursor cursor = {0, 0, 0, 0};
+      double error_sum = 0;
+
+      printf("%s SHARDS error:\n", policies[p]->name);
+      printf("Frame\tExact ratio\tEstimated ratio\tError\t\tExact write "
+             "backs\tEstimated\tError\n");
+      for (int i = 0; i < num_sizes; i++) {
+        SimResult *estimate = &estimates[p * num_sizes + i];
+        SimResult exact = {.policy = policies[p], .capacity = frame_sizes[i]};
+        exact_result(&exact, stack, &cursor);
+        double exact_ratio = (double)exact.misses / trace_count;
+        double estimated_ratio = (double)estimate->misses / trace_count;
+        double wb_error = exact.write_backs
+                              ? ((double)estimate->write_backs -
+                                 (double)exact.write_backs) /
+                                    exact.write_backs * 100
+                              : 0;
+        error_sum += estimated_ratio > exact_ratio
+                         ? estimated_ratio - exact_ratio
+                         : exact_ratio - estimated_ratio;
+        printf("%d\t%.6f\t%.6f\t\t%+.6f\t%lu\t\t\t%lu\t\t%+.2f%%\n",
+               frame_sizes[i], exact_ratio, estimated_ratio,
+               estimated_ratio - exact_ratio, exact.write_backs,
+               estimate->write_backs, wb_error);
+      }
+      double exact_time = elapsed_since(&start);
+      printf("Mean absolute error %.6f, exact run %.6f sec vs estimate "
+             "%.6f sec\n\n",
+             error_sum / num_sizes, exact_time, estimate_time[p]);
+      if (stack)
+        free_stack_sim(stack);
+    }
+    free_trace();
+  }
+
+  free(estimate_time);
+  free(estimates);
+}
+
+void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [-p policies] [-w write_cost] [-S] [-R step] "
+          "[-j threads] [-I interval [-M metrics.csv]] [-t] <input_file>\n"
+          "       %s [-p policies] [-w write_cost] [-R step] -s rate [-e] "
+          "<input_file>\n"
+          "       %s -o <output_file> [-z] <input_file>\n"
+          "Policies (comma separated, or all; default LRU,CFLRU):",
+          prog, prog, prog);
+  for (int i = 0; i < NUM_POLICIES; i++)
+    fprintf(stderr, " %s", policy_table[i].name);
+  fprintf(stderr, "\n");
+}
+
+int main(int argc, char *argv[]) {
+  // -S: LRU from one stack distance pass instead of one replay per size
+  // -R step: with -S, also print the LRU miss ratio curve every step frames
+  // -j threads: run the replays in parallel on a pool of threads
+  // -o file: convert the trace to binary (-z: varint encoded) and exit
+  // -t: stream the trace in fixed-size chunks instead of loading it
+  // -p list: replacement policies to simulate
+  // -I n: per-interval metrics every n references as CSV to -M's file
+  //        (replays only: not for -S's LRU, -t or -s)
+  // -s rate: estimate from a SHARDS sample (-e: report the error against
+  //          the exact run)
+  // -w ratio: write/read cost ratio, for OPT-WB and ACFLRU, and print the
+  //           weighted I/O cost
+  const Policy *policies[NUM_POLICIES];
+  int num_policies = 0;
+  int stream_mode = 0;
+  double sample_rate = 0;
+  const char *metrics_path = "metrics.csv";
+  int check_sample = 0;
+  int stack_mode = 0;
+  int curve_step = 0;
+  int num_threads = 0;
+  const char *output_path = NULL;
+  int encoding = TRACE_RAW;
+  int opt;
+  while ((opt = getopt(argc, argv, "SR:j:o:ztp:w:s:eI:M:")) != -1) {
+    switch (opt) {
+    case 'o':
+      output_path = optarg;
+      break;
+    case 'z':
+      encoding = TRACE_VARINT;
+      break;
+    case 't':
+      stream_mode = 1;
+      break;
+    case 's':
+      sample_rate = atof(optarg);
+      if (sample_rate <= 0 || sample_rate > 1) {
+        fprintf(stderr, "The sampling rate must be in (0, 1]\n");
+        return 1;
+      }
+      break;
+    case 'e':
+      check_sample = 1;
+      break;
+    case 'I':
+      metrics_interval = atol(optarg);
+      break;
+    case 'M':
+      metrics_path = optarg;
+      break;
+    case 'w':
+      write_cost = atof(optarg);
+      show_cost = 1;
+      break;
+    case 'p':
+      num_policies = parse_policies(optarg, policies);
+      if (num_policies <= 0) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'j':
+      num_threads = atoi(optarg);
+      break;
+    case 'S':
+      stack_mode = 1;
+      break;
+    case 'R':
+      curve_step = atoi(optarg);
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  // argc: number of arguments(including the program name), argv: arguments
+  if (optind >= argc) {
+    // no input file path provided
+    usage(argv[0]);
+    return 1;
+  }
+  char *file_path = argv[optind];
+
+  int frame_sizes[] = {4096, 8192, 16384, 32768, 65536}; // frame numbers
+  // number of frame_sizes[]
+  int num_sizes = sizeof(frame_sizes) / sizeof(frame_sizes[0]);
+
+  if (num_policies == 0) {
+    policies[num_policies++] = find_policy("LRU");
+    policies[num_policies++] = find_policy("CFLRU");
+  }
+
+  if (sample_rate > 0 && !output_path) {
+    int kept = 0;
+    for (int p = 0; p < num_policies; p++) {
+      if (policies[p]->offline)
+        fprintf(stderr, "%s needs the whole trace, skipped with -s\n",
+                policies[p]->name);
+      else
+        policies[kept++] = policies[p];
+    }
+    run_sampled(file_path, policies, kept, frame_sizes, num_sizes,
+                sample_rate, curve_step, check_sample);
+    return 0;
+  }
+
+  // With -S, LRU comes from the stack distance pass instead of the replays
+  int stack_lru = 0;
+  if (stack_mode) {
+    int kept = 0;
+    for (int p = 0; p < num_policies; p++) {
+      if (policies[p]->run == run_lru)
+        stack_lru = 1;
+      else
+        policies[kept++] = policies[p];
+    }
+    num_policies = kept;
+  }
+
+  if (stream_mode && !output_path) {
+    int kept = 0;
+    for (int p = 0; p < num_policies; p++) {
+      if (policies[p]->offline)
+        fprintf(stderr, "%s needs the whole trace, skipped with -t\n",
+                policies[p]->name);
+      else
+        policies[kept++] = policies[p];
+    }
+    num_policies = kept;
+    if (metrics_interval > 0)
+      fprintf(stderr, "-I needs the loaded trace, ignored with -t\n");
+    run_stream(file_path, policies, num_policies, frame_sizes, num_sizes,
+               stack_lru, curve_step, num_threads > 0 ? num_threads : 1);
+    return 0;
+  }
+
+  load_trace(file_path);
+
+  if (output_path) {
+    write_trace(output_path, encoding);
+    free_trace();
+    return 0;
+  }
+
+  if (metrics_interval > 0) {
+    metrics_file = fopen(metrics_path, "w");
+    if (!metrics_file) {
+      perror("Error opening metrics file");
+      return 1;
+    }
+    write_metrics_header();
+    compute_phases();
+  }
+
+  if (stack_lru)
+    run_stack_simulation(frame_sizes, num_sizes, curve_step);
+  if (num_threads > 0 && num_policies > 0) {
+    run_parallel(policies, num_policies, frame_sizes, num_sizes, num_threads);
+  } else {
+    for (int p = 0; p < num_policies; p++)
+      run_simulation(policies[p], frame_sizes, num_sizes, file_path);
+  }
+
+  if (metrics_file) {
+    fclose(metrics_file);
+    free(interval_phases);
+  }
 
-  free(trace_types);
-  free(trace_addrs);
+  free_trace();
 
   return 0;
 }
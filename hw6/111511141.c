@@ -1,6 +1,14 @@
 /*
  Compilation:
- gcc 111511141.c -o 111511141.out `pkg-config fuse --cflags --libs`
+ gcc 111511141.c -o 111511141.out `pkg-config fuse --cflags --libs` -lz -llzma -lzstd
+
+ test.tar may be a plain tar or one compressed with gzip, xz or zstd.
+ With -o layers it mounts a stack of such archives instead, like the layers
+ of a container image.
+
+ Usage:
+ ./111511141.out [-o inline_max=N,inline_budget=N] [-o upper=DIR] [-o commit=FILE]
+                [-o layers=BOTTOM.tar:...:TOP.tar] [FUSE options] <mountpoint>
  */
 
 #define FUSE_USE_VERSION 30
@@ -12,162 +20,3009 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <sys/types.h>
+#include <zlib.h>
+#include <lzma.h>
+#include <zstd.h>
 
 // TAR Header constants
 #define BLOCK_SIZE 512
 #define TAR_FILE "test.tar"
 
+// Whiteouts, as in OCI image layers: a member ".wh.<name>" of a layer hides
+// <name> in the layers below it, and a member ".wh..wh..opq" everything
+// below in its directory. The upper directory of the overlay uses the same.
+#define WHITEOUT_PREFIX ".wh."
+#define OPAQUE_MARKER ".wh..wh..opq"
+
+// Offsets in the tar stream of layer i start at i << LAYER_SHIFT, so the
+// cache, the readahead and the nodes tell layers apart by offset alone
+#define LAYER_SHIFT 48
+#define MAX_LAYERS 4096
+
+// FUSE tuning. The archive never changes while mounted and changes to the
+// upper directory all go through the mount, so the kernel may cache file
+// pages and lookups for as long as it likes.
+#define FUSE_DEFAULT_OPTS "-omax_read=131072,kernel_cache," \
+    "entry_timeout=3600,attr_timeout=3600,negative_timeout=3600"
+#define MAX_BACKGROUND 64           // Concurrent async requests (readahead)
+#define CONGESTION_THRESHOLD 48
+
+// Mount options of our own, taken out before the rest go to FUSE:
+//   -o inline_max=N     keep the data of members up to N bytes in memory,
+//                       read while scanning the headers around them (0, the
+//                       default, keeps none)
+//   -o inline_budget=N  memory for them in bytes
+//   -o upper=DIR        make the mount writable, changes go to DIR (see
+//                       Writable Overlay)
+//   -o commit=FILE      when unmounting, write the mounted tree to FILE as
+//                       a new tar
+//   -o layers=A:B:...   mount these archives as one tree instead of
+//                       test.tar, the first at the bottom (see add_node)
+#define INLINE_MAX_LIMIT (1 << 20)
+#define INLINE_SLAB (1 << 20)       // Inline data is packed into slabs this big
+
+struct Options {
+    unsigned long inline_max;
+    unsigned long inline_budget;
+    char *upper;
+    char *commit;
+    char *layers;
+};
+
+struct Options options = { .inline_max = 0, .inline_budget = 64 << 20 };
+
+static const struct fuse_opt option_spec[] = {
+    { "inline_max=%lu", offsetof(struct Options, inline_max), 0 },
+    { "inline_budget=%lu", offsetof(struct Options, inline_budget), 0 },
+    { "upper=%s", offsetof(struct Options, upper), 0 },
+    { "commit=%s", offsetof(struct Options, commit), 0 },
+    { "layers=%s", offsetof(struct Options, layers), 0 },
+    FUSE_OPT_END
+};
+
+// A region of a sparse file that holds data. The regions' bytes are stored
+// back to back in the archive; the rest of the file reads as zeros.
+struct Extent {
+    uint64_t offset;        // In the file
+    uint64_t length;
+    uint64_t data_offset;   // In the tar stream
+};
+
 // Data structure to store file metadata in memory
 struct TarNode {
-    char path[256];         // Full path (relative to root, e.g., "dir1/file.txt")
-    char linkname[100];     // Target path for symbolic links
-    int size;               // File size
-    int type;               // Type flag: '0'=file, '5'=dir, '2'=symlink
-    long data_offset;       // Offset in test.tar where data begins
+    char *path;             // Full path (relative to root, e.g., "dir1/file.txt")
+    char *linkname;         // Target path for symbolic links, NULL otherwise
+    uint64_t size;          // File size
+    int type;               // Type flag: '0'=file, '5'=dir, '2'=symlink,
+                            // '3'/'4'=char/block device, '6'=FIFO
+    uint64_t data_offset;   // Offset in the tar stream where data begins
+    uint64_t header_offset; // The member's headers and data, as stored in the
+    uint64_t end_offset;    // tar stream (equal if it has no copy of its own)
+    int layer;              // Of the stack, the one it comes from
+
+    // Sparse files only (NULL otherwise), sorted by offset
+    struct Extent *extents;
+    int num_extents;
+
+    const char *inline_data;    // Small files kept in memory (see inline_max)
     
     // Metadata for getattr
     mode_t mode;            // Permissions
     uid_t uid;
     gid_t gid;
     time_t mtime;
-    
-    struct TarNode *next;
+    dev_t rdev;             // Devices
+
+    // Directory tree
+    const char *name;           // Last path component (points into path)
+    struct TarNode *parent;
+    struct TarNode **children;  // Direct children, in archive order
+    int num_children;
+    int max_children;
+
+    // Path hash table chain
+    unsigned long hash;
+    struct TarNode *hash_next;
+
+    int implicit;           // Directory created for its contents, no header yet
+};
+
+// The tree and the seek points are built either from the sidecar index
+// before fuse_main starts, or by parse_tar_file running in the background
+// while FUSE already serves the members it has found (directory listings
+// wait for the whole scan). In the second case readers hold scan_lock (see
+// lock_tree) until the scan completes; after that nothing here is written
+// again and FUSE's worker threads read it without locks.
+pthread_mutex_t scan_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t scan_progress = PTHREAD_COND_INITIALIZER; // Nodes were added
+int scan_complete = 0;
+int scan_stop = 0;          // Unmounting, the scan should give up
+pthread_t scan_thread;
+int scan_running = 0;
+
+// Nodes by full path, in a hash table with chains through hash_next
+struct PathTable {
+    struct TarNode **buckets;
+    size_t num_buckets;
+    size_t num_nodes;
+};
+
+// Root directory (path "") and every other node of the merged tree. While
+// the layers are merged, whiteouts hold the whiteout members of the layers
+// merged so far and shadowed the members of the current layer that a
+// higher one hides (its hard links may still name them).
+struct TarNode root = { .path = "", .type = '5', .name = "" };
+struct PathTable tree_paths;
+struct PathTable whiteouts;
+struct PathTable shadowed;
+
+// An archive of the stack. It stays open for the whole mount and is read
+// with pread, so reads need no open/seek per call and share no file
+// position. Paths are absolute because FUSE changes to / when it
+// daemonizes.
+struct Layer {
+    const char *name;           // As given, for messages
+    char path[PATH_MAX];
+    char index_path[PATH_MAX + 8];
+    int fd;
+    struct stat st;
+    int format;                 // enum ArchiveFormat
+    uint64_t base;              // Of its offsets, see LAYER_SHIFT
+
+    // Where decoding a compressed archive can restart
+    struct SeekPoint *seek_points;
+    int num_seek_points;
+    int max_seek_points;
+};
+
+struct Layer *layers = NULL;
+int num_layers = 0;
+int scan_from = -1;         // Highest layer the background scan merges
+
+// Inline data is packed into slabs as the scan captures it; loaded from the
+// index it points into the mapping instead. Both count against the budget.
+char *inline_slab = NULL;
+size_t inline_slab_used = INLINE_SLAB;
+unsigned long inline_files = 0;
+unsigned long inline_bytes = 0;
+
+// --- Archive Access ---
+
+// Archives may also be compressed; the format is told apart by their magic
+// bytes. Everything above this layer works on offsets in the uncompressed
+// tar streams (with the layer in the top bits, see LAYER_SHIFT).
+enum ArchiveFormat { FORMAT_TAR, FORMAT_GZIP, FORMAT_XZ, FORMAT_ZSTD };
+
+#define IN_CHUNK (64 * 1024)            // Compressed bytes read at a time
+#define SEEK_SPAN (1 << 20)             // gzip: output between seek points
+#define WINDOW_SIZE 32768               // gzip: history inflate restarts from
+#define NUM_DECODERS 4                  // Decoders parked where reads ended
+
+#define CACHE_BLOCK (128 * 1024)        // Unit of the block cache
+#define CACHE_BLOCKS 512                // 64MB of cached blocks
+#define CACHE_SHARDS 16                 // Separately locked parts of the cache
+#define SHARD_BLOCKS (CACHE_BLOCKS / CACHE_SHARDS)
+#define SHARD_BUCKETS (SHARD_BLOCKS * 2)
+#define NUM_STREAMS 16                  // Sequential readers tracked at once
+#define READAHEAD_MIN 2                 // Blocks, once a reader is sequential
+#define READAHEAD_MAX 32                // Blocks (4MB)
+#define READAHEAD_QUEUE 16
+
+// A place in the compressed file where decoding can restart. gzip gets one
+// every SEEK_SPAN bytes of output (at a deflate block boundary, like zlib's
+// zran example), zstd one per frame and xz one per block, so random reads
+// only decode from the nearest point before them. Archives written as a
+// single zstd frame or xz block (the default of both tools without -T or
+// --block-size) still have to be decoded from the start.
+struct SeekPoint {
+    uint64_t out_pos;       // Offset in the uncompressed tar stream
+    uint64_t in_pos;        // Offset in the compressed file
+    int bits;               // gzip: bits of the byte before in_pos still unused
+                            // xz: integrity check type of the block's stream
+    unsigned char *window;  // gzip: output before out_pos (NULL at a member start)
+    unsigned window_len;
+};
+
+// Sequential decoder over the tar stream of a layer, started at a seek
+// point. Its offsets are the layer's own.
+struct Decoder {
+    struct Layer *layer;
+    z_stream z;
+    int raw;                // gzip: inflating raw deflate, trailer not parsed
+    lzma_stream x;
+    lzma_block block;       // xz: the block decoder keeps using this
+    lzma_filter filters[LZMA_FILTERS_MAX + 1];
+    int point;              // xz: seek point (block) being decoded
+    ZSTD_DStream *zs;
+
+    unsigned char in[IN_CHUNK];
+    size_t in_off, in_len;  // Unread input is in[in_off..in_len)
+    uint64_t in_pos;        // File offset just after in[in_len - 1]
+    uint64_t out_pos;       // Stream offset of the next byte produced
+    int eof;
+
+    // Only used while parse_tar_file scans the archive and records points
+    int indexing;
+    unsigned char *history; // gzip: last WINDOW_SIZE bytes of output
+    uint64_t member_start;  // gzip: out_pos where the current member began
+
+    unsigned long last_used; // For replacing parked decoders
+};
+
+// A CACHE_BLOCK bytes block of the tar stream
+struct CachedBlock {
+    uint64_t index;         // Stream offset / CACHE_BLOCK
+    unsigned char *data;
+    size_t len;
+    int prefetched;         // Read ahead and not used yet
+    struct CachedBlock *prev, *next;    // LRU list, most recent first
+    struct CachedBlock *hash_next;
+};
+
+// Blocks go to shard index % CACHE_SHARDS
+struct CacheShard {
+    pthread_mutex_t lock;
+    struct CachedBlock blocks[SHARD_BLOCKS];
+    struct CachedBlock *buckets[SHARD_BUCKETS];
+    struct CachedBlock *lru_head, *lru_tail;
+    int num_blocks;
+
+    // Statistics
+    unsigned long hits, misses;
+    unsigned long readahead_blocks, readahead_hits;
+};
+
+// A reader moving forward through the tar stream (see note_access)
+struct Stream {
+    uint64_t next;          // Block it is expected to read next
+    uint64_t ahead;         // First block not read ahead yet
+    int window;             // Blocks read ahead at a time
+    unsigned long last_used;
+};
+
+struct Readahead {
+    uint64_t start;         // Block
+    int count;
 };
 
-// Global head of the linked list
-struct TarNode *head = NULL;
+// The parked decoders and (while the background scan adds to them) the
+// layers' seek points are shared by FUSE's worker threads; the decoding itself runs
+// outside the lock
+pthread_mutex_t inflate_lock = PTHREAD_MUTEX_INITIALIZER;
+struct Decoder *parked[NUM_DECODERS];
+int num_parked = 0;
+unsigned long decoder_clock = 0;
+
+struct CacheShard cache_shards[CACHE_SHARDS];
+
+// Streams and the readahead queue, served by readahead_thread
+pthread_mutex_t readahead_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t readahead_wake = PTHREAD_COND_INITIALIZER;
+struct Stream streams[NUM_STREAMS];
+unsigned long stream_clock = 0;
+struct Readahead readahead_queue[READAHEAD_QUEUE];
+int queue_head = 0, queue_len = 0;
+unsigned long readahead_requests = 0;
+int readahead_stop = 0;
+int readahead_running = 0;
+pthread_t readahead_thread;
+
+void add_seek_point(struct Layer *layer, uint64_t out_pos, uint64_t in_pos,
+                    int bits, unsigned char *window, unsigned window_len) {
+    // zstd frames that produce nothing (skippable frames) add no new point
+    if (layer->num_seek_points > 0 &&
+        layer->seek_points[layer->num_seek_points - 1].out_pos == out_pos) {
+        free(window);
+        return;
+    }
+
+    pthread_mutex_lock(&inflate_lock);
+    if (layer->num_seek_points == layer->max_seek_points) {
+        layer->max_seek_points = layer->max_seek_points ?
+                                 layer->max_seek_points * 2 : 64;
+        layer->seek_points = realloc(layer->seek_points,
+                                     layer->max_seek_points * sizeof(struct SeekPoint));
+        if (!layer->seek_points) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    struct SeekPoint *p = &layer->seek_points[layer->num_seek_points++];
+    p->out_pos = out_pos;
+    p->in_pos = in_pos;
+    p->bits = bits;
+    p->window = window;
+    p->window_len = window_len;
+    pthread_mutex_unlock(&inflate_lock);
+}
+
+// Last seek point at or before out_pos
+int find_seek_point(struct Layer *layer, uint64_t out_pos) {
+    int lo = 0, hi = layer->num_seek_points - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (layer->seek_points[mid].out_pos <= out_pos) lo = mid;
+        else hi = mid - 1;
+    }
+    return lo;
+}
+
+// Tell the format apart by the first bytes of the file
+int detect_format(int fd) {
+    unsigned char magic[6] = {0};
+    if (pread(fd, magic, sizeof(magic), 0) < (ssize_t)sizeof(magic)) {
+        return FORMAT_TAR;
+    }
+    if (magic[0] == 0x1f && magic[1] == 0x8b) return FORMAT_GZIP;
+    if (memcmp(magic, "\xfd" "7zXZ\0", 6) == 0) return FORMAT_XZ;
+    if (memcmp(magic, "\x28\xb5\x2f\xfd", 4) == 0) return FORMAT_ZSTD;
+    return FORMAT_TAR;
+}
+
+// Make sure some input is buffered. Returns 0 at the end of the file.
+int refill(struct Decoder *d) {
+    if (d->in_off < d->in_len) return 1;
+
+    ssize_t n;
+    do {
+        n = pread(d->layer->fd, d->in, IN_CHUNK, d->in_pos);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) return 0;
+
+    d->in_off = 0;
+    d->in_len = n;
+    d->in_pos += n;
+    return 1;
+}
+
+// File offset of the next unread input byte
+uint64_t consumed(struct Decoder *d) {
+    return d->in_pos - (d->in_len - d->in_off);
+}
+
+// Record the output of a gzip scan, so a seek point can copy its window
+void remember_history(struct Decoder *d, unsigned char *out, size_t len) {
+    if (len > WINDOW_SIZE) {
+        out += len - WINDOW_SIZE;
+        len = WINDOW_SIZE;
+    }
+    size_t at = (d->out_pos - len) % WINDOW_SIZE;
+    size_t first = len < WINDOW_SIZE - at ? len : WINDOW_SIZE - at;
+    memcpy(d->history + at, out, first);
+    memcpy(d->history, out + first, len - first);
+}
+
+// Copy the last window_len bytes of output in order
+unsigned char *copy_window(struct Decoder *d, unsigned window_len) {
+    unsigned char *window = malloc(window_len);
+    if (!window) {
+        perror("malloc");
+        exit(1);
+    }
+    size_t at = (d->out_pos - window_len) % WINDOW_SIZE;
+    size_t first = window_len < WINDOW_SIZE - at ? window_len : WINDOW_SIZE - at;
+    memcpy(window, d->history + at, first);
+    memcpy(window + first, d->history, window_len - first);
+    return window;
+}
+
+// Start an xz block decoder at seek point i
+int start_xz_block(struct Decoder *d, int i) {
+    struct SeekPoint *p = &d->layer->seek_points[i];
+    lzma_block *block = &d->block;
+    unsigned char header[LZMA_BLOCK_HEADER_SIZE_MAX];
+
+    if (pread(d->layer->fd, header, 1, p->in_pos) != 1) return -1;
+    memset(block, 0, sizeof(*block));
+    block->version = 1;
+    block->check = p->bits;
+    block->filters = d->filters;
+    block->header_size = lzma_block_header_size_decode(header[0]);
+    if (pread(d->layer->fd, header, block->header_size, p->in_pos) !=
+        (ssize_t)block->header_size) {
+        return -1;
+    }
+    if (lzma_block_header_decode(block, NULL, header) != LZMA_OK) return -1;
+
+    // The filter options are only needed to set the decoder up
+    lzma_ret ret = lzma_block_decoder(&d->x, block);
+    for (int k = 0; d->filters[k].id != LZMA_VLI_UNKNOWN; k++) {
+        free(d->filters[k].options);
+        d->filters[k].options = NULL;
+    }
+    if (ret != LZMA_OK) return -1;
+
+    d->point = i;
+    d->in_off = d->in_len = 0;
+    d->in_pos = p->in_pos + block->header_size;
+    return 0;
+}
+
+// Set up a decoder to produce the stream of layer from seek point p,
+// number i (NULL for the start of the archive, before any points exist)
+int decoder_start(struct Decoder *d, struct Layer *layer,
+                  const struct SeekPoint *p, int i) {
+    d->layer = layer;
+    d->in_off = d->in_len = 0;
+    d->in_pos = p ? p->in_pos : 0;
+    d->out_pos = p ? p->out_pos : 0;
+    d->eof = 0;
+
+    switch (layer->format) {
+    case FORMAT_GZIP:
+        memset(&d->z, 0, sizeof(d->z));
+        // Windowbits 15 + 32 parses the gzip header, -15 is raw deflate
+        d->raw = p && p->window;
+        if (inflateInit2(&d->z, d->raw ? -15 : 15 + 32) != Z_OK) return -1;
+        if (d->raw) {
+            if (p->bits) {
+                unsigned char byte;
+                if (pread(layer->fd, &byte, 1, p->in_pos - 1) != 1) return -1;
+                inflatePrime(&d->z, p->bits, byte >> (8 - p->bits));
+            }
+            inflateSetDictionary(&d->z, p->window, p->window_len);
+        }
+        d->member_start = d->out_pos;
+        break;
+    case FORMAT_XZ:
+        memset(&d->x, 0, sizeof(d->x));
+        if (p) return start_xz_block(d, i);
+        if (lzma_stream_decoder(&d->x, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK) {
+            return -1;
+        }
+        break;
+    case FORMAT_ZSTD:
+        if (!d->zs && !(d->zs = ZSTD_createDStream())) return -1;
+        ZSTD_DCtx_reset(d->zs, ZSTD_reset_session_only);
+        break;
+    }
+    return 0;
+}
+
+void decoder_end(struct Decoder *d) {
+    int format = d->layer ? d->layer->format : FORMAT_TAR;
+    if (format == FORMAT_GZIP) inflateEnd(&d->z);
+    if (format == FORMAT_XZ) lzma_end(&d->x);
+    if (format == FORMAT_ZSTD) ZSTD_freeDStream(d->zs);
+    free(d->history);
+    free(d);
+}
+
+// Inflate up to len bytes; also moves on to the next member of a
+// multi-member gzip file
+long read_gzip(struct Decoder *d, unsigned char *out, size_t len) {
+    d->z.next_out = out;
+    d->z.avail_out = len;
+
+    while (d->z.avail_out > 0) {
+        if (!refill(d)) break;
+        d->z.next_in = d->in + d->in_off;
+        d->z.avail_in = d->in_len - d->in_off;
+
+        unsigned char *before = d->z.next_out;
+        int ret = inflate(&d->z, d->indexing ? Z_BLOCK : Z_NO_FLUSH);
+        d->in_off = d->in_len - d->z.avail_in;
+        d->out_pos += d->z.next_out - before;
+        if (d->indexing) remember_history(d, before, d->z.next_out - before);
+
+        if (ret == Z_STREAM_END) {
+            // A raw inflate leaves the 8-byte gzip trailer to us
+            for (int skip = d->raw ? 8 : 0; skip > 0; skip--) {
+                if (!refill(d)) break;
+                d->in_off++;
+            }
+            if (!refill(d)) break;
+            d->raw = 0;
+            inflateReset2(&d->z, 15 + 32);
+            d->member_start = d->out_pos;
+            if (d->indexing) add_seek_point(d->layer, d->out_pos, consumed(d), 0, NULL, 0);
+            continue;
+        }
+        if (ret != Z_OK && ret != Z_BUF_ERROR) return -1;
+
+        // Between two deflate blocks (but not after the last one)
+        if (d->indexing && (d->z.data_type & 128) && !(d->z.data_type & 64) &&
+            d->out_pos - d->layer->seek_points[d->layer->num_seek_points - 1].out_pos >=
+                SEEK_SPAN) {
+            uint64_t history = d->out_pos - d->member_start;
+            unsigned window_len = history < WINDOW_SIZE ? history : WINDOW_SIZE;
+            add_seek_point(d->layer, d->out_pos, consumed(d), d->z.data_type & 7,
+                           copy_window(d, window_len), window_len);
+        }
+    }
+    return len - d->z.avail_out;
+}
+
+// Decode up to len bytes with liblzma; a block decoder started at a seek
+// point continues with the next block once its own ends
+long read_xz(struct Decoder *d, unsigned char *out, size_t len) {
+    d->x.next_out = out;
+    d->x.avail_out = len;
+
+    while (d->x.avail_out > 0) {
+        int have_input = refill(d);
+        d->x.next_in = d->in + d->in_off;
+        d->x.avail_in = d->in_len - d->in_off;
+
+        unsigned char *before = d->x.next_out;
+        lzma_ret ret = lzma_code(&d->x, have_input ? LZMA_RUN : LZMA_FINISH);
+        d->in_off = d->in_len - d->x.avail_in;
+        d->out_pos += d->x.next_out - before;
+
+        if (ret == LZMA_STREAM_END) {
+            if (d->layer->num_seek_points == 0 ||
+                d->point + 1 >= d->layer->num_seek_points) {
+                break;
+            }
+            if (start_xz_block(d, d->point + 1) < 0) return -1;
+            continue;
+        }
+        if (ret != LZMA_OK) return -1;
+        if (!have_input) break;
+    }
+    return len - d->x.avail_out;
+}
+
+// Decode up to len bytes of zstd frames; the scan records each frame end
+long read_zstd(struct Decoder *d, unsigned char *out, size_t len) {
+    ZSTD_outBuffer output = { out, len, 0 };
+
+    while (output.pos < output.size) {
+        if (!refill(d)) break;
+        ZSTD_inBuffer input = { d->in, d->in_len, d->in_off };
+
+        size_t before = output.pos;
+        size_t ret = ZSTD_decompressStream(d->zs, &output, &input);
+        d->in_off = input.pos;
+        d->out_pos += output.pos - before;
+
+        if (ZSTD_isError(ret)) return -1;
+        if (ret == 0 && d->indexing) {
+            add_seek_point(d->layer, d->out_pos, consumed(d), 0, NULL, 0);
+        }
+    }
+    return output.pos;
+}
+
+// Read the next len bytes of the tar stream. Returns fewer at its end.
+long decoder_read(struct Decoder *d, unsigned char *out, size_t len) {
+    if (d->eof) return 0;
+
+    long n;
+    switch (d->layer->format) {
+    case FORMAT_GZIP: n = read_gzip(d, out, len); break;
+    case FORMAT_XZ: n = read_xz(d, out, len); break;
+    case FORMAT_ZSTD: n = read_zstd(d, out, len); break;
+    default:
+        n = 0;
+        while (n < (long)len) {
+            ssize_t res = pread(d->layer->fd, out + n, len - n, d->out_pos);
+            if (res < 0 && errno == EINTR) continue;
+            if (res < 0) return -1;
+            if (res == 0) break;
+            n += res;
+            d->out_pos += res;
+        }
+    }
+    if (n >= 0 && n < (long)len) d->eof = 1;
+    return n;
+}
+
+// Move len bytes forward in the tar stream
+int decoder_skip(struct Decoder *d, uint64_t len, unsigned char *scratch,
+                 size_t scratch_len) {
+    if (d->layer->format == FORMAT_TAR) {
+        d->out_pos += len;
+        return 0;
+    }
+    while (len > 0) {
+        size_t want = len < scratch_len ? len : scratch_len;
+        long n = decoder_read(d, scratch, want);
+        if (n < (long)want) return -1;
+        len -= n;
+    }
+    return 0;
+}
+
+// Seek points of an xz file are its blocks, listed in the index at the end
+// of each stream
+int read_xz_index(struct Layer *layer) {
+    lzma_stream strm = LZMA_STREAM_INIT;
+    lzma_index *index = NULL;
+    if (lzma_file_info_decoder(&strm, &index, UINT64_MAX, layer->st.st_size) !=
+        LZMA_OK) {
+        return -1;
+    }
+
+    unsigned char *buf = malloc(IN_CHUNK);
+    uint64_t pos = 0;
+    lzma_ret ret = LZMA_PROG_ERROR;
+    do {
+        ssize_t n = pread(layer->fd, buf, IN_CHUNK, pos);
+        if (n < 0) {
+            ret = LZMA_PROG_ERROR;
+            break;
+        }
+        strm.next_in = buf;
+        strm.avail_in = n;
+        ret = lzma_code(&strm, LZMA_RUN);
+        pos += n - strm.avail_in;
+        if (ret == LZMA_SEEK_NEEDED) pos = strm.seek_pos;
+    } while (ret == LZMA_OK || ret == LZMA_SEEK_NEEDED);
+    lzma_end(&strm);
+    free(buf);
+    if (ret != LZMA_STREAM_END) return -1;
+
+    lzma_index_iter iter;
+    lzma_index_iter_init(&iter, index);
+    while (!lzma_index_iter_next(&iter, LZMA_INDEX_ITER_NONEMPTY_BLOCK)) {
+        add_seek_point(layer, iter.block.uncompressed_file_offset,
+                       iter.block.compressed_file_offset,
+                       iter.stream.flags->check, NULL, 0);
+    }
+    lzma_index_end(index, NULL);
+    return 0;
+}
+
+// --- Block Cache ---
+
+// Blocks of the tar stream are cached by their offset, whatever the archive
+// format: small members share blocks, so reading many of them in archive
+// order costs one read per block instead of one per member. The cache is
+// split into shards, each with its own lock and LRU list, so FUSE's worker
+// threads rarely wait on each other.
+
+struct CacheShard *shard_of(uint64_t index) {
+    return &cache_shards[index % CACHE_SHARDS];
+}
+
+// Cached block by index, or NULL. Called with the shard locked.
+struct CachedBlock *find_cached(struct CacheShard *s, uint64_t index) {
+    struct CachedBlock *b = s->buckets[index / CACHE_SHARDS % SHARD_BUCKETS];
+    while (b && b->index != index) b = b->hash_next;
+    if (b && b != s->lru_head) {
+        // Move to the front of the LRU list
+        b->prev->next = b->next;
+        if (b->next) b->next->prev = b->prev;
+        else s->lru_tail = b->prev;
+        b->prev = NULL;
+        b->next = s->lru_head;
+        s->lru_head->prev = b;
+        s->lru_head = b;
+    }
+    return b;
+}
+
+// Cache a copy of a block, replacing the least recently used one of its
+// shard when that is full
+void insert_cached(uint64_t index, const unsigned char *data, size_t len,
+                   int prefetched) {
+    struct CacheShard *s = shard_of(index);
+    pthread_mutex_lock(&s->lock);
+    if (find_cached(s, index)) {
+        pthread_mutex_unlock(&s->lock);
+        return;
+    }
+
+    struct CachedBlock *b;
+    if (s->num_blocks < SHARD_BLOCKS) {
+        b = &s->blocks[s->num_blocks++];
+        if (!(b->data = malloc(CACHE_BLOCK))) {
+            s->num_blocks--;
+            pthread_mutex_unlock(&s->lock);
+            return;
+        }
+    } else {
+        b = s->lru_tail;
+        s->lru_tail = b->prev;
+        s->lru_tail->next = NULL;
+        struct CachedBlock **link =
+            &s->buckets[b->index / CACHE_SHARDS % SHARD_BUCKETS];
+        while (*link != b) link = &(*link)->hash_next;
+        *link = b->hash_next;
+    }
+
+    b->index = index;
+    memcpy(b->data, data, len);
+    b->len = len;
+    b->prefetched = prefetched;
+    if (prefetched) s->readahead_blocks++;
+    b->hash_next = s->buckets[index / CACHE_SHARDS % SHARD_BUCKETS];
+    s->buckets[index / CACHE_SHARDS % SHARD_BUCKETS] = b;
+    b->prev = NULL;
+    b->next = s->lru_head;
+    if (s->lru_head) s->lru_head->prev = b;
+    else s->lru_tail = b;
+    s->lru_head = b;
+    pthread_mutex_unlock(&s->lock);
+}
+
+// Copy up to n bytes at offset of a cached block. Returns whether the block
+// was cached; its length is stored in len.
+int read_cached(uint64_t index, size_t offset, char *out, size_t n, long *len) {
+    struct CacheShard *s = shard_of(index);
+    pthread_mutex_lock(&s->lock);
+    struct CachedBlock *b = find_cached(s, index);
+    if (!b) {
+        s->misses++;
+        pthread_mutex_unlock(&s->lock);
+        return 0;
+    }
+
+    s->hits++;
+    if (b->prefetched) {
+        s->readahead_hits++;
+        b->prefetched = 0;
+    }
+    *len = b->len;
+    if (b->len > offset) {
+        memcpy(out, b->data + offset, b->len - offset < n ? b->len - offset : n);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return 1;
+}
+
+// Whether a block is cached, without counting it as a use
+int is_cached(uint64_t index) {
+    struct CacheShard *s = shard_of(index);
+    pthread_mutex_lock(&s->lock);
+    struct CachedBlock *b = s->buckets[index / CACHE_SHARDS % SHARD_BUCKETS];
+    while (b && b->index != index) b = b->hash_next;
+    pthread_mutex_unlock(&s->lock);
+    return b != NULL;
+}
+
+// Layer of a stream offset, and the offset in that layer's own stream
+struct Layer *layer_of(uint64_t pos) {
+    return &layers[pos >> LAYER_SHIFT];
+}
+
+uint64_t layer_pos(uint64_t pos) {
+    return pos & (((uint64_t)1 << LAYER_SHIFT) - 1);
+}
+
+// A decoder that can reach out_pos of layer: the parked one closest before
+// it, or a new one started at the last seek point before it
+struct Decoder *acquire_decoder(struct Layer *layer, uint64_t out_pos) {
+    struct Decoder *d = NULL;
+
+    pthread_mutex_lock(&inflate_lock);
+    int p = find_seek_point(layer, out_pos);
+    struct SeekPoint point = layer->seek_points[p];
+    int best = -1;
+    for (int i = 0; i < num_parked; i++) {
+        if (parked[i]->layer == layer && parked[i]->out_pos <= out_pos &&
+            parked[i]->out_pos >= point.out_pos &&
+            (best < 0 || parked[i]->out_pos > parked[best]->out_pos)) {
+            best = i;
+        }
+    }
+    if (best >= 0) {
+        d = parked[best];
+        parked[best] = parked[--num_parked];
+    }
+    pthread_mutex_unlock(&inflate_lock);
+
+    if (!d) {
+        d = calloc(1, sizeof(struct Decoder));
+        if (!d) return NULL;
+        if (decoder_start(d, layer, &point, p) < 0) {
+            decoder_end(d);
+            return NULL;
+        }
+    }
+    return d;
+}
+
+// Park a decoder where its last read ended, so a sequential reader's next
+// block continues from there instead of from a seek point
+void release_decoder(struct Decoder *d) {
+    if (d->eof) {
+        decoder_end(d);
+        return;
+    }
+
+    pthread_mutex_lock(&inflate_lock);
+    d->last_used = ++decoder_clock;
+    if (num_parked < NUM_DECODERS) {
+        parked[num_parked++] = d;
+        d = NULL;
+    } else {
+        int oldest = 0;
+        for (int i = 1; i < num_parked; i++) {
+            if (parked[i]->last_used < parked[oldest]->last_used) oldest = i;
+        }
+        struct Decoder *old = parked[oldest];
+        parked[oldest] = d;
+        d = old;
+    }
+    pthread_mutex_unlock(&inflate_lock);
+
+    if (d) decoder_end(d);
+}
+
+// Decode block index into out (CACHE_BLOCK bytes), caching it and every
+// whole block passed on the way. Returns its length, 0 past the end of the
+// stream or -1 on a decoding error.
+long inflate_block(uint64_t index, unsigned char *out, int prefetched) {
+    struct Layer *layer = layer_of(index * CACHE_BLOCK);
+    uint64_t target = layer_pos(index * CACHE_BLOCK);
+    struct Decoder *d = acquire_decoder(layer, target);
+    if (!d) return -1;
+
+    long n = 0;
+    while (d->out_pos <= target) {
+        uint64_t start = d->out_pos;
+        size_t want = CACHE_BLOCK - start % CACHE_BLOCK;
+        n = decoder_read(d, out, want);
+        if (n < 0) {
+            decoder_end(d);
+            return -1;
+        }
+        if (start % CACHE_BLOCK == 0 && n > 0) {
+            insert_cached((layer->base + start) / CACHE_BLOCK, out, n, prefetched);
+        }
+        if (n < (long)want) {
+            if (start < target) n = 0; // Ended before the block
+            break;
+        }
+    }
+
+    release_decoder(d);
+    return n;
+}
+
+// Read len bytes at pos of an uncompressed layer. Returns fewer at its end,
+// or a negative errno.
+long read_full(unsigned char *buffer, size_t len, uint64_t pos) {
+    int fd = layer_of(pos)->fd;
+    pos = layer_pos(pos);
+
+    size_t done = 0;
+    while (done < len) {
+        ssize_t res = pread(fd, buffer + done, len - done, pos + done);
+        if (res < 0) {
+            if (errno == EINTR) continue;
+            return -errno;
+        }
+        if (res == 0) break; // Archive truncated
+        done += res;
+    }
+    return done;
+}
+
+// Read block index into out (CACHE_BLOCK bytes) and cache it. Returns its
+// length, 0 past the end of the stream or a negative errno.
+long load_block(uint64_t index, unsigned char *out, int prefetched) {
+    if (layer_of(index * CACHE_BLOCK)->format != FORMAT_TAR) {
+        long len = inflate_block(index, out, prefetched);
+        return len < 0 ? -EIO : len;
+    }
+    long len = read_full(out, CACHE_BLOCK, index * CACHE_BLOCK);
+    if (len > 0) insert_cached(index, out, len, prefetched);
+    return len;
+}
+
+// Track the block each reader is expected to read next. Readers that keep
+// reading the next block are sequential: blocks are read ahead for them in
+// the background, in a window that doubles (up to READAHEAD_MAX) each time
+// they get within half a window of its end.
+void note_access(uint64_t index) {
+    pthread_mutex_lock(&readahead_lock);
+    struct Stream *s = NULL, *oldest = &streams[0];
+    for (int i = 0; i < NUM_STREAMS; i++) {
+        if (streams[i].next == index || streams[i].next == index + 1) {
+            s = &streams[i];
+            break;
+        }
+        if (streams[i].last_used < oldest->last_used) oldest = &streams[i];
+    }
+
+    if (!s) {
+        // Maybe the start of a new stream, nothing is read ahead until it
+        // reads on
+        s = oldest;
+        s->next = s->ahead = index + 1;
+        s->window = 0;
+    } else if (s->next == index) {
+        s->next = index + 1;
+        if (s->ahead < s->next) s->ahead = s->next;
+        if (s->ahead - s->next <= (uint64_t)s->window / 2) {
+            s->window = s->window ? s->window * 2 : READAHEAD_MIN;
+            if (s->window > READAHEAD_MAX) s->window = READAHEAD_MAX;
+
+            uint64_t end = s->next + s->window;
+            if (readahead_running && s->ahead < end &&
+                queue_len < READAHEAD_QUEUE) {
+                struct Readahead *r =
+                    &readahead_queue[(queue_head + queue_len++) % READAHEAD_QUEUE];
+                r->start = s->ahead;
+                r->count = end - s->ahead;
+                s->ahead = end;
+                readahead_requests++;
+                pthread_cond_signal(&readahead_wake);
+            }
+        }
+    }
+    s->last_used = ++stream_clock;
+    pthread_mutex_unlock(&readahead_lock);
+}
+
+// Background thread filling the cache with the queued readahead
+void *readahead_main(void *arg) {
+    (void) arg;
+    unsigned char *buffer = malloc((size_t)READAHEAD_MAX * CACHE_BLOCK);
+    if (!buffer) return NULL;
+
+    pthread_mutex_lock(&readahead_lock);
+    while (!readahead_stop) {
+        if (queue_len == 0) {
+            pthread_cond_wait(&readahead_wake, &readahead_lock);
+            continue;
+        }
+        struct Readahead r = readahead_queue[queue_head];
+        queue_head = (queue_head + 1) % READAHEAD_QUEUE;
+        queue_len--;
+        pthread_mutex_unlock(&readahead_lock);
+
+        // Readers may have got there first
+        while (r.count > 0 && is_cached(r.start)) {
+            r.start++;
+            r.count--;
+        }
+        if (r.count > 0 && layer_of(r.start * CACHE_BLOCK)->format == FORMAT_TAR) {
+            // One read for the whole window
+            long len = read_full(buffer, (size_t)r.count * CACHE_BLOCK,
+                                 r.start * CACHE_BLOCK);
+            for (long off = 0; off < len; off += CACHE_BLOCK) {
+                insert_cached(r.start + off / CACHE_BLOCK, buffer + off,
+                              len - off < CACHE_BLOCK ? len - off : CACHE_BLOCK, 1);
+            }
+        } else {
+            for (int i = 0; i < r.count; i++) {
+                if (!is_cached(r.start + i) &&
+                    inflate_block(r.start + i, buffer, 1) != CACHE_BLOCK) {
+                    break;
+                }
+            }
+        }
+
+        pthread_mutex_lock(&readahead_lock);
+    }
+    pthread_mutex_unlock(&readahead_lock);
+    free(buffer);
+    return NULL;
+}
+
+// Read size bytes at offset pos of the tar stream. Returns the number of
+// bytes read (fewer at its end) or a negative errno.
+long archive_pread(char *buffer, size_t size, uint64_t pos) {
+    long done = 0;
+    unsigned char *block = NULL;
+
+    while (done < (long)size) {
+        uint64_t index = (pos + done) / CACHE_BLOCK;
+        size_t offset = (pos + done) % CACHE_BLOCK;
+        size_t want = CACHE_BLOCK - offset < size - done ?
+                      CACHE_BLOCK - offset : size - done;
+        long len, n = 0;
+
+        note_access(index);
+        if (!read_cached(index, offset, buffer + done, want, &len)) {
+            if (!block && !(block = malloc(CACHE_BLOCK))) return -ENOMEM;
+            len = load_block(index, block, 0);
+            if (len < 0) {
+                free(block);
+                return len;
+            }
+            if (len > (long)offset) {
+                memcpy(buffer + done, block + offset,
+                       len - offset < want ? len - offset : want);
+            }
+        }
+        if (len > (long)offset) n = len - offset < want ? len - offset : want;
+
+        done += n;
+        if (len < CACHE_BLOCK) break; // End of the stream
+    }
+    free(block);
+    return done;
+}
+
+// Text of the statistics file, as snprintf would write it
+int format_stats(char *out, size_t size) {
+    unsigned long hits = 0, misses = 0, readahead_blocks = 0, readahead_hits = 0;
+    int blocks = 0;
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        struct CacheShard *s = &cache_shards[i];
+        pthread_mutex_lock(&s->lock);
+        hits += s->hits;
+        misses += s->misses;
+        readahead_blocks += s->readahead_blocks;
+        readahead_hits += s->readahead_hits;
+        blocks += s->num_blocks;
+        pthread_mutex_unlock(&s->lock);
+    }
+    pthread_mutex_lock(&readahead_lock);
+    unsigned long requests = readahead_requests;
+    pthread_mutex_unlock(&readahead_lock);
+
+    return snprintf(out, size,
+                    "block_size %d\n"
+                    "cached_blocks %d/%d\n"
+                    "hits %lu\n"
+                    "misses %lu\n"
+                    "readahead_requests %lu\n"
+                    "readahead_blocks %lu\n"
+                    "readahead_hits %lu\n"
+                    "inline_files %lu\n"
+                    "inline_bytes %lu\n",
+                    CACHE_BLOCK, blocks, CACHE_BLOCKS, hits, misses, requests,
+                    readahead_blocks, readahead_hits,
+                    __atomic_load_n(&inline_files, __ATOMIC_RELAXED),
+                    __atomic_load_n(&inline_bytes, __ATOMIC_RELAXED));
+}
 
 // --- Helper Functions ---
 
-// Convert Octal string to integer
-long octal_to_int(char *oct) {
-    long value = 0;
-    while (*oct && *oct != ' ') {
-        if (*oct < '0' || *oct > '7') break;
-        value = (value << 3) | (*oct++ - '0');
+// Convert a numeric header field to an integer. Fields are octal text
+// (possibly space padded), or base-256 when the top bit of the first byte
+// is set, which GNU tar uses for values that do not fit (sizes from 8GB).
+int64_t parse_number(const unsigned char *field, int len) {
+    if (field[0] & 0x80) {
+        // Two's complement, the flag bit standing in for the sign
+        int64_t value = (field[0] & 0x40) ? -1 : 0;
+        value = (value << 6) | (field[0] & 0x3f);
+        for (int i = 1; i < len; i++) {
+            value = (value << 8) | field[i];
+        }
+        return value;
+    }
+
+    int64_t value = 0;
+    int i = 0;
+    while (i < len && field[i] == ' ') i++;
+    while (i < len && field[i] >= '0' && field[i] <= '7') {
+        value = (value << 3) | (field[i++] - '0');
     }
     return value;
 }
 
-// Add a node to the linked list
-void add_node(struct TarNode *node) {
-    if (head == NULL) {
-        head = node;
-    } else {
-        struct TarNode *current = head;
-        while (current->next != NULL) {
-            current = current->next;
+// FNV-1a hash of the first len bytes of path
+unsigned long hash_path(const char *path, size_t len) {
+    unsigned long hash = 14695981039346656037UL;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)path[i]) * 1099511628211UL;
+    }
+    return hash;
+}
+
+// Find the node of a table whose path is exactly the first len bytes of
+// path; the one inserted last if there are several
+struct TarNode *lookup_path(struct PathTable *table, const char *path, size_t len) {
+    if (table->num_buckets == 0) return NULL;
+
+    unsigned long hash = hash_path(path, len);
+    struct TarNode *curr = table->buckets[hash & (table->num_buckets - 1)];
+    while (curr) {
+        if (curr->hash == hash && memcmp(curr->path, path, len) == 0 &&
+            curr->path[len] == '\0') {
+            return curr;
+        }
+        curr = curr->hash_next;
+    }
+    return NULL;
+}
+
+// Find the node of the tree whose path is exactly the first len bytes of path
+struct TarNode *lookup_node(const char *path, size_t len) {
+    if (len == 0) return &root;
+    return lookup_path(&tree_paths, path, len);
+}
+
+// Insert a node into a table, doubling it once the load reaches 1
+void insert_path(struct PathTable *table, struct TarNode *node) {
+    if (table->num_nodes >= table->num_buckets) {
+        size_t new_size = table->num_buckets ? table->num_buckets * 2 : 1024;
+        struct TarNode **new_buckets = calloc(new_size, sizeof(struct TarNode *));
+        if (!new_buckets) {
+            perror("calloc");
+            exit(1);
+        }
+        for (size_t i = 0; i < table->num_buckets; i++) {
+            struct TarNode *curr = table->buckets[i];
+            while (curr) {
+                struct TarNode *next = curr->hash_next;
+                curr->hash_next = new_buckets[curr->hash & (new_size - 1)];
+                new_buckets[curr->hash & (new_size - 1)] = curr;
+                curr = next;
+            }
+        }
+        free(table->buckets);
+        table->buckets = new_buckets;
+        table->num_buckets = new_size;
+    }
+
+    node->hash = hash_path(node->path, strlen(node->path));
+    node->hash_next = table->buckets[node->hash & (table->num_buckets - 1)];
+    table->buckets[node->hash & (table->num_buckets - 1)] = node;
+    table->num_nodes++;
+}
+
+// Empty a table that owns its nodes. Their extents and inline data are
+// left alone: hard links may share them, or they are in an index mapping.
+void clear_paths(struct PathTable *table) {
+    for (size_t i = 0; i < table->num_buckets; i++) {
+        struct TarNode *curr = table->buckets[i];
+        while (curr) {
+            struct TarNode *next = curr->hash_next;
+            free(curr->path);
+            free(curr->linkname);
+            free(curr);
+            curr = next;
+        }
+    }
+    free(table->buckets);
+    memset(table, 0, sizeof(*table));
+}
+
+// Append a node to its parent directory's child array
+void add_child(struct TarNode *parent, struct TarNode *node) {
+    if (parent->num_children == parent->max_children) {
+        int new_max = parent->max_children ? parent->max_children * 2 : 4;
+        struct TarNode **children = realloc(parent->children,
+                                            new_max * sizeof(struct TarNode *));
+        if (!children) {
+            perror("realloc");
+            exit(1);
+        }
+        parent->children = children;
+        parent->max_children = new_max;
+    }
+    parent->children[parent->num_children++] = node;
+    node->parent = parent;
+}
+
+struct TarNode *get_dir(const char *path, size_t len, int layer);
+
+// Link a node into the hash table and under its parent directory
+void link_node(struct TarNode *node) {
+    char *slash = strrchr(node->path, '/');
+    node->name = slash ? slash + 1 : node->path;
+    add_child(get_dir(node->path, slash ? slash - node->path : 0, node->layer), node);
+    insert_path(&tree_paths, node);
+}
+
+// Return the directory for the first len bytes of path. Archives may list
+// a directory after its contents or not at all, so missing ones are created
+// here (for the layer whose member needs them) and take their real metadata
+// once their own header shows up.
+struct TarNode *get_dir(const char *path, size_t len, int layer) {
+    struct TarNode *dir = lookup_node(path, len);
+    if (dir) return dir;
+
+    dir = (struct TarNode *)malloc(sizeof(struct TarNode));
+    memset(dir, 0, sizeof(struct TarNode));
+    dir->path = strndup(path, len);
+    dir->type = '5';
+    dir->mode = 0755;
+    dir->uid = getuid();
+    dir->gid = getgid();
+    dir->layer = layer;
+    dir->implicit = 1;
+    link_node(dir);
+    return dir;
+}
+
+// The first len bytes of path, "dir/name", as "dir/<prefix>name"
+char *prefixed_path(const char *path, size_t len, const char *prefix) {
+    size_t dir_len = len;
+    while (dir_len > 0 && path[dir_len - 1] != '/') dir_len--;
+
+    char *out = malloc(len + strlen(prefix) + 1);
+    if (out) {
+        sprintf(out, "%.*s%s%.*s", (int)dir_len, path, prefix,
+                (int)(len - dir_len), path + dir_len);
+    }
+    return out;
+}
+
+// Layer of the whiteout member whose path is key, -1 if there is none
+int whiteout_layer(char *key) {
+    if (!key) {
+        perror("malloc");
+        exit(1);
+    }
+    struct TarNode *whiteout = lookup_path(&whiteouts, key, strlen(key));
+    free(key);
+    return whiteout ? whiteout->layer : -1;
+}
+
+// Whether a member is hidden by the layers above its own, which are merged
+// first: by a whiteout of it or of a directory above it, by an opaque
+// directory above it, or by what they have at its path or above it
+int hidden_above(struct TarNode *node) {
+    size_t len = strlen(node->path);
+    for (size_t end = 1; end <= len; end++) {
+        if (end < len && node->path[end] != '/') continue;
+
+        // The first end bytes are the member or a directory above it
+        if (whiteout_layer(prefixed_path(node->path, end, WHITEOUT_PREFIX)) >
+            node->layer) {
+            return 1;
+        }
+        struct TarNode *above = lookup_node(node->path, end);
+        if (above && above->layer > node->layer) {
+            if (end < len && above->type != '5') return 1;
+            // Directories only known from higher layers' contents take
+            // this one's metadata
+            if (end == len && (!above->implicit || node->type != '5')) return 1;
+        }
+        if (end < len) {
+            char *marker = malloc(end + sizeof(OPAQUE_MARKER) + 1);
+            if (marker) sprintf(marker, "%.*s/%s", (int)end, node->path, OPAQUE_MARKER);
+            if (whiteout_layer(marker) > node->layer) return 1;
+        }
+    }
+    return 0;
+}
+
+// Add a parsed header to the tree. A path seen before (an implicit
+// directory, or an earlier copy of an appended member) is updated in place,
+// so the last header for a path wins as it does when extracting.
+//
+// A stack of layers is merged from the top layer down, so whatever a layer
+// adds is final: members a higher layer has already replaced or whited out
+// are left out. Lookups then take one hash probe however many layers there
+// are, and FUSE can serve what the merge has found while it goes on.
+void add_node(struct TarNode *node) {
+    // A hard link shares the data of the member it names, which always
+    // comes before it in the archive (in a stack, in the same layer, even
+    // if a higher one hides it)
+    if (node->type == '1') {
+        struct TarNode *target = lookup_node(node->linkname, strlen(node->linkname));
+        if (!target || target->layer != node->layer) {
+            target = lookup_path(&shadowed, node->linkname, strlen(node->linkname));
+        }
+        node->type = '0';
+        if (target && target->type == '0') {
+            node->size = target->size;
+            node->data_offset = target->data_offset;
+            node->extents = target->extents;
+            node->num_extents = target->num_extents;
+            node->inline_data = target->inline_data;
+        }
+        node->header_offset = node->end_offset = 0; // Not a file by itself
+        free(node->linkname);
+        node->linkname = NULL;
+    }
+
+    if (num_layers > 1) {
+        const char *name = strrchr(node->path, '/');
+        name = name ? name + 1 : node->path;
+        if (strncmp(name, WHITEOUT_PREFIX, strlen(WHITEOUT_PREFIX)) == 0) {
+            insert_path(&whiteouts, node);
+            return;
+        }
+        if (hidden_above(node)) {
+            insert_path(&shadowed, node);
+            return;
+        }
+    }
+
+    struct TarNode *old = lookup_node(node->path, strlen(node->path));
+    if (!old) {
+        link_node(node);
+        return;
+    }
+
+    // Readers may still use the old extents and inline data, so they are
+    // not freed
+    old->implicit = 0;
+    free(old->linkname);
+    old->linkname = node->linkname;
+    old->size = node->size;
+    old->type = node->type;
+    old->data_offset = node->data_offset;
+    old->header_offset = node->header_offset;
+    old->end_offset = node->end_offset;
+    old->layer = node->layer;
+    old->extents = node->extents;
+    old->num_extents = node->num_extents;
+    old->inline_data = node->inline_data;
+    old->mode = node->mode;
+    old->uid = node->uid;
+    old->gid = node->gid;
+    old->mtime = node->mtime;
+    old->rdev = node->rdev;
+    free(node->path);
+    free(node);
+}
+
+// Remove trailing slashes from path (for directory normalization) and
+// leading "/" and "./", as tar does when extracting. Returns whether there
+// was a trailing slash.
+int trim_slash(char *path) {
+    int len = strlen(path);
+    int trailing = len > 0 && path[len - 1] == '/';
+    while (len > 0 && path[len - 1] == '/') {
+        path[--len] = '\0';
+    }
+
+    char *start = path;
+    while (start[0] == '/' || (start[0] == '.' && start[1] == '/')) {
+        start += start[0] == '/' ? 1 : 2;
+    }
+    if (strcmp(start, ".") == 0) start += 1;
+    memmove(path, start, strlen(start) + 1);
+    return trailing;
+}
+
+// Whether len more bytes of inline data fit the options
+int inline_fits(uint64_t len) {
+    return len > 0 && len <= options.inline_max &&
+           inline_bytes + len <= options.inline_budget;
+}
+
+void count_inline(uint64_t len) {
+    __atomic_add_fetch(&inline_files, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&inline_bytes, len, __ATOMIC_RELAXED);
+}
+
+// Room for len bytes of inline data in the current slab or a new one.
+// Only the scan allocates.
+char *inline_alloc(size_t len) {
+    if (INLINE_SLAB - inline_slab_used < len) {
+        if (!(inline_slab = malloc(INLINE_SLAB))) {
+            inline_slab_used = INLINE_SLAB;
+            return NULL;
+        }
+        inline_slab_used = 0;
+    }
+    char *data = inline_slab + inline_slab_used;
+    inline_slab_used += len;
+    return data;
+}
+
+// Open the archives for the whole mount and find out how they are
+// compressed: those in the colon-separated list of -o layers (bottom
+// first), or test.tar
+void open_archives() {
+    char *list = strdup(options.layers ? options.layers : TAR_FILE);
+    if (!list) {
+        perror("strdup");
+        exit(1);
+    }
+    for (char *p = list; *p; p++) num_layers += *p == ':';
+    num_layers++;
+    if (num_layers > MAX_LAYERS) {
+        fprintf(stderr, "At most %d layers are supported\n", MAX_LAYERS);
+        exit(1);
+    }
+    layers = calloc(num_layers, sizeof(struct Layer));
+    if (!layers) {
+        perror("calloc");
+        exit(1);
+    }
+
+    char *save = NULL;
+    char *name = strtok_r(list, ":", &save);
+    for (int i = 0; i < num_layers; i++) {
+        struct Layer *layer = &layers[i];
+        layer->name = name ? name : "";
+        if (!name || !realpath(name, layer->path) ||
+            (layer->fd = open(layer->path, O_RDONLY)) < 0 ||
+            fstat(layer->fd, &layer->st) < 0) {
+            fprintf(stderr, "Cannot open %s: %s\n", layer->name,
+                    name ? strerror(errno) : "empty layer name");
+            exit(1);
+        }
+        snprintf(layer->index_path, sizeof(layer->index_path), "%s.idx", layer->path);
+        layer->format = detect_format(layer->fd);
+        layer->base = (uint64_t)i << LAYER_SHIFT;
+        name = strtok_r(NULL, ":", &save);
+    }
+    // The names point into list for the whole mount
+
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        pthread_mutex_init(&cache_shards[i].lock, NULL);
+    }
+}
+
+// Until the background scan completes the tree may change under readers,
+// so they hold scan_lock. Returns whether it was taken.
+int lock_tree() {
+    if (__atomic_load_n(&scan_complete, __ATOMIC_ACQUIRE)) return 0;
+    pthread_mutex_lock(&scan_lock);
+    return 1;
+}
+
+void unlock_tree(int locked) {
+    if (locked) pthread_mutex_unlock(&scan_lock);
+}
+
+// Add the nodes parsed since the last batch and wake up waiting lookups
+void add_batch(struct TarNode **batch, int count) {
+    pthread_mutex_lock(&scan_lock);
+    for (int i = 0; i < count; i++) {
+        add_node(batch[i]);
+    }
+    pthread_cond_broadcast(&scan_progress);
+    pthread_mutex_unlock(&scan_lock);
+}
+
+// --- Header Parsing ---
+
+// Besides the ustar header itself, members can be described by GNU long
+// name/link entries ('L'/'K') and PAX extended headers ('x' for the next
+// member, 'g' for all that follow), which come right before them.
+#define MAX_EXTENDED_HEADER (16 << 20)  // Larger 'L'/'K'/'x'/'g' data is skipped
+#define MAX_SPARSE_EXTENTS (1 << 24)
+
+// What the entries before a member say about it. Numbers are -1 and
+// strings NULL where they say nothing.
+struct ExtendedHeader {
+    char *path;
+    char *linkpath;
+    int64_t size;           // Of the data stored in the archive
+    int64_t mtime;
+    int64_t uid;
+    int64_t gid;
+
+    // GNU sparse files, PAX formats 0.0, 0.1 and 1.0
+    char *sparse_name;      // Real path, the header holds a made-up one
+    int64_t sparse_size;    // Apparent size of the file
+    int sparse_major;       // 1: the map is stored at the start of the data
+    int64_t sparse_offset;  // 0.0: offset record waiting for its numbytes
+    struct Extent *sparse;
+    int num_sparse;
+    int max_sparse;
+};
+
+void clear_extended(struct ExtendedHeader *h) {
+    free(h->path);
+    free(h->linkpath);
+    free(h->sparse_name);
+    free(h->sparse);
+    memset(h, 0, sizeof(*h));
+    h->size = h->mtime = h->uid = h->gid = h->sparse_size = h->sparse_offset = -1;
+}
+
+// Header checksum: the sum of all header bytes with the checksum field
+// taken as spaces. Some old tars summed signed chars.
+int checksum_ok(const unsigned char *header) {
+    int64_t stored = parse_number(header + 148, 8);
+    int64_t sum = 0, signed_sum = 0;
+    for (int i = 0; i < BLOCK_SIZE; i++) {
+        unsigned char c = (i >= 148 && i < 156) ? ' ' : header[i];
+        sum += c;
+        signed_sum += (signed char)c;
+    }
+    return stored == sum || stored == signed_sum;
+}
+
+// Append a data region to a sparse map; empty ones (GNU tar ends maps
+// with one at the file size) are dropped
+void add_extent(struct ExtendedHeader *h, uint64_t offset, uint64_t length) {
+    if (length == 0 || h->num_sparse == MAX_SPARSE_EXTENTS) return;
+    if (h->num_sparse == h->max_sparse) {
+        h->max_sparse = h->max_sparse ? h->max_sparse * 2 : 16;
+        h->sparse = realloc(h->sparse, h->max_sparse * sizeof(struct Extent));
+        if (!h->sparse) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    h->sparse[h->num_sparse].offset = offset;
+    h->sparse[h->num_sparse].length = length;
+    h->sparse[h->num_sparse].data_offset = 0;
+    h->num_sparse++;
+}
+
+void replace_string(char **field, char *value) {
+    free(*field);
+    *field = value;
+}
+
+// Apply one PAX record. Only the keys that change what the mount shows are
+// used; times keep whole seconds.
+void set_pax(struct ExtendedHeader *h, int global, const char *key,
+             size_t key_len, const char *value, size_t value_len) {
+#define KEY_IS(k) (key_len == strlen(k) && memcmp(key, k, key_len) == 0)
+    char *v = strndup(value, value_len);
+    if (!v) return;
+
+    // A global header only sets ownership and times, paths and sizes are
+    // per member
+    if (KEY_IS("mtime")) h->mtime = strtoll(v, NULL, 10);
+    else if (KEY_IS("uid")) h->uid = strtoll(v, NULL, 10);
+    else if (KEY_IS("gid")) h->gid = strtoll(v, NULL, 10);
+    else if (global) ;
+    else if (KEY_IS("path")) { replace_string(&h->path, v); v = NULL; }
+    else if (KEY_IS("linkpath")) { replace_string(&h->linkpath, v); v = NULL; }
+    else if (KEY_IS("size")) h->size = strtoll(v, NULL, 10);
+    else if (KEY_IS("GNU.sparse.name")) { replace_string(&h->sparse_name, v); v = NULL; }
+    else if (KEY_IS("GNU.sparse.size") || KEY_IS("GNU.sparse.realsize")) {
+        h->sparse_size = strtoll(v, NULL, 10);
+    } else if (KEY_IS("GNU.sparse.major")) h->sparse_major = atoi(v);
+    else if (KEY_IS("GNU.sparse.offset")) {
+        // 0.0: offset and numbytes records alternate
+        h->sparse_offset = strtoll(v, NULL, 10);
+    } else if (KEY_IS("GNU.sparse.numbytes")) {
+        if (h->sparse_offset >= 0) {
+            add_extent(h, h->sparse_offset, strtoull(v, NULL, 10));
+        }
+        h->sparse_offset = -1;
+    } else if (KEY_IS("GNU.sparse.map")) {
+        // 0.1: "offset,size,offset,size..."
+        char *p = v;
+        while (*p) {
+            char *next;
+            uint64_t offset = strtoull(p, &next, 10);
+            if (*next != ',') break;
+            uint64_t length = strtoull(next + 1, &p, 10);
+            add_extent(h, offset, length);
+            if (*p != ',') break;
+            p++;
+        }
+    }
+    free(v);
+#undef KEY_IS
+}
+
+// Parse PAX records, each "<length> <key>=<value>\n"
+void parse_pax(const char *data, size_t len, struct ExtendedHeader *h, int global) {
+    const char *p = data, *end = data + len;
+    while (p < end) {
+        char *rest;
+        unsigned long n = strtoul(p, &rest, 10);
+        if (*rest != ' ' || n <= (size_t)(rest - p) + 1 || n > (size_t)(end - p) ||
+            p[n - 1] != '\n') {
+            break;
+        }
+        const char *key = rest + 1, *record_end = p + n - 1;
+        const char *eq = memchr(key, '=', record_end - key);
+        if (!eq) break;
+        set_pax(h, global, key, eq - key, eq + 1, record_end - (eq + 1));
+        p += n;
+    }
+}
+
+// Read a member's data (GNU long names, PAX records) as a string. Returns
+// NULL when the archive ends, or when the data is unreasonably large, in
+// which case it is skipped.
+char *read_data(struct Decoder *d, uint64_t size, unsigned char *scratch) {
+    uint64_t padded = (size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+    if (size > MAX_EXTENDED_HEADER) {
+        fprintf(stderr, "%s: skipping %llu byte extended header\n",
+                d->layer->name, (unsigned long long)size);
+        decoder_skip(d, padded, scratch, IN_CHUNK);
+        return NULL;
+    }
+
+    char *data = malloc(padded + 1);
+    if (!data) {
+        perror("malloc");
+        exit(1);
+    }
+    if (decoder_read(d, (unsigned char *)data, padded) != (long)padded) {
+        free(data);
+        return NULL;
+    }
+    data[size] = '\0';
+    return data;
+}
+
+// Old GNU sparse members ('S') keep up to 4 regions in the header and the
+// rest in extension blocks of 21 after it, each region an offset and size
+// field of 12 bytes. A flag after the regions says whether more follow.
+int read_gnu_sparse(struct Decoder *d, const unsigned char *header,
+                    struct ExtendedHeader *h) {
+    for (int i = 0; i < 4 && header[386 + i * 24]; i++) {
+        add_extent(h, parse_number(header + 386 + i * 24, 12),
+                   parse_number(header + 398 + i * 24, 12));
+    }
+    h->sparse_size = parse_number(header + 483, 12);
+
+    int extended = header[482];
+    unsigned char block[BLOCK_SIZE];
+    while (extended) {
+        if (decoder_read(d, block, BLOCK_SIZE) != BLOCK_SIZE) return -1;
+        for (int i = 0; i < 21 && block[i * 24]; i++) {
+            add_extent(h, parse_number(block + i * 24, 12),
+                       parse_number(block + 12 + i * 24, 12));
+        }
+        extended = block[504];
+    }
+    return 0;
+}
+
+// PAX sparse 1.0 keeps the map at the start of the member's data: the
+// number of regions, then the offset and size of each, one decimal number
+// per line, padded to a whole block. Sets map_bytes to the blocks read.
+int read_sparse_map(struct Decoder *d, struct ExtendedHeader *h,
+                    uint64_t *map_bytes) {
+    unsigned char block[BLOCK_SIZE];
+    int64_t count = -1, have = 0;
+    uint64_t value = 0, offset = 0;
+    int digits = 0;
+
+    *map_bytes = 0;
+    while (count < 0 || have < 2 * count) {
+        if (decoder_read(d, block, BLOCK_SIZE) != BLOCK_SIZE) return -1;
+        *map_bytes += BLOCK_SIZE;
+
+        for (int i = 0; i < BLOCK_SIZE && (count < 0 || have < 2 * count); i++) {
+            if (block[i] >= '0' && block[i] <= '9' && digits < 20) {
+                value = value * 10 + (block[i] - '0');
+                digits++;
+                continue;
+            }
+            if (block[i] != '\n' || digits == 0) return -1;
+
+            if (count < 0) {
+                if (value > MAX_SPARSE_EXTENTS) return -1;
+                count = value;
+            } else if (have++ % 2 == 0) {
+                offset = value;
+            } else {
+                add_extent(h, offset, value);
+            }
+            value = 0;
+            digits = 0;
+        }
+    }
+    return 0;
+}
+
+// Member path: PAX path, GNU long name, or ustar prefix + name
+char *member_path(const unsigned char *header, struct ExtendedHeader *h) {
+    if (h->sparse_name) return strdup(h->sparse_name);
+    if (h->path) return strdup(h->path);
+
+    char *name = strndup((const char *)header, 100);
+    // Old GNU headers ("ustar  ") use the prefix field for other things
+    if (memcmp(header + 257, "ustar\0", 6) == 0 && header[345]) {
+        char *prefix = strndup((const char *)header + 345, 155);
+        char *joined = malloc(strlen(prefix) + strlen(name) + 2);
+        if (joined) sprintf(joined, "%s/%s", prefix, name);
+        free(prefix);
+        free(name);
+        name = joined;
+    }
+    return name;
+}
+
+// --- Index Sidecar ---
+
+// The scan result is saved next to each archive as <archive>.idx and used
+// instead of scanning on later mounts, as long as the archive's size,
+// mtime and a hash of its first and last FINGERPRINT_SPAN bytes match. It
+// lists the archive's own members, whatever stack it is mounted in, and is
+// merged into the tree the same way as a scan.
+#define INDEX_MAGIC "TARFSIDX"
+#define INDEX_VERSION 5
+#define FINGERPRINT_SPAN (1 << 20)
+#define SCAN_BATCH 256              // Nodes added to the tree per lock hold
+
+struct IndexHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t format;
+    uint64_t archive_size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t fingerprint;
+    uint64_t num_entries;
+    uint64_t num_seek_points;
+    uint64_t file_size;     // Of the whole index, catches truncated files
+    uint64_t inline_max;    // Members up to this size have inline data
+};
+
+// Followed by the extents of a sparse file, then the path and link name,
+// padded to 8 bytes, then any inline data, padded to 8 bytes. Entries are
+// the members as the scan finds them, in archive order, with offsets in
+// the archive's own stream.
+struct IndexEntry {
+    uint64_t size;
+    uint64_t data_offset;
+    uint64_t header_offset;
+    uint64_t end_offset;
+    int64_t mtime;
+    uint64_t rdev;
+    uint32_t mode;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t path_len;
+    uint32_t link_len;
+    uint32_t num_extents;
+    uint32_t inline_len;
+    uint8_t type;
+    uint8_t pad[3];
+};
+
+// Followed by the window (gzip), padded to 8 bytes
+struct IndexSeekPoint {
+    uint64_t out_pos;
+    uint64_t in_pos;
+    int32_t bits;
+    uint32_t window_len;
+};
+
+#define PAD8(n) (((n) + 7) & ~(size_t)7)
+
+size_t entry_size(const struct IndexEntry *entry) {
+    return sizeof(*entry) + entry->num_extents * sizeof(struct Extent) +
+           PAD8(entry->path_len + entry->link_len) + PAD8(entry->inline_len);
+}
+
+uint64_t archive_fingerprint(struct Layer *layer) {
+    unsigned char *buf = malloc(2 * FINGERPRINT_SPAN);
+    if (!buf) return 0;
+
+    off_t tail = layer->st.st_size - FINGERPRINT_SPAN;
+    if (tail < FINGERPRINT_SPAN) tail = FINGERPRINT_SPAN;
+    ssize_t head_len = pread(layer->fd, buf, FINGERPRINT_SPAN, 0);
+    ssize_t tail_len = pread(layer->fd, buf + (head_len > 0 ? head_len : 0),
+                             FINGERPRINT_SPAN, tail);
+    size_t len = (head_len > 0 ? head_len : 0) + (tail_len > 0 ? tail_len : 0);
+
+    uint64_t hash = hash_path((char *)buf, len);
+    free(buf);
+    return hash;
+}
+
+// An index being written by the scan of a layer; written to a temporary
+// file first so a crash never leaves a half-written index behind
+struct IndexWriter {
+    FILE *fp;               // NULL once writing failed
+    char tmp_path[PATH_MAX + 16];
+    uint64_t num_entries;
+};
+
+void index_begin(struct IndexWriter *w, struct Layer *layer) {
+    struct IndexHeader header;
+    memset(&header, 0, sizeof(header));
+    w->num_entries = 0;
+    snprintf(w->tmp_path, sizeof(w->tmp_path), "%s.tmp", layer->index_path);
+
+    // The header is written again once the counts are known
+    w->fp = fopen(w->tmp_path, "wb");
+    if (w->fp && fwrite(&header, sizeof(header), 1, w->fp) != 1) {
+        fclose(w->fp);
+        w->fp = NULL;
+    }
+    if (!w->fp) {
+        fprintf(stderr, "Cannot save index %s: %s\n", layer->index_path,
+                strerror(errno));
+        unlink(w->tmp_path);
+    }
+}
+
+// Write a member as the scan parsed it
+void index_add(struct IndexWriter *w, struct Layer *layer, struct TarNode *node) {
+    static const char zeros[8];
+    if (!w->fp) return;
+
+    struct IndexEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.size = node->size;
+    entry.data_offset = node->data_offset - layer->base;
+    entry.header_offset = node->header_offset - layer->base;
+    entry.end_offset = node->end_offset - layer->base;
+    entry.mtime = node->mtime;
+    entry.rdev = node->rdev;
+    entry.mode = node->mode;
+    entry.uid = node->uid;
+    entry.gid = node->gid;
+    entry.path_len = strlen(node->path);
+    entry.link_len = node->linkname ? strlen(node->linkname) : 0;
+    entry.num_extents = node->num_extents;
+    entry.inline_len = node->inline_data ? node->size : 0;
+    entry.type = node->type;
+
+    int ok = fwrite(&entry, sizeof(entry), 1, w->fp) == 1;
+    for (int i = 0; ok && i < node->num_extents; i++) {
+        struct Extent extent = node->extents[i];
+        extent.data_offset -= layer->base;
+        ok = fwrite(&extent, sizeof(extent), 1, w->fp) == 1;
+    }
+    size_t len = entry.path_len + entry.link_len;
+    ok = ok && fwrite(node->path, 1, entry.path_len, w->fp) == entry.path_len &&
+         (!node->linkname ||
+          fwrite(node->linkname, 1, entry.link_len, w->fp) == entry.link_len) &&
+         fwrite(zeros, 1, PAD8(len) - len, w->fp) == PAD8(len) - len &&
+         (!node->inline_data ||
+          fwrite(node->inline_data, 1, entry.inline_len, w->fp) == entry.inline_len) &&
+         fwrite(zeros, 1, PAD8(entry.inline_len) - entry.inline_len, w->fp) ==
+             PAD8(entry.inline_len) - entry.inline_len;
+    if (!ok) {
+        fclose(w->fp);
+        w->fp = NULL;
+        unlink(w->tmp_path);
+        return;
+    }
+    w->num_entries++;
+}
+
+// Add the seek points and the header and put the index in place, or drop
+// it if the scan failed (complete is 0)
+void index_finish(struct IndexWriter *w, struct Layer *layer, int complete) {
+    static const char zeros[8];
+    if (!w->fp) return;
+
+    struct IndexHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    header.version = INDEX_VERSION;
+    header.format = layer->format;
+    header.archive_size = layer->st.st_size;
+    header.mtime_sec = layer->st.st_mtim.tv_sec;
+    header.mtime_nsec = layer->st.st_mtim.tv_nsec;
+    header.fingerprint = archive_fingerprint(layer);
+    header.num_entries = w->num_entries;
+    header.num_seek_points = layer->num_seek_points;
+    header.inline_max = options.inline_max;
+
+    int ok = complete;
+    for (int i = 0; ok && i < layer->num_seek_points; i++) {
+        struct SeekPoint *p = &layer->seek_points[i];
+        struct IndexSeekPoint point = { p->out_pos, p->in_pos, p->bits,
+                                        p->window_len };
+        size_t pad = PAD8(p->window_len) - p->window_len;
+        ok = fwrite(&point, sizeof(point), 1, w->fp) == 1 &&
+             (p->window_len == 0 ||
+              fwrite(p->window, 1, p->window_len, w->fp) == p->window_len) &&
+             fwrite(zeros, 1, pad, w->fp) == pad;
+    }
+    if (ok) {
+        header.file_size = ftell(w->fp);
+        ok = fseek(w->fp, 0, SEEK_SET) == 0 &&
+             fwrite(&header, sizeof(header), 1, w->fp) == 1;
+    }
+    if (fclose(w->fp) != 0) ok = 0;
+    w->fp = NULL;
+
+    if (!ok || rename(w->tmp_path, layer->index_path) < 0) {
+        if (complete) {
+            fprintf(stderr, "Cannot save index %s: %s\n", layer->index_path,
+                    strerror(errno));
+        }
+        unlink(w->tmp_path);
+    }
+}
+
+// Merge a layer's members from its saved index if that matches the
+// archive, with its seek points. Returns 0 on success, -1 (having changed
+// nothing) otherwise.
+int load_index(struct Layer *layer) {
+    const char *index_path = layer->index_path;
+    int fd = open(index_path, O_RDONLY);
+    if (fd < 0) return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(struct IndexHeader)) {
+        close(fd);
+        return -1;
+    }
+    // Seek point windows, extents and inline data are used straight from
+    // the mapping, so it stays mapped for the whole mount
+    char *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+
+    const struct IndexHeader *header = (const struct IndexHeader *)map;
+    char *end = map + st.st_size;
+    if (memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != INDEX_VERSION ||
+        header->format != (uint32_t)layer->format ||
+        header->file_size != (uint64_t)st.st_size ||
+        header->archive_size != (uint64_t)layer->st.st_size ||
+        header->mtime_sec != layer->st.st_mtim.tv_sec ||
+        header->mtime_nsec != layer->st.st_mtim.tv_nsec ||
+        header->fingerprint != archive_fingerprint(layer)) {
+        fprintf(stderr, "Index %s is out of date, rescanning\n", index_path);
+        munmap(map, st.st_size);
+        return -1;
+    }
+    if (header->inline_max < options.inline_max) {
+        fprintf(stderr, "Index %s has less inline data than inline_max asks "
+                "for, rescanning\n", index_path);
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    // Check every record fits before touching the tree
+    char *pos = map + sizeof(struct IndexHeader);
+    for (uint64_t i = 0; pos && i < header->num_entries; i++) {
+        const struct IndexEntry *entry = (const struct IndexEntry *)pos;
+        if ((size_t)(end - pos) < sizeof(*entry) ||
+            entry->path_len == 0 || entry->path_len > MAX_EXTENDED_HEADER ||
+            entry->link_len > MAX_EXTENDED_HEADER ||
+            (entry->type == '1' && entry->link_len == 0) ||
+            entry->num_extents > (size_t)(end - pos) / sizeof(struct Extent) ||
+            entry->inline_len > INLINE_MAX_LIMIT ||
+            (entry->inline_len && entry->inline_len != entry->size) ||
+            (size_t)(end - pos) < entry_size(entry)) {
+            pos = NULL;
+            break;
+        }
+        pos += entry_size(entry);
+    }
+    // A compressed layer is read through its seek points, the first at the
+    // start of the stream and the rest in increasing order: find_seek_point
+    // searches them, and add_seek_point would free a repeated one's window,
+    // which points into the mapping. A plain tar has none.
+    int compressed = layer->format != FORMAT_TAR;
+    if (pos && (header->num_seek_points > 0) != compressed) pos = NULL;
+    char *points = pos;
+    uint64_t last_out_pos = 0;
+    for (uint64_t i = 0; pos && i < header->num_seek_points; i++) {
+        const struct IndexSeekPoint *point = (const struct IndexSeekPoint *)pos;
+        if ((size_t)(end - pos) < sizeof(*point) ||
+            point->window_len > WINDOW_SIZE ||
+            (size_t)(end - pos) - sizeof(*point) < PAD8(point->window_len) ||
+            point->bits < 0 || point->bits > 7 ||
+            point->in_pos > header->archive_size ||
+            (i == 0 ? point->out_pos != 0 : point->out_pos <= last_out_pos)) {
+            pos = NULL;
+            break;
+        }
+        last_out_pos = point->out_pos;
+        pos += sizeof(*point) + PAD8(point->window_len);
+    }
+    if (!pos) {
+        fprintf(stderr, "Index %s is corrupt, rescanning\n", index_path);
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    // Seek points first, members of a compressed layer are read through
+    // them as soon as they are in the tree
+    pos = points;
+    for (uint64_t i = 0; i < header->num_seek_points; i++) {
+        const struct IndexSeekPoint *point = (const struct IndexSeekPoint *)pos;
+        unsigned char *window = point->window_len ?
+            (unsigned char *)pos + sizeof(*point) : NULL;
+        add_seek_point(layer, point->out_pos, point->in_pos, point->bits, window,
+                       point->window_len);
+        pos += sizeof(*point) + PAD8(point->window_len);
+    }
+
+    struct TarNode *batch[SCAN_BATCH];
+    int batch_size = 0;
+    pos = map + sizeof(struct IndexHeader);
+    for (uint64_t i = 0; i < header->num_entries; i++) {
+        const struct IndexEntry *entry = (const struct IndexEntry *)pos;
+        // Extents are used straight from the (private, writable) mapping
+        // too, moved to this layer's offsets
+        struct Extent *extents = (struct Extent *)(pos + sizeof(*entry));
+        char *path = (char *)(extents + entry->num_extents);
+        char *data = path + PAD8(entry->path_len + entry->link_len);
+        pos += entry_size(entry);
+
+        struct TarNode *node = calloc(1, sizeof(struct TarNode));
+        if (!node) {
+            perror("calloc");
+            exit(1);
+        }
+        node->path = strndup(path, entry->path_len);
+        if (entry->link_len || entry->type == '2') {
+            node->linkname = strndup(path + entry->path_len, entry->link_len);
+        }
+        node->size = entry->size;
+        node->type = entry->type;
+        node->layer = layer - layers;
+        node->data_offset = layer->base + entry->data_offset;
+        node->header_offset = layer->base + entry->header_offset;
+        node->end_offset = layer->base + entry->end_offset;
+        if (entry->num_extents) {
+            for (uint32_t k = 0; layer->base && k < entry->num_extents; k++) {
+                extents[k].data_offset += layer->base;
+            }
+            node->extents = extents;
+            node->num_extents = entry->num_extents;
+        }
+        node->mode = entry->mode;
+        node->uid = entry->uid;
+        node->gid = entry->gid;
+        node->mtime = entry->mtime;
+        node->rdev = entry->rdev;
+        if (entry->inline_len && inline_fits(entry->inline_len)) {
+            node->inline_data = data;
+            count_inline(entry->inline_len);
+        }
+
+        batch[batch_size++] = node;
+        if (batch_size == SCAN_BATCH) {
+            add_batch(batch, batch_size);
+            batch_size = 0;
+        }
+    }
+    add_batch(batch, batch_size);
+    return 0;
+}
+
+// --- Archive Scan ---
+
+// Parse a layer's TAR file and merge it into the memory structure, saving
+// its index on the way. A compressed archive is decoded once here,
+// recording its seek points. Runs in the background while FUSE serves the
+// nodes found so far, which are added in batches under scan_lock.
+void parse_tar_file(struct Layer *layer) {
+    struct Decoder *scan = calloc(1, sizeof(struct Decoder));
+    unsigned char *scratch = malloc(IN_CHUNK);
+    if (!scan || !scratch) {
+        perror("malloc");
+        exit(1);
+    }
+    if (layer->format == FORMAT_GZIP || layer->format == FORMAT_ZSTD) {
+        scan->indexing = 1;
+        if (layer->format == FORMAT_GZIP && !(scan->history = malloc(WINDOW_SIZE))) {
+            perror("malloc");
+            exit(1);
+        }
+        add_seek_point(layer, 0, 0, 0, NULL, 0);
+    }
+
+    int ok = decoder_start(scan, layer, NULL, -1) == 0;
+    if (!ok) fprintf(stderr, "Cannot decode %s\n", layer->name);
+
+    struct IndexWriter index;
+    index_begin(&index, layer);
+
+    unsigned char buffer[BLOCK_SIZE];
+    struct TarNode *batch[SCAN_BATCH];
+    int batch_size = 0;
+
+    // Entries describing the next member, and defaults from global headers.
+    // A member's own entries start at entry_start.
+    struct ExtendedHeader ext, global;
+    uint64_t entry_start = 0;
+    int in_entry = 0;
+    memset(&ext, 0, sizeof(ext));
+    memset(&global, 0, sizeof(global));
+    clear_extended(&ext);
+    clear_extended(&global);
+
+    while (ok) {
+        if (__atomic_load_n(&scan_stop, __ATOMIC_RELAXED)) {
+            ok = 0;
+            break;
+        }
+
+        long read_size = decoder_read(scan, buffer, BLOCK_SIZE);
+        if (read_size < 0) {
+            fprintf(stderr, "%s: corrupt compressed data\n", layer->name);
+            ok = 0;
+        }
+        if (read_size < BLOCK_SIZE) break; // End of file
+        // Check for empty block (end of archive)
+        if (buffer[0] == 0) {
+            // Usually 2 empty blocks mark the end, just stop if name is empty
+            break;
+        }
+        if (!checksum_ok(buffer)) {
+            fprintf(stderr, "%s: bad header checksum at offset %llu\n",
+                    layer->name, (unsigned long long)(scan->out_pos - BLOCK_SIZE));
+            ok = 0;
+            break;
+        }
+
+        int type = buffer[156];
+        uint64_t stored = parse_number(buffer + 124, 12);
+        if (!in_entry) entry_start = scan->out_pos - BLOCK_SIZE;
+
+        // Entries about the next member: read their data and move on
+        if (type == 'L' || type == 'K' || type == 'x' || type == 'g') {
+            in_entry = type != 'g';
+            char *data = read_data(scan, stored, scratch);
+            if (!data) continue;
+            if (type == 'L') replace_string(&ext.path, data);
+            else if (type == 'K') replace_string(&ext.linkpath, data);
+            else {
+                parse_pax(data, stored, type == 'g' ? &global : &ext, type == 'g');
+                free(data);
+            }
+            continue;
+        }
+        // Volume labels and multi-volume continuations are not files
+        if (type == 'V' || type == 'M' || type == 'N') {
+            decoder_skip(scan, (stored + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE,
+                         scratch, IN_CHUNK);
+            clear_extended(&ext);
+            in_entry = 0;
+            continue;
+        }
+
+        struct TarNode *node = (struct TarNode *)malloc(sizeof(struct TarNode));
+        memset(node, 0, sizeof(struct TarNode));
+        node->layer = layer - layers;
+
+        // 1. Path: PAX/GNU long name, or ustar prefix (345) + name (0)
+        node->path = member_path(buffer, &ext);
+        if (!node->path) {
+            perror("malloc");
+            exit(1);
+        }
+        
+        // 2. Mode (100), UID (108), GID (116), Mtime (136), unless a PAX
+        // header overrides them
+        node->mode = parse_number(buffer + 100, 8) & 07777;
+        node->uid = ext.uid >= 0 ? ext.uid :
+                    global.uid >= 0 ? global.uid : parse_number(buffer + 108, 8);
+        node->gid = ext.gid >= 0 ? ext.gid :
+                    global.gid >= 0 ? global.gid : parse_number(buffer + 116, 8);
+        node->mtime = ext.mtime >= 0 ? ext.mtime :
+                      global.mtime >= 0 ? global.mtime : parse_number(buffer + 136, 12);
+
+        // 3. Size of the data in the archive (124, or PAX size)
+        if (ext.size >= 0) stored = ext.size;
+        node->size = stored;
+
+        // 4. Link target (157) of hard and symbolic links
+        if (type == '1' || type == '2') {
+            node->linkname = ext.linkpath ? strdup(ext.linkpath) :
+                                            strndup((char *)(buffer + 157), 100);
+        }
+        // 5. Device numbers (329, 337)
+        if (type == '3' || type == '4') {
+            node->rdev = makedev(parse_number(buffer + 329, 8),
+                                 parse_number(buffer + 337, 8));
+        }
+
+        // 6. Sparse map, in the header (old GNU), PAX records (0.0, 0.1) or
+        // at the start of the data (1.0)
+        uint64_t map_bytes = 0;
+        int sparse = type == 'S' || ext.sparse_major == 1 || ext.num_sparse > 0 ||
+                     ext.sparse_size >= 0;
+        if ((type == 'S' && read_gnu_sparse(scan, buffer, &ext) < 0) ||
+            (type != 'S' && ext.sparse_major == 1 &&
+             read_sparse_map(scan, &ext, &map_bytes) < 0)) {
+            fprintf(stderr, "%s: bad sparse map for %s\n", layer->name, node->path);
+            free(node->path);
+            free(node->linkname);
+            free(node);
+            ok = 0;
+            break;
+        }
+
+        // Calculate Data Offset (in the uncompressed stream)
+        node->data_offset = layer->base + scan->out_pos;
+
+        if (sparse) {
+            // Regions are stored back to back; a map claiming more data
+            // than the member holds is cut short
+            uint64_t pos = node->data_offset, end = node->data_offset +
+                (stored > map_bytes ? stored - map_bytes : 0);
+            int n = 0;
+            while (n < ext.num_sparse && pos + ext.sparse[n].length <= end) {
+                ext.sparse[n].data_offset = pos;
+                pos += ext.sparse[n++].length;
+            }
+            node->size = ext.sparse_size >= 0 ? (uint64_t)ext.sparse_size :
+                         n > 0 ? ext.sparse[n - 1].offset + ext.sparse[n - 1].length : 0;
+            if (n == 0) {
+                // All hole, an empty region at the end keeps it sparse
+                free(ext.sparse);
+                ext.sparse = calloc(1, sizeof(struct Extent));
+                if (!ext.sparse) {
+                    perror("calloc");
+                    exit(1);
+                }
+                ext.sparse[0].offset = node->size;
+                ext.sparse[0].data_offset = node->data_offset;
+                n = 1;
+            }
+            node->extents = ext.sparse;
+            node->num_extents = n;
+            ext.sparse = NULL;
+        }
+
+        // Normalize path: strip "./" and "/" prefixes, and the trailing
+        // slash of directories (which old tars mark only by it)
+        int is_dir_name = trim_slash(node->path);
+        if (type == '1') trim_slash(node->linkname);
+
+        switch (type) {
+        case '1': case '2': case '3': case '4': case '5': case '6':
+            node->type = type;
+            break;
+        case 'D':   // GNU dump directory, has a listing as data
+            node->type = '5';
+            break;
+        default:    // '0', '\0', '7' (contiguous), 'S' and unknown types
+            node->type = is_dir_name ? '5' : '0';
+            break;
+        }
+
+        // Keep the data of small files while the scan passes over it
+        uint64_t data_bytes = (stored + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+        if (data_bytes > map_bytes) data_bytes -= map_bytes;
+        else data_bytes = 0;
+        if (node->type == '0' && !node->extents && inline_fits(stored)) {
+            char *data = inline_alloc(stored);
+            long n = data ? decoder_read(scan, (unsigned char *)data, stored) : 0;
+            if (n == (long)stored) {
+                node->inline_data = data;
+                count_inline(stored);
+            }
+            if (n > 0) data_bytes -= n;
+        }
+
+        // Skip data blocks
+        decoder_skip(scan, data_bytes, scratch, IN_CHUNK);
+        clear_extended(&ext);
+        node->header_offset = layer->base + entry_start;
+        node->end_offset = layer->base + scan->out_pos;
+        in_entry = 0;
+
+        if (node->path[0] == '\0') {
+            free(node->path);
+            free(node->linkname);
+            free(node->extents);
+            free(node);
+            continue;
+        }
+
+        index_add(&index, layer, node);
+        batch[batch_size++] = node;
+        if (batch_size == SCAN_BATCH) {
+            add_batch(batch, batch_size);
+            batch_size = 0;
+        }
+    }
+    add_batch(batch, batch_size);
+    clear_extended(&ext);
+    clear_extended(&global);
+
+    decoder_end(scan);
+    free(scratch);
+    index_finish(&index, layer, ok);
+}
+
+// Merge the layers from scan_from down, from their index or by scanning
+// them (the index of scan_from did not load already)
+void scan_layers() {
+    for (int i = scan_from; i >= 0; i--) {
+        if (__atomic_load_n(&scan_stop, __ATOMIC_RELAXED)) break;
+
+        struct Layer *layer = &layers[i];
+        if (i == scan_from || load_index(layer) < 0) {
+            if (layer->format == FORMAT_XZ && layer->num_seek_points == 0 &&
+                read_xz_index(layer) < 0) {
+                fprintf(stderr, "Cannot read the xz index of %s\n", layer->name);
+                continue;
+            }
+            parse_tar_file(layer);
+        }
+        // Only its own hard links could still name what it had hidden
+        clear_paths(&shadowed);
+    }
+    clear_paths(&whiteouts);
+
+    // Lookups still waiting now know their path does not exist
+    pthread_mutex_lock(&scan_lock);
+    __atomic_store_n(&scan_complete, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&scan_progress);
+    pthread_mutex_unlock(&scan_lock);
+}
+
+void *scan_main(void *arg) {
+    (void) arg;
+    scan_layers();
+    return NULL;
+}
+
+// Find a node by path. Call with the tree locked (see lock_tree); while
+// the scan runs, a path it has not reached yet is waited for.
+struct TarNode *get_node(const char *path) {
+    // FUSE paths start with '/', TAR paths usually don't.
+    // We skip the leading '/' from FUSE path.
+    const char *target = path;
+    if (path[0] == '/') target++; // Skip '/'
+
+    // Root "/" maps to the root node (getattr still handles it separately)
+    struct TarNode *node = lookup_node(target, strlen(target));
+    while (!node && !__atomic_load_n(&scan_complete, __ATOMIC_ACQUIRE)) {
+        pthread_cond_wait(&scan_progress, &scan_lock);
+        node = lookup_node(target, strlen(target));
+    }
+    return node;
+}
+
+// --- Writable Overlay ---
+
+// With -o upper=DIR the mount is writable, copy-on-write like overlayfs.
+// Whatever is created or changed lives in DIR, members of the archive are
+// copied up there before they are changed, and removing one leaves a
+// whiteout file ".wh.<name>" in its directory. A directory holding
+// ".wh..wh..opq" hides the archive's contents of the same directory (it
+// replaced one that was removed). These are the AUFS/OCI layer whiteouts.
+// DIR must not be changed behind the mount's back.
+#define COPYUP_PREFIX ".wh..copyup."   // Copy-ups in progress, hidden as whiteouts
+#define COPY_CHUNK (1 << 20)
+
+int upper_fd = -1;
+// Serializes changes to the upper directory: copy-ups, whiteouts, renames
+pthread_mutex_t overlay_lock = PTHREAD_MUTEX_INITIALIZER;
+
+long read_node(struct TarNode *node, char *buffer, size_t size, off_t offset);
+
+// FUSE path as a path relative to upper_fd
+const char *upper_path(const char *path) {
+    while (*path == '/') path++;
+    return *path ? path : ".";
+}
+
+// rel/name, or name in the root
+char *child_path(const char *rel, const char *name) {
+    char *out = malloc(strlen(rel) + strlen(name) + 2);
+    if (!out) return NULL;
+    if (strcmp(rel, ".") == 0) strcpy(out, name);
+    else sprintf(out, "%s/%s", rel, name);
+    return out;
+}
+
+// Whether rel exists in the upper directory; its type in *mode
+int upper_exists(const char *rel, mode_t *mode) {
+    struct stat st;
+    if (fstatat(upper_fd, rel, &st, AT_SYMLINK_NOFOLLOW) < 0) return 0;
+    if (mode) *mode = st.st_mode;
+    return 1;
+}
+
+int is_opaque(const char *rel) {
+    char *marker = child_path(rel, OPAQUE_MARKER);
+    int opaque = marker && upper_exists(marker, NULL);
+    free(marker);
+    return opaque;
+}
+
+// Whether the archive's member at rel is hidden: by a whiteout of it or of
+// a directory above it, or because something above it in the upper
+// directory is opaque or not a directory
+int is_hidden(const char *rel) {
+    size_t len = strlen(rel);
+    if (strcmp(rel, ".") == 0) return 0;
+
+    for (size_t end = 1; end <= len; end++) {
+        if (end < len && rel[end] != '/') continue;
+
+        // rel[0..end) is rel or a directory above it
+        char *path = prefixed_path(rel, end, WHITEOUT_PREFIX);
+        int hidden = path && upper_exists(path, NULL);
+        free(path);
+        if (hidden) return 1;
+        if (end == len) break;
+
+        // Nothing below a directory that is not in the upper directory
+        // can be hidden
+        mode_t mode;
+        path = strndup(rel, end);
+        int exists = path && upper_exists(path, &mode);
+        hidden = exists && (!S_ISDIR(mode) || is_opaque(path));
+        free(path);
+        if (!exists) return 0;
+        if (hidden) return 1;
+    }
+    return 0;
+}
+
+// The archive's member at path if the overlay does not hide it. As for
+// get_node, call with the tree locked.
+struct TarNode *visible_node(const char *path) {
+    if (strcmp(path, ".") == 0) return &root;  // As given by upper_path
+
+    struct TarNode *node = get_node(path);
+    if (node && node != &root && upper_fd >= 0 && is_hidden(upper_path(path))) {
+        return NULL;
+    }
+    return node;
+}
+
+int write_all(int fd, const char *buffer, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buffer, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -errno;
+        }
+        buffer += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Copy the archive's member at rel into the upper directory, after the
+// directories above it; its data only if with_data (not when it is about
+// to be truncated). Called with overlay_lock held. Returns 0 or a negative
+// errno.
+int copy_up(const char *rel, int with_data) {
+    if (upper_exists(rel, NULL)) return 0;
+
+    const char *slash = strrchr(rel, '/');
+    if (slash) {
+        char *parent = strndup(rel, slash - rel);
+        int res = parent ? copy_up(parent, 1) : -ENOMEM;
+        free(parent);
+        if (res < 0) return res;
+    }
+
+    int locked = lock_tree();
+    struct TarNode *node = visible_node(rel);
+    struct TarNode copy;
+    if (node) {
+        copy = *node;
+        copy.linkname = node->linkname ? strdup(node->linkname) : NULL;
+    }
+    unlock_tree(locked);
+    if (!node) return -ENOENT;
+
+    // Built under a name readdir skips, then renamed into place
+    char *tmp = prefixed_path(rel, strlen(rel), COPYUP_PREFIX);
+    if (!tmp) {
+        free(copy.linkname);
+        return -ENOMEM;
+    }
+    int res = 0;
+    if (copy.type == '5') {
+        if (mkdirat(upper_fd, tmp, copy.mode | 0700) < 0) res = -errno;
+    } else if (copy.type == '2') {
+        if (symlinkat(copy.linkname, upper_fd, tmp) < 0) res = -errno;
+    } else if (copy.type == '3' || copy.type == '4' || copy.type == '6') {
+        mode_t kind = copy.type == '3' ? S_IFCHR : copy.type == '4' ? S_IFBLK : S_IFIFO;
+        if (mknodat(upper_fd, tmp, kind | copy.mode, copy.rdev) < 0) res = -errno;
+    } else {
+        int fd = openat(upper_fd, tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        char *buffer = with_data ? malloc(COPY_CHUNK) : NULL;
+        if (fd < 0) res = -errno;
+        else if (with_data && !buffer) res = -ENOMEM;
+        for (uint64_t off = 0; res == 0 && with_data && off < copy.size; ) {
+            long n = read_node(node, buffer, COPY_CHUNK, off);
+            if (n <= 0) {
+                res = n < 0 ? n : -EIO;
+                break;
+            }
+            res = write_all(fd, buffer, n);
+            off += n;
+        }
+        free(buffer);
+        if (fd >= 0 && close(fd) < 0 && res == 0) res = -errno;
+    }
+
+    if (res == 0) {
+        // Keep the member's ownership (only root may give files away, they
+        // stay ours otherwise), mode and time
+        struct timespec times[2] = { { copy.mtime, 0 }, { copy.mtime, 0 } };
+        (void) fchownat(upper_fd, tmp, copy.uid, copy.gid, AT_SYMLINK_NOFOLLOW);
+        if (copy.type != '2') fchmodat(upper_fd, tmp, copy.mode, 0);
+        utimensat(upper_fd, tmp, times, AT_SYMLINK_NOFOLLOW);
+        if (renameat(upper_fd, tmp, upper_fd, rel) < 0) res = -errno;
+    }
+    if (res < 0) unlinkat(upper_fd, tmp, copy.type == '5' ? AT_REMOVEDIR : 0);
+    free(tmp);
+    free(copy.linkname);
+    return res;
+}
+
+// Make room for a new entry at rel: copy up the directories above it and
+// remove a whiteout left there. Returns 1 if there was one, 0 if not, or a
+// negative errno. Called with overlay_lock held.
+int prepare_create(const char *rel) {
+    const char *slash = strrchr(rel, '/');
+    if (slash) {
+        char *parent = strndup(rel, slash - rel);
+        int res = parent ? copy_up(parent, 1) : -ENOMEM;
+        free(parent);
+        if (res < 0) return res;
+    }
+
+    char *whiteout = prefixed_path(rel, strlen(rel), WHITEOUT_PREFIX);
+    if (!whiteout) return -ENOMEM;
+    int res = unlinkat(upper_fd, whiteout, 0) == 0 ? 1 :
+              errno == ENOENT ? 0 : -errno;
+    free(whiteout);
+    return res;
+}
+
+// Hide the archive's member at rel. Called with overlay_lock held.
+int add_whiteout(const char *rel) {
+    int res = prepare_create(rel);
+    if (res < 0) return res;
+
+    char *whiteout = prefixed_path(rel, strlen(rel), WHITEOUT_PREFIX);
+    if (!whiteout) return -ENOMEM;
+    int fd = openat(upper_fd, whiteout, O_WRONLY | O_CREAT, 0644);
+    free(whiteout);
+    if (fd < 0) return -errno;
+    close(fd);
+    return 0;
+}
+
+int make_opaque(const char *rel) {
+    char *marker = child_path(rel, OPAQUE_MARKER);
+    if (!marker) return -ENOMEM;
+    int fd = openat(upper_fd, marker, O_WRONLY | O_CREAT, 0644);
+    free(marker);
+    if (fd < 0) return -errno;
+    close(fd);
+    return 0;
+}
+
+// Remove the whiteouts inside an upper directory that is about to be
+// removed or replaced
+void clear_whiteouts(const char *rel) {
+    int fd = openat(upper_fd, rel, O_RDONLY | O_DIRECTORY);
+    DIR *dir = fd >= 0 ? fdopendir(fd) : NULL;
+    if (!dir) {
+        if (fd >= 0) close(fd);
+        return;
+    }
+    struct dirent *e;
+    while ((e = readdir(dir))) {
+        if (strncmp(e->d_name, WHITEOUT_PREFIX, strlen(WHITEOUT_PREFIX)) == 0) {
+            unlinkat(dirfd(dir), e->d_name, 0);
+        }
+    }
+    closedir(dir);
+}
+
+struct NameSet {
+    char **names;
+    int count;
+    int max;
+};
+
+void add_name(struct NameSet *set, const char *name) {
+    if (set->count == set->max) {
+        set->max = set->max ? set->max * 2 : 16;
+        set->names = realloc(set->names, set->max * sizeof(char *));
+        if (!set->names) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    set->names[set->count++] = strdup(name);
+}
+
+int compare_names(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+int has_name(struct NameSet *set, const char *name) {
+    return set->count &&
+           bsearch(&name, set->names, set->count, sizeof(char *), compare_names);
+}
+
+void free_names(struct NameSet *set) {
+    for (int i = 0; i < set->count; i++) free(set->names[i]);
+    free(set->names);
+    memset(set, 0, sizeof(*set));
+}
+
+// Call fn (if any) for every name visible in directory rel: the archive's
+// members in archive order, then those only in the upper directory.
+// Waits for the scan like readdir. Returns the number of names.
+int list_merged(const char *rel, void (*fn)(void *ctx, const char *name),
+                void *ctx) {
+    struct NameSet upper = {0}, hidden = {0};
+    int opaque = 0;
+
+    int fd = upper_fd >= 0 ? openat(upper_fd, rel, O_RDONLY | O_DIRECTORY) : -1;
+    DIR *dir = fd >= 0 ? fdopendir(fd) : NULL;
+    if (dir) {
+        struct dirent *e;
+        while ((e = readdir(dir))) {
+            const char *name = e->d_name;
+            if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+            if (strcmp(name, OPAQUE_MARKER) == 0) opaque = 1;
+            else if (strncmp(name, WHITEOUT_PREFIX, strlen(WHITEOUT_PREFIX)) == 0) {
+                add_name(&hidden, name + strlen(WHITEOUT_PREFIX));
+            } else {
+                add_name(&upper, name);
+            }
         }
-        current->next = node;
+        closedir(dir);
+    } else if (fd >= 0) {
+        close(fd);
+    }
+    if (upper.count) qsort(upper.names, upper.count, sizeof(char *), compare_names);
+    if (hidden.count) {
+        qsort(hidden.names, hidden.count, sizeof(char *), compare_names);
     }
-}
 
-// Remove trailing slash from path (for directory normalization)
-void trim_slash(char *path) {
-    int len = strlen(path);
-    if (len > 0 && path[len - 1] == '/') {
-        path[len - 1] = '\0';
+    int locked = lock_tree();
+    while (!__atomic_load_n(&scan_complete, __ATOMIC_ACQUIRE)) {
+        pthread_cond_wait(&scan_progress, &scan_lock);
+    }
+    struct TarNode *node = opaque ? NULL : visible_node(rel);
+    unlock_tree(locked);
+
+    int count = 0;
+    for (int i = 0; node && node->type == '5' && i < node->num_children; i++) {
+        const char *name = node->children[i]->name;
+        if (has_name(&upper, name) || has_name(&hidden, name)) continue;
+        if (fn) fn(ctx, name);
+        count++;
+    }
+    for (int i = 0; i < upper.count; i++) {
+        if (fn) fn(ctx, upper.names[i]);
+        count++;
     }
+    free_names(&upper);
+    free_names(&hidden);
+    return count;
 }
 
-// Parse the TAR file and build the memory structure
-void parse_tar_file() {
-    FILE *fp = fopen(TAR_FILE, "rb");
-    if (!fp) {
-        perror("Cannot open test.tar");
+// Writing the mounted tree as a new tar (-o commit). Members the overlay
+// did not touch are copied as they are stored in the archive, headers and
+// all, decompressed but not re-encoded; the rest get new ustar headers,
+// with a PAX header for what does not fit.
+
+// Append the PAX record "<length> key=value\n" to pax
+void add_pax_record(char **pax, size_t *pax_len, const char *key,
+                    const char *value) {
+    size_t body = strlen(key) + strlen(value) + 3; // ' ', '=' and '\n'
+    size_t len = body + 1;
+    for (;;) {
+        char digits[24];
+        size_t total = body + snprintf(digits, sizeof(digits), "%zu", len);
+        if (total == len) break;
+        len = total;
+    }
+
+    *pax = realloc(*pax, *pax_len + len + 1);
+    if (!*pax) {
+        perror("realloc");
         exit(1);
     }
+    sprintf(*pax + *pax_len, "%zu %s=%s\n", len, key, value);
+    *pax_len += len;
+}
 
-    unsigned char buffer[BLOCK_SIZE];
-    long current_offset = 0;
+// Fill a ustar header; values that do not fit its octal fields go to pax
+// (are left out without it)
+void fill_header(unsigned char *header, const char *name, const char *linkname,
+                 const struct stat *st, int type, char **pax, size_t *pax_len) {
+    char value[32];
+    memset(header, 0, BLOCK_SIZE);
 
-    while (1) {
-        size_t read_size = fread(buffer, 1, BLOCK_SIZE, fp);
-        if (read_size < BLOCK_SIZE) break; // End of file
+    if (strlen(name) > 100) add_pax_record(pax, pax_len, "path", name);
+    strncpy((char *)header, name, 100);
+    if (linkname) {
+        if (strlen(linkname) > 100) add_pax_record(pax, pax_len, "linkpath", linkname);
+        strncpy((char *)header + 157, linkname, 100);
+    }
 
-        // Check for empty block (end of archive)
-        if (buffer[0] == 0) {
-            // Usually 2 empty blocks mark the end, just stop if name is empty
-            break;
+    uint64_t size = type == '0' ? (uint64_t)st->st_size : 0;
+    struct { int offset, len; uint64_t value; const char *key; } fields[] = {
+        { 100, 8, st->st_mode & 07777, NULL },
+        { 108, 8, st->st_uid, "uid" },
+        { 116, 8, st->st_gid, "gid" },
+        { 124, 12, size, "size" },
+        { 136, 12, st->st_mtime > 0 ? (uint64_t)st->st_mtime : 0, "mtime" },
+    };
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+        uint64_t max = ((uint64_t)1 << (3 * (fields[i].len - 1))) - 1;
+        if (fields[i].value > max) {
+            snprintf(value, sizeof(value), "%llu", (unsigned long long)fields[i].value);
+            if (pax) add_pax_record(pax, pax_len, fields[i].key, value);
+            fields[i].value = 0;
         }
+        snprintf((char *)header + fields[i].offset, fields[i].len, "%0*llo",
+                 fields[i].len - 1, (unsigned long long)fields[i].value);
+    }
 
-        struct TarNode *node = (struct TarNode *)malloc(sizeof(struct TarNode));
-        memset(node, 0, sizeof(struct TarNode));
-
-        // 1. Parse Name (Offset 0, 100 bytes)
-        // Note: Real TAR might use prefix (345), but for this assignment name is usually enough
-        strncpy(node->path, (char *)buffer, 100);
-        
-        // 2. Parse Mode (Offset 100, 8 bytes)
-        node->mode = octal_to_int((char *)(buffer + 100));
+    header[156] = type;
+    memcpy(header + 257, "ustar", 6);
+    memcpy(header + 263, "00", 2);
+    if (type == '3' || type == '4') {
+        snprintf((char *)header + 329, 8, "%07o", major(st->st_rdev) & 07777777);
+        snprintf((char *)header + 337, 8, "%07o", minor(st->st_rdev) & 07777777);
+    }
+}
 
-        // 3. Parse UID (Offset 108, 8 bytes)
-        node->uid = octal_to_int((char *)(buffer + 108));
+void set_checksum(unsigned char *header) {
+    unsigned sum = 0;
+    memset(header + 148, ' ', 8);
+    for (int i = 0; i < BLOCK_SIZE; i++) sum += header[i];
+    snprintf((char *)header + 148, 8, "%06o", sum);
+    header[155] = ' ';
+}
 
-        // 4. Parse GID (Offset 116, 8 bytes)
-        node->gid = octal_to_int((char *)(buffer + 116));
+// Write data padded to whole blocks
+int write_padded(FILE *out, const void *data, size_t len) {
+    static const char zeros[BLOCK_SIZE];
+    size_t pad = (BLOCK_SIZE - len % BLOCK_SIZE) % BLOCK_SIZE;
+    return fwrite(data, 1, len, out) == len &&
+           fwrite(zeros, 1, pad, out) == pad ? 0 : -1;
+}
 
-        // 5. Parse Size (Offset 124, 12 bytes)
-        node->size = octal_to_int((char *)(buffer + 124));
+// Write the headers of one member, a PAX header first if needed
+int write_header(FILE *out, const char *name, const char *linkname,
+                 const struct stat *st, int type) {
+    unsigned char header[BLOCK_SIZE];
+    char *pax = NULL;
+    size_t pax_len = 0;
+    fill_header(header, name, linkname, st, type, &pax, &pax_len);
+    set_checksum(header);
 
-        // 6. Parse Mtime (Offset 136, 12 bytes)
-        node->mtime = octal_to_int((char *)(buffer + 136));
+    int res = 0;
+    if (pax) {
+        unsigned char pax_header[BLOCK_SIZE];
+        struct stat pax_st;
+        memset(&pax_st, 0, sizeof(pax_st));
+        pax_st.st_mode = 0644;
+        pax_st.st_size = pax_len;
+        pax_st.st_mtime = st->st_mtime;
+        fill_header(pax_header, "././@PaxHeader", NULL, &pax_st, '0', NULL, NULL);
+        pax_header[156] = 'x';
+        set_checksum(pax_header);
+        res = write_padded(out, pax_header, BLOCK_SIZE) < 0 ||
+              write_padded(out, pax, pax_len) < 0 ? -1 : 0;
+        free(pax);
+    }
+    if (res == 0) res = write_padded(out, header, BLOCK_SIZE);
+    return res;
+}
 
-        // 7. Parse Typeflag (Offset 156, 1 byte)
-        node->type = buffer[156];
+void collect_name(void *ctx, const char *name) {
+    add_name(ctx, name);
+}
 
-        // 8. Parse Linkname (Offset 157, 100 bytes) - for symlinks
-        if (node->type == '2') {
-            strncpy(node->linkname, (char *)(buffer + 157), 100);
-        }
+int commit_path(FILE *out, const char *rel, char *buffer);
 
-        // Calculate Data Offset
-        current_offset += BLOCK_SIZE; // Skip header
-        node->data_offset = current_offset;
+int commit_dir(FILE *out, const char *rel, char *buffer) {
+    struct NameSet names = {0};
+    list_merged(rel, collect_name, &names);
 
-        // Skip data blocks
-        int data_blocks = (node->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-        fseek(fp, data_blocks * BLOCK_SIZE, SEEK_CUR);
-        current_offset += data_blocks * BLOCK_SIZE;
+    int res = 0;
+    for (int i = 0; res == 0 && i < names.count; i++) {
+        char *path = child_path(rel, names.names[i]);
+        res = path ? commit_path(out, path, buffer) : -1;
+        free(path);
+    }
+    free_names(&names);
+    return res;
+}
 
-        // Normalize path: remove trailing slash for directories
-        trim_slash(node->path);
+// Write the member at rel (and what is below it) from wherever it is
+int commit_path(FILE *out, const char *rel, char *buffer) {
+    struct stat st;
+    char *dir_name = malloc(strlen(rel) + 2);
+    if (!dir_name) return -1;
+    sprintf(dir_name, "%s/", rel);
+    int res = 0;
 
-        node->next = NULL;
-        add_node(node);
+    if (upper_fd >= 0 && fstatat(upper_fd, rel, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+        if (S_ISDIR(st.st_mode)) {
+            res = write_header(out, dir_name, NULL, &st, '5');
+            if (res == 0) res = commit_dir(out, rel, buffer);
+        } else if (S_ISLNK(st.st_mode)) {
+            ssize_t n = readlinkat(upper_fd, rel, buffer, COPY_CHUNK - 1);
+            if (n >= 0) {
+                buffer[n] = '\0';
+                res = write_header(out, rel, buffer, &st, '2');
+            }
+        } else if (S_ISREG(st.st_mode)) {
+            int fd = openat(upper_fd, rel, O_RDONLY);
+            res = fd < 0 ? -1 : write_header(out, rel, NULL, &st, '0');
+            off_t done = 0;
+            while (res == 0 && done < st.st_size) {
+                ssize_t n = pread(fd, buffer, COPY_CHUNK, done);
+                if (n <= 0) {
+                    res = -1;
+                    break;
+                }
+                if (n > st.st_size - done) n = st.st_size - done;
+                res = fwrite(buffer, 1, n, out) == (size_t)n ? 0 : -1;
+                done += n;
+            }
+            if (res == 0 && st.st_size % BLOCK_SIZE) {
+                static const char zeros[BLOCK_SIZE];
+                size_t pad = BLOCK_SIZE - st.st_size % BLOCK_SIZE;
+                res = fwrite(zeros, 1, pad, out) == pad ? 0 : -1;
+            }
+            if (fd >= 0) close(fd);
+        } else if (S_ISCHR(st.st_mode) || S_ISBLK(st.st_mode) || S_ISFIFO(st.st_mode)) {
+            res = write_header(out, rel, NULL, &st,
+                               S_ISCHR(st.st_mode) ? '3' : S_ISBLK(st.st_mode) ? '4' : '6');
+        }
+        free(dir_name);
+        return res;
     }
 
-    fclose(fp);
+    // From the archive; the scan is complete by now
+    struct TarNode *node = visible_node(rel);
+    if (!node) {
+        free(dir_name);
+        return 0;
+    }
+    if (node->end_offset > node->header_offset) {
+        for (uint64_t pos = node->header_offset; res == 0 && pos < node->end_offset; ) {
+            size_t want = node->end_offset - pos < COPY_CHUNK ?
+                          node->end_offset - pos : COPY_CHUNK;
+            long n = archive_pread(buffer, want, pos);
+            res = n == (long)want && fwrite(buffer, 1, n, out) == (size_t)n ? 0 : -1;
+            pos += want;
+        }
+    } else {
+        // Implicit directories and hard links have no copy of their own
+        memset(&st, 0, sizeof(st));
+        st.st_mode = node->mode;
+        st.st_uid = node->uid;
+        st.st_gid = node->gid;
+        st.st_mtime = node->mtime;
+        st.st_size = node->size;
+        if (node->type == '5') {
+            res = write_header(out, dir_name, NULL, &st, '5');
+        } else {
+            res = write_header(out, rel, NULL, &st, '0');
+            for (uint64_t off = 0; res == 0 && off < node->size; ) {
+                long n = read_node(node, buffer, COPY_CHUNK, off);
+                res = n > 0 && fwrite(buffer, 1, n, out) == (size_t)n ? 0 : -1;
+                off += n;
+            }
+            if (res == 0 && node->size % BLOCK_SIZE) {
+                static const char zeros[BLOCK_SIZE];
+                size_t pad = BLOCK_SIZE - node->size % BLOCK_SIZE;
+                res = fwrite(zeros, 1, pad, out) == pad ? 0 : -1;
+            }
+        }
+    }
+    if (res == 0 && node->type == '5') res = commit_dir(out, rel, buffer);
+    free(dir_name);
+    return res;
 }
 
-// Find a node by path
-struct TarNode *get_node(const char *path) {
-    // FUSE paths start with '/', TAR paths usually don't.
-    // We skip the leading '/' from FUSE path.
-    const char *target = path;
-    if (path[0] == '/') target++; // Skip '/'
-    
-    // If path is root "/", return NULL (handled separately in getattr)
-    if (strlen(target) == 0) return NULL;
+// Write the whole tree to the -o commit file, through a temporary file
+void commit_tree() {
+    char *tmp_path = malloc(strlen(options.commit) + 5);
+    char *buffer = malloc(COPY_CHUNK);
+    FILE *out = NULL;
+    if (tmp_path && buffer) {
+        sprintf(tmp_path, "%s.tmp", options.commit);
+        out = fopen(tmp_path, "wb");
+    }
+    if (!out) {
+        fprintf(stderr, "Cannot write %s: %s\n", options.commit, strerror(errno));
+        free(tmp_path);
+        free(buffer);
+        return;
+    }
 
-    struct TarNode *curr = head;
-    while (curr) {
-        if (strcmp(curr->path, target) == 0) {
-            return curr;
-        }
-        curr = curr->next;
+    static const char end[2 * BLOCK_SIZE];
+    int ok = commit_dir(out, ".", buffer) == 0 &&
+             fwrite(end, 1, sizeof(end), out) == sizeof(end);
+    if (fclose(out) != 0) ok = 0;
+    if (!ok || rename(tmp_path, options.commit) < 0) {
+        fprintf(stderr, "Cannot write %s: %s\n", options.commit, strerror(errno));
+        unlink(tmp_path);
     }
-    return NULL;
+    free(tmp_path);
+    free(buffer);
 }
 
 // --- FUSE Operations ---
 
+// open/opendir resolve the path once and keep the node in the file handle,
+// so read and readdir skip both our lookup and FUSE's path building. Files
+// open in the upper directory keep their fd there instead, tagged in the
+// low bit (nodes are aligned).
+#define FI_NODE(fi) ((struct TarNode *)(uintptr_t)(fi)->fh)
+#define FI_IS_FD(fi) ((fi)->fh & 1)
+#define FI_FD(fi) ((int)((fi)->fh >> 1))
+#define FD_FH(fd) (((uint64_t)(fd) << 1) | 1)
+
+// Block cache statistics can be read from this file. It is not listed in
+// the root directory and hides a member of the same name.
+#define STATS_PATH "/.tarfs-stats"
+struct TarNode stats_node = { .path = ".tarfs-stats", .type = '0',
+                              .name = ".tarfs-stats" };
+
 static struct fuse_operations op;
 
+// Type of the archive's member at rel, 0 if there is none or it is hidden
+int archive_type(const char *rel) {
+    int locked = lock_tree();
+    struct TarNode *node = visible_node(rel);
+    int type = node ? node->type : 0;
+    unlock_tree(locked);
+    return type;
+}
+
+// Names starting with the whiteout prefix belong to the overlay
+int reserved_name(const char *path) {
+    const char *name = strrchr(path, '/');
+    name = name ? name + 1 : path;
+    return strncmp(name, WHITEOUT_PREFIX, strlen(WHITEOUT_PREFIX)) == 0;
+}
+
+// Open path in the upper directory if it is there, copying it up first
+// when it is opened for writing. Returns 1 if it is left to the archive.
+int open_upper(const char *path, struct fuse_file_info *fi) {
+    const char *rel = upper_path(path);
+    int writing = (fi->flags & O_ACCMODE) != O_RDONLY || (fi->flags & O_TRUNC);
+
+    pthread_mutex_lock(&overlay_lock);
+    int res = writing ? copy_up(rel, !(fi->flags & O_TRUNC)) :
+              upper_exists(rel, NULL) ? 0 : 1;
+    if (res == 0) {
+        int fd = openat(upper_fd, rel, fi->flags & ~(O_CREAT | O_EXCL));
+        if (fd < 0) res = -errno;
+        else fi->fh = FD_FH(fd);
+    }
+    pthread_mutex_unlock(&overlay_lock);
+    return res;
+}
+
+int my_open(const char *path, struct fuse_file_info *fi) {
+    if (strcmp(path, STATS_PATH) == 0) {
+        if ((fi->flags & O_ACCMODE) != O_RDONLY) return -EROFS;
+        fi->fh = (uintptr_t)&stats_node;
+        fi->direct_io = 1;  // Changes all the time, size is not known
+        return 0;
+    }
+    if (upper_fd >= 0) {
+        int res = open_upper(path, fi);
+        if (res <= 0) return res;
+    }
+
+    int locked = lock_tree();
+    struct TarNode *node = visible_node(path);
+    int type = node ? node->type : 0;
+    unlock_tree(locked);
+
+    if (!node) return -ENOENT;
+    if (type == '5') return -EISDIR;
+    if ((fi->flags & O_ACCMODE) != O_RDONLY) return -EROFS;
+
+    fi->fh = (uintptr_t)node;
+    fi->keep_cache = 1;
+    return 0;
+}
+
+int my_opendir(const char *path, struct fuse_file_info *fi) {
+    // Listed by path (see my_readdir)
+    struct stat st;
+    if (upper_fd >= 0 && fstatat(upper_fd, upper_path(path), &st, AT_SYMLINK_NOFOLLOW) == 0) {
+        if (!S_ISDIR(st.st_mode)) return -ENOTDIR;
+        fi->fh = 0;
+        return 0;
+    }
+
+    int locked = lock_tree();
+    struct TarNode *node = visible_node(path);
+    int type = node ? node->type : 0;
+    unlock_tree(locked);
+
+    if (!node) return -ENOENT;
+    if (type != '5') return -ENOTDIR;
+
+    fi->fh = (uintptr_t)node;
+    return 0;
+}
+
 int my_getattr(const char *path, struct stat *st) {
     memset(st, 0, sizeof(struct stat));
 
+    // Case 0: Created or changed through the overlay
+    if (upper_fd >= 0 && strcmp(path, STATS_PATH) != 0) {
+        if (reserved_name(path)) return -ENOENT;
+        if (fstatat(upper_fd, upper_path(path), st, AT_SYMLINK_NOFOLLOW) == 0) return 0;
+    }
+
     // Case 1: Root Directory
     if (strcmp(path, "/") == 0) {
         st->st_mode = S_IFDIR | 0444; // Read-only directory
@@ -176,10 +3031,20 @@ int my_getattr(const char *path, struct stat *st) {
         st->st_gid = getgid();
         return 0;
     }
+    if (strcmp(path, STATS_PATH) == 0) {
+        st->st_mode = S_IFREG | 0444;
+        st->st_size = format_stats(NULL, 0);
+        st->st_uid = getuid();
+        st->st_gid = getgid();
+        st->st_mtime = time(NULL);
+        return 0;
+    }
 
     // Case 2: Files inside tar
-    struct TarNode *node = get_node(path);
+    int locked = lock_tree();
+    struct TarNode *node = visible_node(path);
     if (!node) {
+        unlock_tree(locked);
         return -ENOENT;
     }
 
@@ -189,6 +3054,14 @@ int my_getattr(const char *path, struct stat *st) {
     } else if (node->type == '2') { // symlink
         st->st_mode = S_IFLNK | node->mode;
         // st->st_nlink = 1;
+    } else if (node->type == '3') { // character device
+        st->st_mode = S_IFCHR | node->mode;
+        st->st_rdev = node->rdev;
+    } else if (node->type == '4') { // block device
+        st->st_mode = S_IFBLK | node->mode;
+        st->st_rdev = node->rdev;
+    } else if (node->type == '6') { // FIFO
+        st->st_mode = S_IFIFO | node->mode;
     } else { // regular file
         st->st_mode = S_IFREG | node->mode;
         // st->st_nlink = 1;
@@ -198,122 +3071,575 @@ int my_getattr(const char *path, struct stat *st) {
     st->st_uid = node->uid;
     st->st_gid = node->gid;
     st->st_mtime = node->mtime;
+    unlock_tree(locked);
 
     return 0;
 }
 
+struct FillContext {
+    void *buffer;
+    fuse_fill_dir_t filler;
+};
+
+void fill_name(void *ctx, const char *name) {
+    struct FillContext *fill = ctx;
+    fill->filler(fill->buffer, name, NULL, 0);
+}
+
 int my_readdir(const char *path, void *buffer, fuse_fill_dir_t filler,
                        off_t offset, struct fuse_file_info *fi) {
     (void) offset;
-    (void) fi;
 
-    // FUSE paths start with /
-    const char *target_dir = path;
-    if (path[0] == '/') target_dir++; // Skip leading slash for comparison
-    
-    // If we are at root, target_dir is empty string ""
+    struct TarNode *dir = FI_NODE(fi);
 
     filler(buffer, ".", NULL, 0);
     filler(buffer, "..", NULL, 0);
 
-    struct TarNode *curr = head;
-    while (curr) {
-        // Check if file is inside the target_dir
-        
-        // Logic:
-        // If target_dir is "", we look for files with NO slashes (e.g., "file1.txt", "dir1")
-        // If target_dir is "dir1", we look for "dir1/file2.txt"
-        
-        int target_len = strlen(target_dir);
-        int is_child = 0;
-
-        // Root directory listing
-        if (target_len == 0) {
-            // Child must not contain '/', implies it's top level
-            if (strchr(curr->path, '/') == NULL) {
-                is_child = 1;
-            }
-        } 
-        // Subdirectory listing
-        else {
-            // Check if curr->path starts with "target_dir/"
-            if (strncmp(curr->path, target_dir, target_len) == 0 && 
-                curr->path[target_len] == '/') {
-                
-                // Ensure it is a direct child (no more slashes after the one we just found)
-                char *ptr_after_slash = curr->path + target_len + 1;
-                if (strchr(ptr_after_slash, '/') == NULL) {
-                    is_child = 1;
-                }
-            }
-        }
+    // With an overlay the upper directory is merged in, by path (a directory
+    // may be only there); path is only passed then, see main
+    if (upper_fd >= 0) {
+        struct FillContext fill = { buffer, filler };
+        list_merged(upper_path(path), fill_name, &fill);
+        return 0;
+    }
 
-        if (is_child) {
-            // Extract filename from full path
-            char *filename = curr->path;
-            if (target_len > 0) {
-                filename = curr->path + target_len + 1;
-            }
-            filler(buffer, filename, NULL, 0);
-        }
+    // A member may turn up anywhere in the archive, so a listing is only
+    // complete once the scan is
+    int locked = lock_tree();
+    while (!__atomic_load_n(&scan_complete, __ATOMIC_ACQUIRE)) {
+        pthread_cond_wait(&scan_progress, &scan_lock);
+    }
+    unlock_tree(locked);
 
-        curr = curr->next;
+    for (int i = 0; i < dir->num_children; i++) {
+        filler(buffer, dir->children[i]->name, NULL, 0);
     }
 
     return 0;
 }
 
-int my_read(const char *path, char *buffer, size_t size, off_t offset,
-                    struct fuse_file_info *fi) {
-    (void) fi;
-
-    struct TarNode *node = get_node(path);
-    if (!node) return -ENOENT;
-    
+// Clamp a read of size bytes at offset to the file's data.
+// Returns the number of bytes to read or a negative errno.
+long read_extent(struct TarNode *node, size_t size, off_t offset) {
     // Check if trying to read a directory
     if (node->type == '5') return -EISDIR;
 
     // Adjust size to avoid reading past EOF
-    if (offset >= node->size) return 0;
-    if (offset + size > node->size) {
+    if (offset < 0) return -EINVAL;
+    if ((uint64_t)offset >= node->size) return 0;
+    if (size > node->size - offset) {
         size = node->size - offset;
     }
+    return size;
+}
 
-    FILE *fp = fopen(TAR_FILE, "rb");
-    if (!fp) return -EIO;
+// Read len bytes at offset of a sparse file: data regions come from the
+// archive and holes are zero-filled, so they never take space anywhere
+long read_sparse(const struct Extent *extents, int num_extents, char *buffer,
+                 size_t len, uint64_t offset) {
+    // First region ending after offset
+    int lo = 0, hi = num_extents;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (extents[mid].offset + extents[mid].length <= offset) lo = mid + 1;
+        else hi = mid;
+    }
 
-    // Seek to the exact position: Data Start + Offset
-    fseek(fp, node->data_offset + offset, SEEK_SET);
-    
-    size_t res = fread(buffer, 1, size, fp);
-    fclose(fp);
+    size_t done = 0;
+    for (int i = lo; done < len; ) {
+        uint64_t at = offset + done;
+        if (i < num_extents && extents[i].offset + extents[i].length <= at) {
+            i++;    // Overlapping regions in a broken map
+            continue;
+        }
+        if (i == num_extents || extents[i].offset > at) {
+            uint64_t hole = i < num_extents ? extents[i].offset - at : len - done;
+            size_t n = hole < len - done ? hole : len - done;
+            memset(buffer + done, 0, n);
+            done += n;
+            continue;
+        }
 
-    return res;
+        uint64_t left = extents[i].offset + extents[i].length - at;
+        size_t n = left < len - done ? left : len - done;
+        long res = archive_pread(buffer + done, n,
+                                 extents[i].data_offset + (at - extents[i].offset));
+        if (res < 0) return res;
+        done += res;
+        if ((size_t)res < n) break; // Truncated archive
+        i++;
+    }
+    return done;
+}
+
+// Read from an archive member, for my_read and copy-ups
+long read_node(struct TarNode *node, char *buffer, size_t size, off_t offset) {
+    int locked = lock_tree();
+    long len = read_extent(node, size, offset);
+    uint64_t pos = node->data_offset + offset;
+    const struct Extent *extents = node->extents;
+    int num_extents = node->num_extents;
+    const char *inline_data = node->inline_data;
+    unlock_tree(locked);
+    if (len <= 0) return len;
+
+    if (inline_data) {
+        memcpy(buffer, inline_data + offset, len);
+        return len;
+    }
+    if (extents) return read_sparse(extents, num_extents, buffer, len, offset);
+
+    // Read from the exact position: Data Start + Offset
+    return archive_pread(buffer, len, pos);
+}
+
+int my_read(const char *path, char *buffer, size_t size, off_t offset,
+                    struct fuse_file_info *fi) {
+    (void) path;
+
+    if (FI_IS_FD(fi)) {
+        ssize_t res = pread(FI_FD(fi), buffer, size, offset);
+        return res < 0 ? -errno : res;
+    }
+
+    struct TarNode *node = FI_NODE(fi);
+    if (node == &stats_node) {
+        char text[512];
+        int len = format_stats(text, sizeof(text));
+        if (offset >= len) return 0;
+        if (size > (size_t)(len - offset)) size = len - offset;
+        memcpy(buffer, text + offset, size);
+        return size;
+    }
+    return read_node(node, buffer, size, offset);
+}
+
+// Same as my_read, but for reads of a whole cache block or more hands FUSE
+// the archive fd and position instead of copying the data, so it can be
+// spliced into the reply without a copy through our buffer. Smaller reads
+// go through the block cache, where their neighbours are likely to be too.
+// Only used for uncompressed archives. Files in the upper directory are
+// handed over as an fd too.
+int my_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size,
+                off_t offset, struct fuse_file_info *fi) {
+    if (FI_IS_FD(fi)) {
+        struct fuse_bufvec *bufvec = malloc(sizeof(struct fuse_bufvec));
+        if (!bufvec) return -ENOMEM;
+        *bufvec = FUSE_BUFVEC_INIT(size);
+        bufvec->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+        bufvec->buf[0].fd = FI_FD(fi);
+        bufvec->buf[0].pos = offset;
+        *bufp = bufvec; // Freed by FUSE
+        return 0;
+    }
+
+    struct TarNode *node = FI_NODE(fi);
+    int locked = lock_tree();
+    long len = read_extent(node, size, offset);
+    uint64_t pos = node->data_offset + offset;
+    int splice = node != &stats_node && !node->extents && !node->inline_data &&
+                 layers[node->layer].format == FORMAT_TAR && len >= CACHE_BLOCK;
+    unlock_tree(locked);
+    if (len < 0) return len;
+
+    struct fuse_bufvec *bufvec = malloc(sizeof(struct fuse_bufvec));
+    if (!bufvec) return -ENOMEM;
+
+    *bufvec = FUSE_BUFVEC_INIT(len);
+
+    // Sparse files mix archive data and zeros, so they are assembled in
+    // memory too. Inline data is copied, FUSE frees the buffer.
+    if (!splice) {
+        char *data = malloc(size);
+        int res = data ? my_read(path, data, size, offset, fi) : -ENOMEM;
+        if (res < 0) {
+            free(data);
+            free(bufvec);
+            return res;
+        }
+        bufvec->buf[0].size = res;
+        bufvec->buf[0].mem = data;
+        *bufp = bufvec; // Both freed by FUSE
+        return 0;
+    }
+    bufvec->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK | FUSE_BUF_FD_RETRY;
+    bufvec->buf[0].fd = layers[node->layer].fd;
+    bufvec->buf[0].pos = layer_pos(pos);
+    *bufp = bufvec; // Freed by FUSE
+
+    return 0;
 }
 
 int my_readlink(const char *path, char *buffer, size_t size) {
-    struct TarNode *node = get_node(path);
-    if (!node) return -ENOENT;
-    
-    if (node->type != '2') return -EINVAL; // Not a symlink
+    if (upper_fd >= 0) {
+        ssize_t len = readlinkat(upper_fd, upper_path(path), buffer, size - 1);
+        if (len >= 0) {
+            buffer[len] = '\0';
+            return 0;
+        }
+        if (errno != ENOENT) return -errno;
+    }
+
+    int locked = lock_tree();
+    struct TarNode *node = visible_node(path);
+    int ret = 0;
+
+    if (!node) {
+        ret = -ENOENT;
+    } else if (node->type != '2') {
+        ret = -EINVAL; // Not a symlink
+    } else {
+        // Copy linkname to buffer, ensure null termination
+        strncpy((char *)buffer, node->linkname, size - 1);
+        ((char *)buffer)[size - 1] = '\0';
+    }
 
-    // Copy linkname to buffer, ensure null termination
-    strncpy((char *)buffer, node->linkname, size - 1);
-    ((char *)buffer)[size - 1] = '\0';
+    unlock_tree(locked);
+    return ret;
+}
+
+// The rest change the tree, all in the upper directory. They are only
+// registered with -o upper.
+
+int my_write(const char *path, const char *buffer, size_t size, off_t offset,
+             struct fuse_file_info *fi) {
+    (void) path;
+    if (!FI_IS_FD(fi)) return -EBADF;
+    ssize_t res = pwrite(FI_FD(fi), buffer, size, offset);
+    return res < 0 ? -errno : res;
+}
 
+int my_release(const char *path, struct fuse_file_info *fi) {
+    (void) path;
+    if (FI_IS_FD(fi)) close(FI_FD(fi));
     return 0;
 }
 
+int my_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+    (void) path;
+    if (!FI_IS_FD(fi)) return 0;
+    int res = datasync ? fdatasync(FI_FD(fi)) : fsync(FI_FD(fi));
+    return res < 0 ? -errno : 0;
+}
+
+int my_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+    if (reserved_name(path)) return -EPERM;
+    const char *rel = upper_path(path);
+
+    pthread_mutex_lock(&overlay_lock);
+    int res;
+    if (!upper_exists(rel, NULL) && archive_type(rel)) {
+        res = (fi->flags & O_EXCL) ? -EEXIST : copy_up(rel, !(fi->flags & O_TRUNC));
+    } else {
+        res = prepare_create(rel);
+    }
+    if (res >= 0) {
+        int fd = openat(upper_fd, rel, fi->flags | O_CREAT, mode);
+        res = fd < 0 ? -errno : 0;
+        if (fd >= 0) fi->fh = FD_FH(fd);
+    }
+    pthread_mutex_unlock(&overlay_lock);
+    return res;
+}
+
+int my_mkdir(const char *path, mode_t mode) {
+    if (reserved_name(path)) return -EPERM;
+    const char *rel = upper_path(path);
+
+    pthread_mutex_lock(&overlay_lock);
+    int res = upper_exists(rel, NULL) || archive_type(rel) ? -EEXIST :
+              prepare_create(rel);
+    int whiteout = res == 1;
+    if (res >= 0) res = mkdirat(upper_fd, rel, mode) < 0 ? -errno : 0;
+    // It replaces a removed directory, whose contents stay hidden
+    if (res == 0 && whiteout) res = make_opaque(rel);
+    pthread_mutex_unlock(&overlay_lock);
+    return res;
+}
+
+int my_symlink(const char *target, const char *path) {
+    if (reserved_name(path)) return -EPERM;
+    const char *rel = upper_path(path);
+
+    pthread_mutex_lock(&overlay_lock);
+    int res = upper_exists(rel, NULL) || archive_type(rel) ? -EEXIST :
+              prepare_create(rel);
+    if (res >= 0) res = symlinkat(target, upper_fd, rel) < 0 ? -errno : 0;
+    pthread_mutex_unlock(&overlay_lock);
+    return res;
+}
+
+int my_link(const char *from, const char *to) {
+    if (reserved_name(to)) return -EPERM;
+    const char *src = upper_path(from), *dst = upper_path(to);
+
+    pthread_mutex_lock(&overlay_lock);
+    int res = upper_exists(dst, NULL) || archive_type(dst) ? -EEXIST :
+              copy_up(src, 1);
+    if (res == 0) res = prepare_create(dst);
+    if (res >= 0) res = linkat(upper_fd, src, upper_fd, dst, 0) < 0 ? -errno : 0;
+    pthread_mutex_unlock(&overlay_lock);
+    return res;
+}
+
+int my_unlink(const char *path) {
+    const char *rel = upper_path(path);
+    mode_t mode;
+
+    pthread_mutex_lock(&overlay_lock);
+    int in_upper = upper_exists(rel, &mode);
+    int type = archive_type(rel);
+    int res = 0;
+    if (!in_upper && !type) res = -ENOENT;
+    else if (in_upper ? S_ISDIR(mode) : type == '5') res = -EISDIR;
+    else if (in_upper && unlinkat(upper_fd, rel, 0) < 0) res = -errno;
+    // Or the archive's copy would show through again
+    if (res == 0 && type) res = add_whiteout(rel);
+    pthread_mutex_unlock(&overlay_lock);
+    return res;
+}
+
+int my_rmdir(const char *path) {
+    const char *rel = upper_path(path);
+    mode_t mode;
+    if (strcmp(rel, ".") == 0) return -EBUSY;
+
+    pthread_mutex_lock(&overlay_lock);
+    int in_upper = upper_exists(rel, &mode);
+    int type = archive_type(rel);
+    int res = 0;
+    if (!in_upper && !type) res = -ENOENT;
+    else if (in_upper ? !S_ISDIR(mode) : type != '5') res = -ENOTDIR;
+    else if (list_merged(rel, NULL, NULL) > 0) res = -ENOTEMPTY;
+    else if (in_upper) {
+        clear_whiteouts(rel);
+        if (unlinkat(upper_fd, rel, AT_REMOVEDIR) < 0) res = -errno;
+    }
+    if (res == 0 && type) res = add_whiteout(rel);
+    pthread_mutex_unlock(&overlay_lock);
+    return res;
+}
+
+int my_rename(const char *from, const char *to) {
+    if (reserved_name(to)) return -EPERM;
+    const char *src = upper_path(from), *dst = upper_path(to);
+    if (strcmp(src, dst) == 0) return 0;
+    mode_t src_mode, dst_mode;
+
+    pthread_mutex_lock(&overlay_lock);
+    int src_upper = upper_exists(src, &src_mode);
+    int src_type = archive_type(src);
+    int dst_upper = upper_exists(dst, &dst_mode);
+    int dst_type = archive_type(dst);
+    int src_dir = src_upper ? S_ISDIR(src_mode) : src_type == '5';
+    int dst_dir = dst_upper ? S_ISDIR(dst_mode) : dst_type == '5';
+
+    int res = 0;
+    if (!src_upper && !src_type) {
+        res = -ENOENT;
+    } else if (src_dir && src_type == '5' && !is_opaque(src)) {
+        // What the archive holds below it cannot move along; mv and the
+        // like copy the directory instead
+        res = -EXDEV;
+    } else if (dst_upper || dst_type) {
+        if (src_dir && !dst_dir) res = -ENOTDIR;
+        else if (!src_dir && dst_dir) res = -EISDIR;
+        else if (dst_dir && list_merged(dst, NULL, NULL) > 0) res = -ENOTEMPTY;
+        else if (dst_dir && dst_upper) clear_whiteouts(dst);
+    }
+
+    int whiteout = 0;
+    if (res == 0) res = copy_up(src, 1);
+    if (res == 0) {
+        res = prepare_create(dst);
+        whiteout = res == 1;
+    }
+    if (res >= 0) res = renameat(upper_fd, src, upper_fd, dst) < 0 ? -errno : 0;
+    if (res == 0 && src_type) res = add_whiteout(src);
+    // A directory moved over one of the archive's hides what that held
+    if (res == 0 && src_dir && (dst_type || whiteout)) res = make_opaque(dst);
+    pthread_mutex_unlock(&overlay_lock);
+    return res;
+}
+
+int my_truncate(const char *path, off_t size) {
+    const char *rel = upper_path(path);
+
+    pthread_mutex_lock(&overlay_lock);
+    int res = copy_up(rel, size > 0);
+    if (res == 0) {
+        int fd = openat(upper_fd, rel, O_WRONLY);
+        if (fd < 0 || ftruncate(fd, size) < 0) res = -errno;
+        if (fd >= 0) close(fd);
+    }
+    pthread_mutex_unlock(&overlay_lock);
+    return res;
+}
+
+int my_chmod(const char *path, mode_t mode) {
+    const char *rel = upper_path(path);
+
+    pthread_mutex_lock(&overlay_lock);
+    int res = copy_up(rel, 1);
+    if (res == 0 && fchmodat(upper_fd, rel, mode, 0) < 0) res = -errno;
+    pthread_mutex_unlock(&overlay_lock);
+    return res;
+}
+
+int my_chown(const char *path, uid_t uid, gid_t gid) {
+    const char *rel = upper_path(path);
+
+    pthread_mutex_lock(&overlay_lock);
+    int res = copy_up(rel, 1);
+    if (res == 0 && fchownat(upper_fd, rel, uid, gid, AT_SYMLINK_NOFOLLOW) < 0) {
+        res = -errno;
+    }
+    pthread_mutex_unlock(&overlay_lock);
+    return res;
+}
+
+int my_utimens(const char *path, const struct timespec ts[2]) {
+    const char *rel = upper_path(path);
+
+    pthread_mutex_lock(&overlay_lock);
+    int res = copy_up(rel, 1);
+    if (res == 0 && utimensat(upper_fd, rel, ts, AT_SYMLINK_NOFOLLOW) < 0) {
+        res = -errno;
+    }
+    pthread_mutex_unlock(&overlay_lock);
+    return res;
+}
+
+void *my_init(struct fuse_conn_info *conn) {
+    // Let the kernel keep more readahead in flight across worker threads,
+    // and splice read_buf replies straight from the archive
+    conn->max_background = MAX_BACKGROUND;
+    conn->congestion_threshold = CONGESTION_THRESHOLD;
+    conn->want |= conn->capable & (FUSE_CAP_ASYNC_READ |
+                                   FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+
+    // Without it every read is on demand
+    if (pthread_create(&readahead_thread, NULL, readahead_main, NULL) == 0) {
+        readahead_running = 1;
+    } else {
+        perror("pthread_create");
+    }
+
+    // Without a usable index, scan now that FUSE has daemonized (threads
+    // started before the fork would not survive it)
+    if (!scan_complete) {
+        if (pthread_create(&scan_thread, NULL, scan_main, NULL) == 0) {
+            scan_running = 1;
+        } else {
+            perror("pthread_create");
+            scan_layers();
+        }
+    }
+    return NULL;
+}
+
+void my_destroy(void *private_data) {
+    (void) private_data;
+    if (scan_running) {
+        // A commit needs the whole archive, unmounting waits for it then
+        if (!options.commit) __atomic_store_n(&scan_stop, 1, __ATOMIC_RELAXED);
+        pthread_join(scan_thread, NULL);
+    }
+    if (options.commit) commit_tree();
+    if (readahead_running) {
+        pthread_mutex_lock(&readahead_lock);
+        readahead_stop = 1;
+        pthread_cond_signal(&readahead_wake);
+        pthread_mutex_unlock(&readahead_lock);
+        pthread_join(readahead_thread, NULL);
+    }
+}
+
 int main(int argc, char *argv[])
 {
     memset(&op, 0, sizeof(op)); 
+    op.init = my_init;
+    op.destroy = my_destroy;
     op.getattr = my_getattr;
+    op.open = my_open;
+    op.opendir = my_opendir;
     op.readdir = my_readdir;
     op.read = my_read;
+    op.read_buf = my_read_buf;
     op.readlink = my_readlink;
-    
-    // Parse encryption/tar file
-    parse_tar_file();
+    op.flag_nopath = 1;     // read/readdir only use the node in fi->fh
+
+    // Our defaults go first so options given on the command line override
+    // them. FUSE runs multithreaded unless -s is passed. Our own options
+    // (see struct Options) are taken out here.
+    struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
+    fuse_opt_add_arg(&args, argv[0]);
+    fuse_opt_add_arg(&args, FUSE_DEFAULT_OPTS);
+    for (int i = 1; i < argc; i++) {
+        fuse_opt_add_arg(&args, argv[i]);
+    }
+    if (fuse_opt_parse(&args, &options, option_spec, NULL) < 0) {
+        return 1;
+    }
+    if (options.inline_max > INLINE_MAX_LIMIT) {
+        fprintf(stderr, "inline_max is limited to %d bytes\n", INLINE_MAX_LIMIT);
+        return 1;
+    }
+
+    // Open encryption/tar files and load their indexes from the top. The
+    // first layer without one and those below it are scanned in the
+    // background once FUSE is up (see my_init).
+    open_archives();
+    int i = num_layers - 1;
+    while (i >= 0 && load_index(&layers[i]) == 0) i--;
+    scan_from = i;
+    if (scan_from < 0) {
+        scan_complete = 1;
+    } else if (layers[i].format == FORMAT_XZ && read_xz_index(&layers[i]) < 0) {
+        fprintf(stderr, "Cannot read the xz index of %s\n", layers[i].name);
+        exit(1);
+    }
+    op.read_buf = NULL;
+    for (i = 0; i < num_layers; i++) {
+        if (layers[i].format == FORMAT_TAR) op.read_buf = my_read_buf;
+    }
+
+    if (options.upper) {
+        upper_fd = open(options.upper, O_RDONLY | O_DIRECTORY);
+        if (upper_fd < 0) {
+            fprintf(stderr, "Cannot open %s: %s\n", options.upper, strerror(errno));
+            return 1;
+        }
+        op.write = my_write;
+        op.release = my_release;
+        op.fsync = my_fsync;
+        op.create = my_create;
+        op.mkdir = my_mkdir;
+        op.symlink = my_symlink;
+        op.link = my_link;
+        op.unlink = my_unlink;
+        op.rmdir = my_rmdir;
+        op.rename = my_rename;
+        op.truncate = my_truncate;
+        op.chmod = my_chmod;
+        op.chown = my_chown;
+        op.utimens = my_utimens;
+        op.flag_nopath = 0; // readdir merges the upper directory by path
+    }
+    // FUSE changes to / when it daemonizes
+    if (options.commit && options.commit[0] != '/') {
+        char *cwd = getcwd(NULL, 0);
+        char *commit = cwd ? malloc(strlen(cwd) + strlen(options.commit) + 2) : NULL;
+        if (!commit) {
+            perror("getcwd");
+            return 1;
+        }
+        sprintf(commit, "%s/%s", cwd, options.commit);
+        free(cwd);
+        options.commit = commit;
+    }
 
-    return fuse_main(argc, argv, &op, NULL);
+    int ret = fuse_main(args.argc, args.argv, &op, NULL);
+    fuse_opt_free_args(&args);
+    return ret;
 }
\ No newline at end of file
@@ -0,0 +1,229 @@
+/*
+ Read throughput benchmark for the tar filesystem.
+
+ Compilation:
+ gcc -O2 bench.c -o bench -pthread
+
+ Usage:
+ ./bench [-b block_size] [-n random_reads] [-j threads] [-s seed] <dir>
+
+ Walks <dir> (the tarfs mount point, or the same archive extracted with
+ tar -x for comparison) and reports two passes:
+ sequential  every regular file read from start to end in block_size reads
+ random      random_reads preads of block_size at block-aligned offsets,
+             files picked in proportion to their size
+ With -j the passes run on that many concurrent reader threads. The files
+ of the sequential pass and the random reads are split between the threads,
+ and the reported throughput is the total for all of them.
+
+ The kernel keeps pages of files it has already read, so only the first
+ run after mounting measures the filesystem itself.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>      // nftw
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>     // clock_gettime
+#include <unistd.h>   // pread, getopt
+
+struct file_entry {
+    char *path;
+    long size;
+    long start; // Sum of the sizes of all files before this one
+};
+
+struct file_entry *files = NULL;
+int num_files = 0;
+int max_files = 0;
+long total_size = 0;
+
+// Collect every regular file under the benchmark directory
+int add_file(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    (void) ftw;
+    if (flag != FTW_F || !S_ISREG(st->st_mode)) return 0;
+
+    if (num_files == max_files) {
+        max_files = max_files ? max_files * 2 : 1024;
+        files = realloc(files, max_files * sizeof(struct file_entry));
+        if (!files) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    files[num_files].path = strdup(path);
+    files[num_files].size = st->st_size;
+    files[num_files].start = total_size;
+    total_size += st->st_size;
+    num_files++;
+    return 0;
+}
+
+struct reader {
+    pthread_t thread;
+    int id;
+    char *buffer;
+    unsigned long long rng_state; // xorshift64, seeded from -s and id
+    long reads;
+    long bytes;
+};
+
+size_t block_size = 128 * 1024;
+long num_reads = 10000;
+int num_threads = 1;
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void report(const char *name, long reads, long bytes, double seconds) {
+    printf("%-10s %9ld reads %12ld bytes %8.3f s %10.2f MB/s %10.0f reads/s\n",
+           name, reads, bytes, seconds, bytes / seconds / (1 << 20),
+           reads / seconds);
+}
+
+// Read every num_threads-th file from start to end
+void *sequential_reader(void *arg) {
+    struct reader *r = arg;
+
+    for (int i = r->id; i < num_files; i += num_threads) {
+        int fd = open(files[i].path, O_RDONLY);
+        if (fd < 0) {
+            perror(files[i].path);
+            continue;
+        }
+        ssize_t res;
+        while ((res = read(fd, r->buffer, block_size)) > 0) {
+            r->reads++;
+            r->bytes += res;
+        }
+        if (res < 0) perror(files[i].path);
+        close(fd);
+    }
+    return NULL;
+}
+
+unsigned long long next_random(struct reader *r) {
+    r->rng_state ^= r->rng_state << 13;
+    r->rng_state ^= r->rng_state >> 7;
+    r->rng_state ^= r->rng_state << 17;
+    return r->rng_state;
+}
+
+// File containing byte pos of the concatenation of all files
+int file_at(long pos) {
+    int lo = 0, hi = num_files - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (files[mid].start <= pos) lo = mid;
+        else hi = mid - 1;
+    }
+    return lo;
+}
+
+// Read single blocks at random places
+void *random_reader(void *arg) {
+    struct reader *r = arg;
+    long count = num_reads / num_threads + (r->id < num_reads % num_threads);
+
+    for (long n = 0; n < count; n++) {
+        int i = file_at(next_random(r) % total_size);
+        long offset = next_random(r) % files[i].size / block_size * block_size;
+
+        // Files are reopened for each read, as many small readers would do
+        int fd = open(files[i].path, O_RDONLY);
+        if (fd < 0) {
+            perror(files[i].path);
+            continue;
+        }
+        ssize_t res = pread(fd, r->buffer, block_size, offset);
+        if (res < 0) perror(files[i].path);
+        else r->bytes += res;
+        r->reads++;
+        close(fd);
+    }
+    return NULL;
+}
+
+// Run one pass on every reader and report the totals
+void run_pass(const char *name, void *(*pass)(void *), struct reader *readers) {
+    long reads = 0, bytes = 0;
+    double start = now();
+
+    for (int i = 0; i < num_threads; i++) {
+        readers[i].reads = readers[i].bytes = 0;
+        if (pthread_create(&readers[i].thread, NULL, pass, &readers[i]) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(readers[i].thread, NULL);
+        reads += readers[i].reads;
+        bytes += readers[i].bytes;
+    }
+
+    report(name, reads, bytes, now() - start);
+}
+
+void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-b block_size] [-n random_reads] [-j threads] "
+            "[-s seed] <dir>\n",
+            prog);
+}
+
+int main(int argc, char *argv[]) {
+    unsigned long long seed = 88172645463325252ULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "b:n:j:s:")) != -1) {
+        switch (opt) {
+        case 'b': block_size = atol(optarg); break;
+        case 'n': num_reads = atol(optarg); break;
+        case 'j': num_threads = atoi(optarg); break;
+        case 's': seed = strtoull(optarg, NULL, 10); break;
+        default: usage(argv[0]); return 1;
+        }
+    }
+    if (optind != argc - 1 || block_size == 0 || num_threads < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (nftw(argv[optind], add_file, 64, FTW_PHYS) != 0) {
+        perror(argv[optind]);
+        return 1;
+    }
+    printf("%d files, %ld bytes, %zu byte reads, %d threads\n", num_files,
+           total_size, block_size, num_threads);
+    if (total_size == 0) return 0;
+
+    struct reader *readers = calloc(num_threads, sizeof(struct reader));
+    for (int i = 0; i < num_threads; i++) {
+        readers[i].id = i;
+        readers[i].rng_state = (seed + i * 0x9E3779B97F4A7C15ULL) | 1;
+        readers[i].buffer = malloc(block_size);
+        if (!readers[i].buffer) {
+            perror("malloc");
+            return 1;
+        }
+    }
+
+    run_pass("sequential", sequential_reader, readers);
+    run_pass("random", random_reader, readers);
+
+    for (int i = 0; i < num_threads; i++) {
+        free(readers[i].buffer);
+    }
+    free(readers);
+    return 0;
+}